@@ -108,6 +108,33 @@ public:
             index, path, argv, argc, nullptr, 0, options ) };
     }
 
+    /**
+     * @brief parseTranslationUnit creates a TranslationUnit from the given
+     * source file and arguments, reading some files from memory.
+     * @param index The CXIndex to use to create the translation unit
+     * @param path A path to the source file to parse
+     * @param argc The number of arguments in `argv`
+     * @param argv The command line-argumetns to pass to clang
+     * @param files The UnsavedFile objects whose contents replace the files
+     * on disk with the same names
+     * @param options The options for the parse
+     * @return A TranslationUnit created from the given arguments
+     */
+    static TranslationUnit parseTranslationUnit( CXIndex index, const char* path, int argc,
+                                      const char* const* argv,
+                                      const std::vector<UnsavedFile>& files,
+                                      unsigned options = 0 )
+    {
+        std::vector<CXUnsavedFile> passfiles;
+        std::transform( begin( files ), end( files ),
+                        std::back_inserter( passfiles ),
+                        []( const UnsavedFile& f )
+                        { return f.handle(); } );
+        return TranslationUnit{ clang_parseTranslationUnit(
+            index, path, argv, argc, passfiles.data(),
+            unsigned( passfiles.size() ), options ) };
+    }
+
     /**
      * @brief createFromSourceString Creates a set of CXUnsavedFile objects
      * and uses them to produce a TranslationUnit object
@@ -181,11 +208,12 @@ public:
      * @param path The path to the file to create and save to
      * @param options The options to use when saving
      * @todo Document `options` for saving
+     * @return The result of `clang_saveTranslationUnit`, a `CXSaveError`
      */
-    void save( std::string path, unsigned options = 0 ) const
+    int save( std::string path, unsigned options = 0 ) const
     {
         throwIfInvalid( "Cannot save null TranslationUnit" );
-        clang_saveTranslationUnit( ptr(), path.data(), options );
+        return clang_saveTranslationUnit( ptr(), path.data(), options );
     }
 
     /// Returns the results from clang_defaultReparseOptions for this
@@ -216,38 +244,73 @@ public:
             ptr(), unsigned( passfiles.size() ), passfiles.data(), options );
     }
 
-    /// @TODO implement the resource usage stuff
-    //    struct ResourceUsage
-    //    {
-    //        struct CXTUResourceUsage_deleter
-    //        {
-    //            void operator()( CXTUResourceUsage* ptr )
-    //            {
-    //                clang_disposeCXTUResourceUsage( *ptr );
-    //                delete ptr;
-    //            }
-    //        };
-
-    //        std::unique_ptr<CXTUResourceUsage, CXTUResourceUsage_deleter>
-    // handle;
-    //    };
-
-    //    auto resourceUsageName() const
-    //    {
-    //        auto usage = resourceUsage();
-    //        return make_clang_string( clang_getTUResourceUsageName(
-    // usage.handle.get()->kind ) );
-    //    }
-
-    //    ResourceUsage resourceUsage() const
-    //    {
-    //        ResourceUsage item;
-    //        auto handle = clang_getCXTUResourceUsage( ptr() );
-    //        std::unique_ptr<CXTUResourceUsage,
-    //                        ResourceUsage::CXTUResourceUsage_deleter> ptr;
-    //        ptr.reset( new decltype( handle )( handle ) );
-    //        return { std::move( ptr ) };
-    //    }
+    /**
+     * @brief Returns the files that were read while parsing this translation
+     * unit, the main file included, using clang_getInclusions
+     * @return A vector of File objects, one for each file
+     */
+    std::vector<File> inclusions() const
+    {
+        throwIfInvalid( "Cannot get inclusions of null TranslationUnit" );
+        std::vector<File> files;
+        clang_getInclusions( ptr(),
+                             []( CXFile included, CXSourceLocation*, unsigned,
+                                 CXClientData data )
+                             {
+                                 static_cast<std::vector<File>*>( data )
+                                     ->emplace_back( included );
+                             },
+                             &files );
+        return files;
+    }
+
+    /**
+     * @brief The memory used by a translation unit, as reported by
+     * clang_getCXTUResourceUsage, broken down by what it is used for
+     */
+    struct ResourceUsage
+    {
+        /// The amount of memory used for one purpose
+        struct Entry
+        {
+            /// What the memory is used for
+            CXTUResourceUsageKind kind;
+            /// The number of bytes used
+            unsigned long amount;
+
+            /// Returns a human-readable name for kind
+            string name() const { return clang_getTUResourceUsageName( kind ); }
+        };
+
+        /// One Entry for each kind of memory the translation unit uses
+        std::vector<Entry> entries;
+
+        /// Returns the total number of bytes used, of all kinds
+        unsigned long total() const
+        {
+            unsigned long ret = 0;
+            for ( const auto& e : entries ) ret += e.amount;
+            return ret;
+        }
+    };
+
+    /**
+     * @brief Returns the memory used by this translation unit
+     * @return A ResourceUsage with an Entry for each kind of memory
+     */
+    ResourceUsage resourceUsage() const
+    {
+        throwIfInvalid( "Cannot get resource usage of null TranslationUnit" );
+        auto handle = clang_getCXTUResourceUsage( ptr() );
+        ResourceUsage ret;
+        for ( unsigned i = 0; i < handle.numEntries; ++i )
+        {
+            ret.entries.push_back(
+                { handle.entries[i].kind, handle.entries[i].amount } );
+        }
+        clang_disposeCXTUResourceUsage( handle );
+        return ret;
+    }
 
     /*
     static TranslationUnit create( CXIndex index, const char* path )
@@ -390,6 +453,19 @@ public:
         return Location{ clang_getLocation( ptr(), file( filename() ).file(), line, col ) };
     }
 
+    /**
+     * @brief Returns a Location object for a byte offset into the main file
+     * of the TranslationUnit
+     * @param offset The offset, in bytes, from the start of the file
+     * @return A Location object at the requested offset
+     */
+    Location locationAtOffset( unsigned offset )
+    {
+        throwIfInvalid( "Cannot get location in null TranslationUnit" );
+        return Location{ clang_getLocationForOffset(
+            ptr(), file( filename() ).file(), offset ) };
+    }
+
     /**
      * @brief file Get a File object with the specified name associated with
      * this translation unit
@@ -581,6 +657,18 @@ struct Diagnostic
     /// source file location
     Location location() const { return clang_getDiagnosticLocation( ptr() ); }
 
+    /// Returns the source ranges that the diagnostic highlights. May be empty
+    std::vector<SourceRange> ranges() const
+    {
+        std::vector<SourceRange> ret;
+        const auto count = clang_getDiagnosticNumRanges( ptr() );
+        for ( unsigned i = 0; i < count; ++i )
+        {
+            ret.emplace_back( clang_getDiagnosticRange( ptr(), i ) );
+        }
+        return ret;
+    }
+
     /// Generates a DiagnosticSet that represents the children of the
     /// diagnostic. Children are things such as backtraces from failed template
     /// instantiations or macro expansions
@@ -0,0 +1,86 @@
+#ifndef CLS_JSON_RPC_CANCELLATION_HPP_INCLUDED
+#define CLS_JSON_RPC_CANCELLATION_HPP_INCLUDED
+
+#include "error.hpp"
+
+#include <json.hpp>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace json_rpc {
+
+using nlohmann::json;
+
+/**
+ * Lets long-running work notice that its result is no longer wanted.
+ * Handlers should poll it between units of work and bail out with
+ * `throw_if_cancelled()`. A default-constructed token is never cancelled.
+ */
+class cancellation_token {
+    std::shared_ptr<const std::atomic_bool> _flag;
+    friend class cancellation_registry;
+
+public:
+    cancellation_token() = default;
+    explicit cancellation_token(std::shared_ptr<const std::atomic_bool> flag)
+        : _flag(std::move(flag)) {}
+
+    bool cancelled() const { return _flag && _flag->load(std::memory_order_relaxed); }
+
+    void throw_if_cancelled() const {
+        if (cancelled())
+            throw request_cancelled{};
+    }
+};
+
+/**
+ * Tracks in-flight requests by ID so that `$/cancelRequest` can reach the
+ * token handed to their handler. A client may reuse the ID of a request that
+ * is still running, so each dispatch gets an entry of its own.
+ */
+class cancellation_registry {
+    std::mutex _lock;
+    std::multimap<std::string, std::shared_ptr<std::atomic_bool>> _in_flight;
+
+    // IDs may be numbers or strings, so key on their serialized form
+    static std::string _key(const json& id) { return id.dump(); }
+
+public:
+    cancellation_token add(const json& id) {
+        auto flag = std::make_shared<std::atomic_bool>(false);
+        std::lock_guard<std::mutex> lk{ _lock };
+        _in_flight.emplace(_key(id), flag);
+        return cancellation_token{ flag };
+    }
+
+    /// Forget the request that `add` handed `token` to, leaving any other
+    /// request with the same ID alone
+    void remove(const json& id, const cancellation_token& token) {
+        std::lock_guard<std::mutex> lk{ _lock };
+        const auto range = _in_flight.equal_range(_key(id));
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (iter->second == token._flag) {
+                _in_flight.erase(iter);
+                return;
+            }
+        }
+    }
+
+    /// Cancels every request in flight with that ID. Returns false if there
+    /// is none
+    bool cancel(const json& id) {
+        std::lock_guard<std::mutex> lk{ _lock };
+        const auto range = _in_flight.equal_range(_key(id));
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            *iter->second = true;
+        }
+        return range.first != range.second;
+    }
+};
+}
+
+#endif  // CLS_JSON_RPC_CANCELLATION_HPP_INCLUDED
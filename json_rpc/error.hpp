@@ -0,0 +1,41 @@
+#ifndef CLS_JSON_RPC_ERROR_HPP_INCLUDED
+#define CLS_JSON_RPC_ERROR_HPP_INCLUDED
+
+#include <stdexcept>
+#include <string>
+
+namespace json_rpc {
+
+/// Error codes defined by JSON-RPC 2.0 and the language server protocol
+namespace error_code {
+enum : int {
+    parse_error = -32700,
+    invalid_request = -32600,
+    method_not_found = -32601,
+    invalid_params = -32602,
+    internal_error = -32603,
+    request_cancelled = -32800,
+};
+}
+
+/// An error that is reported back to the peer with its code
+class error : public std::runtime_error {
+    int _code = -1;
+
+public:
+    error(int code, std::string msg)
+        : runtime_error(msg)
+        , _code{ code } {}
+
+    int code() const { return _code; }
+};
+
+/// Thrown from a handler that noticed its request was cancelled
+class request_cancelled : public error {
+public:
+    request_cancelled()
+        : error(error_code::request_cancelled, "Request cancelled") {}
+};
+}
+
+#endif  // CLS_JSON_RPC_ERROR_HPP_INCLUDED
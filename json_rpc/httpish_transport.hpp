@@ -6,9 +6,16 @@
 
 #include <json.hpp>
 
-#include <mutex>
+#include "logging.hpp"
+#include "message_buffer.hpp"
 
-static std::ofstream OUTPUT_STREAM{ "clang-languageservice.log" };
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace json_rpc {
 
@@ -19,99 +26,223 @@ using nlohmann::json;
 
 template <typename StreamTransport> class httpish_transport {
     StreamTransport _streamer;
-    using handler_type = std::function<boost::optional<boost::future<json>>(json)>;
+    /// Receives the body of each message, which is only valid during the call,
+    /// and may return the serialized response
+    using handler_type = std::function<boost::optional<boost::future<std::string>>(
+        const char* first, const char* last)>;
     handler_type _handler;
+    message_buffer _buffer{ _streamer.read_chunk_size() };
+    /// How far into the buffer we have already looked for the end of the headers
+    std::size_t _header_scan_pos = 0;
+
+    /// A framed message waiting for the writer thread
+    struct outgoing_message {
+        std::string header;
+        std::string body;
+    };
+    std::mutex _write_lock;
+    std::condition_variable _write_cond;
+    std::vector<outgoing_message> _write_queue;
+    bool _stop_writing = false;
+    std::thread _writer;
 
 public:
+    /// The largest message body accepted. A larger content-length aborts the
+    /// connection rather than have us try to buffer it
+    static const std::size_t max_message_size = std::size_t{ 1 } << 30;
+
     template <typename... Args>
     httpish_transport(Args&&... args)
-        : _streamer(std::forward<Args>(args)...) {}
+        : _streamer(std::forward<Args>(args)...) {
+        _writer = std::thread([this] { _write_messages(); });
+    }
+
+    ~httpish_transport() {
+        {
+            std::lock_guard<std::mutex> lk{ _write_lock };
+            _stop_writing = true;
+        }
+        _write_cond.notify_one();
+        _writer.join();
+    }
 
 private:
-    void _step1_read_headers() {
-        std::stringstream stream;
-        while (_streamer.read(stream)) {
-            auto off = stream.str().find("\r\n\r\n");
-            if (off != std::string::npos) {
-                const auto do_continue = _step2_parse_headers(off + 4, stream);
-                if (!do_continue)
-                    return;
-            }
+    /// Pull at least one more byte from the stream into the buffer. `want` is
+    /// the number of bytes we know we still need, so a body arrives in as few
+    /// reads as the stream allows. The space reserved for it grows with what
+    /// has actually arrived, so a client can't have us allocate a huge body
+    /// just by claiming one in its content-length.
+    bool _fill(std::size_t want) {
+        const auto min_chunk = _streamer.read_chunk_size();
+        const auto max_chunk = std::max(16 * min_chunk, _buffer.size());
+        const auto chunk = std::max(std::min(want, max_chunk), min_chunk);
+        const auto nread = _streamer.read(_buffer.prepare(chunk), chunk);
+        if (nread == 0)
+            return false;
+        _buffer.commit(nread);
+        return true;
+    }
+
+    /// Look for the blank line ending the header block, only scanning bytes we
+    /// haven't seen yet.
+    std::size_t _find_headers_end() {
+        static const char terminator[] = "\r\n\r\n";
+        const auto first = _buffer.data();
+        const auto last = first + _buffer.size();
+        const auto resume = _header_scan_pos > 3 ? _header_scan_pos - 3 : 0;
+        const auto found = std::search(first + resume, last, terminator, terminator + 4);
+        if (found == last) {
+            _header_scan_pos = _buffer.size();
+            return std::string::npos;
         }
+        _header_scan_pos = 0;
+        return static_cast<std::size_t>(found - first) + 4;
     }
 
-    bool _step2_parse_headers(std::size_t headers_size, std::stringstream& data) {
-        std::string line;
-        std::size_t content_length = 0;
-        while (true) {
-            std::getline(data, line);
-            boost::trim(line);
-            if (line.empty())
-                break;
-            boost::to_lower(line);
-            const auto content_length_pos = line.find("content-length:");
-            if (content_length_pos == 0) {
-                const auto colon_pos = line.find(':');
-                auto len = line.substr(colon_pos + 1);
-                boost::trim(len);
-                try {
-                    content_length = static_cast<std::size_t>(std::stoull(len));
-                } catch (...) {
-                    OUTPUT_STREAM << "Invalid content-length: " << len << "\n";
+    static bool _starts_with_icase(const char* first, const char* last, const char* prefix) {
+        for (; *prefix; ++first, ++prefix) {
+            if (first == last
+                || std::tolower(static_cast<unsigned char>(*first)) != *prefix)
+                return false;
+        }
+        return true;
+    }
+
+    /// Parse the header block in place. Only Content-Length is of interest.
+    bool _parse_headers(std::size_t headers_size, std::size_t& content_length) {
+        static const char content_length_key[] = "content-length:";
+        const auto key_len = sizeof content_length_key - 1;
+        content_length = 0;
+        auto line = _buffer.data();
+        const auto headers_end = line + headers_size;
+        while (line != headers_end) {
+            const auto eol = std::find(line, headers_end, '\n');
+            if (_starts_with_icase(line, eol, content_length_key)) {
+                auto it = line + key_len;
+                while (it != eol && (*it == ' ' || *it == '\t'))
+                    ++it;
+                const auto digits_begin = it;
+                std::size_t value = 0;
+                bool too_large = false;
+                for (; it != eol && std::isdigit(static_cast<unsigned char>(*it)); ++it) {
+                    // Stopping at the limit also keeps the value from overflowing
+                    value = value * 10 + static_cast<std::size_t>(*it - '0');
+                    if (value > max_message_size) {
+                        too_large = true;
+                        break;
+                    }
+                }
+                if (too_large) {
+                    log::error("Content-length exceeds the maximum of ",
+                               max_message_size,
+                               " bytes: ",
+                               std::string(line, eol));
+                    return false;  // Abort connection
+                }
+                while (it != eol && std::isspace(static_cast<unsigned char>(*it)))
+                    ++it;
+                if (it == digits_begin || it != eol) {
+                    log::error("Invalid content-length: ", std::string(line, eol));
                     return false;  // Abort connection
                 }
+                content_length = value;
             }
+            line = eol == headers_end ? eol : eol + 1;
         }
         if (content_length == 0) {
-            OUTPUT_STREAM << "No content-length provided\n";
+            log::error("No content-length provided");
             return false;  // Aborts the connection
         }
-        data.str(data.str().substr(headers_size));
-        return _step3_read_body(content_length, data);
+        return true;
     }
 
-    bool _step3_read_body(std::size_t content_length, std::stringstream& stream) {
-        while (stream.str().size() < content_length && _streamer.read(stream)) {
-            /* NOOP */
+    /// Hand the body straight out of the buffer to the handler
+    void _dispatch_body(const char* first, const char* last) {
+        if (log::enabled(log::level::trace)) {
+            log::trace("Got request: ", std::string(first, last));
         }
-        std::string buffer;
-        buffer.resize(content_length);
-        stream.read(&buffer[0], buffer.size());
-        stream.str(stream.str().substr(content_length));
-        OUTPUT_STREAM << "Got request: " << buffer << std::endl;
-        json data;
-        try {
-            data = json::parse(buffer);
-        } catch (std::invalid_argument e) {
-            OUTPUT_STREAM << "Invalid json: " << e.what() << std::endl;
-            return false;
+        auto maybe_fut = _handler(first, last);
+        if (maybe_fut) {
+            // Queueing the response is cheap, so do it on the thread that
+            // finishes it rather than on a new one
+            maybe_fut->then(boost::launch::sync, [this](future<std::string> response) {
+                send_message(response.get());
+            });
         }
+    }
 
-        auto maybe_fut = _handler(data);
-        if (maybe_fut) {
-            maybe_fut->then([this](future<json> response) { send_message(response.get()); });
+    /// The writer thread: takes everything queued since the last flush and
+    /// writes it with a single gathered write.
+    void _write_messages() {
+        static const char crlf[] = "\r\n";
+        std::vector<outgoing_message> batch;
+        std::vector<asio::const_buffer> buffers;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk{ _write_lock };
+                _write_cond.wait(lk, [this] { return _stop_writing || !_write_queue.empty(); });
+                if (_write_queue.empty())
+                    return;  // Stopping, and everything has been flushed
+                batch.swap(_write_queue);
+            }
+            buffers.clear();
+            for (const auto& msg : batch) {
+                buffers.push_back(asio::buffer(msg.header));
+                buffers.push_back(asio::buffer(msg.body));
+                buffers.push_back(asio::buffer(crlf, 2));
+            }
+            _streamer.write(buffers);
+            batch.clear();
+        }
+    }
+
+    void _read_messages() {
+        while (true) {
+            std::size_t headers_size;
+            while ((headers_size = _find_headers_end()) == std::string::npos) {
+                if (!_fill(0))
+                    return;
+            }
+            std::size_t content_length;
+            if (!_parse_headers(headers_size, content_length))
+                return;
+            _buffer.consume(headers_size);
+            while (_buffer.size() < content_length) {
+                if (!_fill(content_length - _buffer.size()))
+                    return;
+            }
+            const auto body = _buffer.data();
+            _dispatch_body(body, body + content_length);
+            _buffer.consume(content_length);
         }
-        return true;
     }
 
 public:
-    void send_message(json msg) {
-        const auto str = msg.dump();
-        OUTPUT_STREAM << "Sending message: " << str << std::endl;
-        static std::mutex responding_lock;
-        std::lock_guard<std::mutex> lk{ responding_lock };
-        _streamer.write("Content-Length: ");
-        _streamer.write(std::to_string(str.length() + 2));
-        _streamer.write("\r\n\r\n");
-        _streamer.write(str);
-        _streamer.write("\r\n");
+    /// Queue a message for the writer thread. Never blocks on the output.
+    void send_message(const json& msg) { send_message(msg.dump()); }
+
+    /// Queue a message that has already been serialized
+    void send_message(std::string body) {
+        outgoing_message out;
+        out.body = std::move(body);
+        log::trace("Sending message: ", out.body);
+        // The trailing CRLF after the body is counted in the length
+        out.header = "Content-Length: " + std::to_string(out.body.length() + 2) + "\r\n\r\n";
+        {
+            std::lock_guard<std::mutex> lk{ _write_lock };
+            _write_queue.push_back(std::move(out));
+        }
+        _write_cond.notify_one();
     }
     template <typename Handler> void run(Handler&& h) {
         _handler = std::ref(h);
-        _step1_read_headers();
+        _read_messages();
         // _streamer.run();
     }
 };
+
+template <typename StreamTransport>
+const std::size_t httpish_transport<StreamTransport>::max_message_size;
 }
 
 #endif  // CLS_JSON_RPC_HTTPISH_TRANSPORT_HPP_INCLUDED
\ No newline at end of file
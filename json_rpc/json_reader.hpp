@@ -0,0 +1,438 @@
+#ifndef CLS_JSON_RPC_JSON_READER_HPP_INCLUDED
+#define CLS_JSON_RPC_JSON_READER_HPP_INCLUDED
+
+#include "error.hpp"
+
+#include <json.hpp>
+
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <utility>
+
+namespace json_rpc {
+
+using nlohmann::json;
+
+/**
+ * A pull parser reading JSON straight out of a character range.
+ *
+ * Callers walk the document in the order it is written: `peek()` tells what
+ * the next value is, containers are entered with `begin_object()` and
+ * `begin_array()` and iterated with `next_member()` and `next_element()`,
+ * and scalars are read with the `read_*()` functions. Values that are not of
+ * interest are skipped, or taken as a raw range of the input to be read
+ * later. Nothing is allocated except for the strings being read.
+ *
+ * Malformed input throws an `error` with `error_code::parse_error`. Reading a
+ * value of the wrong type throws one with `error_code::invalid_params`.
+ */
+class json_reader {
+public:
+    enum class token {
+        object,
+        array,
+        string,
+        number,
+        boolean,
+        null,
+        /// The end of the input
+        end,
+    };
+
+private:
+    const char* _first;
+    const char* _pos;
+    const char* _last;
+    /// Set right after entering a container, so the first member isn't
+    /// preceded by a comma
+    bool _first_in_container = false;
+    std::size_t _depth = 0;
+    static constexpr std::size_t max_depth = 512;
+
+    [[noreturn]] void _syntax_error(const char* what) const {
+        throw error{ error_code::parse_error,
+                     std::string(what) + " at offset " + std::to_string(_pos - _first) };
+    }
+
+    [[noreturn]] void _type_error(const char* expected) const {
+        throw error{ error_code::invalid_params,
+                     std::string("Expected ") + expected + " at offset "
+                         + std::to_string(_pos - _first) };
+    }
+
+    void _skip_ws() {
+        while (_pos != _last && (*_pos == ' ' || *_pos == '\n' || *_pos == '\r' || *_pos == '\t'))
+            ++_pos;
+    }
+
+    void _expect(char c, const char* what) {
+        _skip_ws();
+        if (_pos == _last || *_pos != c)
+            _syntax_error(what);
+        ++_pos;
+    }
+
+    void _expect_literal(const char* lit) {
+        for (; *lit; ++lit, ++_pos) {
+            if (_pos == _last || *_pos != *lit)
+                _syntax_error("Invalid literal");
+        }
+    }
+
+    void _enter() {
+        if (++_depth > max_depth)
+            _syntax_error("Nesting too deep");
+        _first_in_container = true;
+    }
+
+    void _leave() {
+        --_depth;
+        // The enclosing container, if any, now has at least this member
+        _first_in_container = false;
+    }
+
+    /// Consumes the separator before the next member or element. Returns false
+    /// and leaves the container if `close` comes first
+    bool _next(char close) {
+        _skip_ws();
+        if (_pos == _last)
+            _syntax_error("Unexpected end of input");
+        if (*_pos == close) {
+            ++_pos;
+            _leave();
+            return false;
+        }
+        if (!_first_in_container) {
+            if (*_pos != ',')
+                _syntax_error("Expected ',' or a closing bracket");
+            ++_pos;
+        }
+        _first_in_container = false;
+        return true;
+    }
+
+    static int _hex_digit(char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    unsigned _read_hex4() {
+        unsigned value = 0;
+        for (int i = 0; i < 4; ++i, ++_pos) {
+            const auto digit = _pos == _last ? -1 : _hex_digit(*_pos);
+            if (digit < 0)
+                _syntax_error("Invalid \\u escape");
+            value = value * 16 + static_cast<unsigned>(digit);
+        }
+        return value;
+    }
+
+    static void _append_utf8(std::string& out, unsigned cp) {
+        if (cp < 0x80) {
+            out.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    /// Reads a string starting at the opening quote. With a null `out` the
+    /// string is only validated
+    void _string(std::string* out) {
+        ++_pos;  // Opening quote
+        while (true) {
+            // Copy runs of plain characters in one go
+            const auto run = _pos;
+            while (_pos != _last && *_pos != '"' && *_pos != '\\'
+                   && static_cast<unsigned char>(*_pos) >= 0x20) {
+                ++_pos;
+            }
+            if (out)
+                out->append(run, _pos);
+            if (_pos == _last)
+                _syntax_error("Unterminated string");
+            const auto c = *_pos++;
+            if (c == '"')
+                return;
+            if (c != '\\')
+                _syntax_error("Control character in string");
+            if (_pos == _last)
+                _syntax_error("Unterminated string");
+            const auto esc = *_pos++;
+            char plain;
+            switch (esc) {
+            case '"':
+            case '\\':
+            case '/':
+                plain = esc;
+                break;
+            case 'b':
+                plain = '\b';
+                break;
+            case 'f':
+                plain = '\f';
+                break;
+            case 'n':
+                plain = '\n';
+                break;
+            case 'r':
+                plain = '\r';
+                break;
+            case 't':
+                plain = '\t';
+                break;
+            case 'u': {
+                auto cp = _read_hex4();
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    if (_last - _pos < 2 || _pos[0] != '\\' || _pos[1] != 'u')
+                        _syntax_error("Unpaired surrogate");
+                    _pos += 2;
+                    const auto low = _read_hex4();
+                    if (low < 0xDC00 || low > 0xDFFF)
+                        _syntax_error("Unpaired surrogate");
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                    _syntax_error("Unpaired surrogate");
+                }
+                if (out)
+                    _append_utf8(*out, cp);
+                continue;
+            }
+            default:
+                _syntax_error("Invalid escape");
+            }
+            if (out)
+                out->push_back(plain);
+        }
+    }
+
+    /// Scans a number, returning whether it has a fraction or exponent
+    bool _number() {
+        bool integral = true;
+        if (_pos != _last && *_pos == '-')
+            ++_pos;
+        const auto digits = [this] {
+            const auto start = _pos;
+            while (_pos != _last && *_pos >= '0' && *_pos <= '9')
+                ++_pos;
+            if (_pos == start)
+                _syntax_error("Invalid number");
+        };
+        if (_pos != _last && *_pos == '0') {
+            ++_pos;
+        } else {
+            digits();
+        }
+        if (_pos != _last && *_pos == '.') {
+            ++_pos;
+            digits();
+            integral = false;
+        }
+        if (_pos != _last && (*_pos == 'e' || *_pos == 'E')) {
+            ++_pos;
+            if (_pos != _last && (*_pos == '+' || *_pos == '-'))
+                ++_pos;
+            digits();
+            integral = false;
+        }
+        return integral;
+    }
+
+public:
+    json_reader(const char* first, const char* last)
+        : _first(first)
+        , _pos(first)
+        , _last(last) {}
+
+    /// What the next value is, without consuming anything
+    token peek() {
+        _skip_ws();
+        if (_pos == _last)
+            return token::end;
+        switch (*_pos) {
+        case '{':
+            return token::object;
+        case '[':
+            return token::array;
+        case '"':
+            return token::string;
+        case 't':
+        case 'f':
+            return token::boolean;
+        case 'n':
+            return token::null;
+        default:
+            if (*_pos == '-' || (*_pos >= '0' && *_pos <= '9'))
+                return token::number;
+            _syntax_error("Unexpected character");
+        }
+    }
+
+    /// The offset of the next unread character
+    std::size_t offset() const { return static_cast<std::size_t>(_pos - _first); }
+
+    void begin_object() {
+        if (peek() != token::object)
+            _type_error("an object");
+        ++_pos;
+        _enter();
+    }
+
+    /// Moves to the next member of the current object and reads its key.
+    /// Returns false once the object has ended
+    bool next_member(std::string& key) {
+        if (!_next('}'))
+            return false;
+        if (peek() != token::string)
+            _syntax_error("Expected a member name");
+        key.clear();
+        _string(&key);
+        _expect(':', "Expected ':'");
+        return true;
+    }
+
+    void begin_array() {
+        if (peek() != token::array)
+            _type_error("an array");
+        ++_pos;
+        _enter();
+    }
+
+    /// Moves to the next element of the current array. Returns false once the
+    /// array has ended
+    bool next_element() { return _next(']'); }
+
+    void read_string(std::string& out) {
+        if (peek() != token::string)
+            _type_error("a string");
+        out.clear();
+        _string(&out);
+    }
+
+    std::string read_string() {
+        std::string ret;
+        read_string(ret);
+        return ret;
+    }
+
+    std::int64_t read_integer() {
+        if (peek() != token::number)
+            _type_error("an integer");
+        const auto start = _pos;
+        if (!_number())
+            _type_error("an integer");
+        const bool negative = *start == '-';
+        std::uint64_t value = 0;
+        const std::uint64_t limit = negative
+            ? std::uint64_t(std::numeric_limits<std::int64_t>::max()) + 1
+            : std::uint64_t(std::numeric_limits<std::int64_t>::max());
+        for (auto it = start + (negative ? 1 : 0); it != _pos; ++it) {
+            const auto digit = static_cast<std::uint64_t>(*it - '0');
+            if (value > (limit - digit) / 10)
+                _type_error("an integer in range");
+            value = value * 10 + digit;
+        }
+        return negative ? static_cast<std::int64_t>(0 - value) : static_cast<std::int64_t>(value);
+    }
+
+    double read_number() {
+        if (peek() != token::number)
+            _type_error("a number");
+        const auto start = _pos;
+        _number();
+        // The input isn't null-terminated, so strtod gets a copy
+        const std::string text(start, _pos);
+        return std::strtod(text.c_str(), nullptr);
+    }
+
+    bool read_bool() {
+        if (peek() != token::boolean)
+            _type_error("a boolean");
+        const bool value = *_pos == 't';
+        _expect_literal(value ? "true" : "false");
+        return value;
+    }
+
+    /// Consumes a null and returns true, or returns false if the next value
+    /// is something else
+    bool read_null() {
+        if (peek() != token::null)
+            return false;
+        _expect_literal("null");
+        return true;
+    }
+
+    /// Skips over the next value, checking that it is well-formed
+    void skip() {
+        switch (peek()) {
+        case token::object:
+            begin_object();
+            while (_next('}')) {
+                if (peek() != token::string)
+                    _syntax_error("Expected a member name");
+                _string(nullptr);
+                _expect(':', "Expected ':'");
+                skip();
+            }
+            break;
+        case token::array:
+            begin_array();
+            while (next_element())
+                skip();
+            break;
+        case token::string:
+            _string(nullptr);
+            break;
+        case token::number:
+            _number();
+            break;
+        case token::boolean:
+            read_bool();
+            break;
+        case token::null:
+            read_null();
+            break;
+        case token::end:
+            _syntax_error("Unexpected end of input");
+        }
+    }
+
+    /// Skips over the next value and returns the range of input it occupies
+    std::pair<const char*, const char*> raw_value() {
+        _skip_ws();
+        const auto start = _pos;
+        skip();
+        return { start, _pos };
+    }
+
+    /// Reads the next value into a DOM, for data without a fixed shape
+    json read_json() {
+        const auto raw = raw_value();
+        return json::parse(raw.first, raw.second);
+    }
+
+    /// Checks that nothing but whitespace follows
+    void expect_end() {
+        if (peek() != token::end)
+            _syntax_error("Unexpected data after the value");
+    }
+};
+}
+
+#endif  // CLS_JSON_RPC_JSON_READER_HPP_INCLUDED
@@ -0,0 +1,170 @@
+#ifndef CLS_JSON_RPC_JSON_WRITER_HPP_INCLUDED
+#define CLS_JSON_RPC_JSON_WRITER_HPP_INCLUDED
+
+#include <json.hpp>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+namespace json_rpc {
+
+using nlohmann::json;
+
+/// JSON text that has already been serialized, such as a method's result
+struct raw_json {
+    std::string text;
+};
+
+/**
+ * Appends JSON text to a string as values are written, without building a
+ * DOM.
+ *
+ * Object keys are written either from a plain string, which is escaped on the
+ * spot, or from a literal prepared once with `key_literal()`. The writer
+ * takes care of the commas; it does not check that the calls make a valid
+ * document.
+ */
+class json_writer {
+    std::string _out;
+    /// Whether the next member or element needs a separating comma
+    bool _need_comma = false;
+
+    void _separate() {
+        if (_need_comma)
+            _out.push_back(',');
+    }
+
+    static void _escape_into(std::string& out, const char* first, const char* last) {
+        static const char hex[] = "0123456789abcdef";
+        while (first != last) {
+            // Copy runs of plain characters in one go
+            auto run = first;
+            while (run != last && *run != '"' && *run != '\\'
+                   && static_cast<unsigned char>(*run) >= 0x20) {
+                ++run;
+            }
+            out.append(first, run);
+            if (run == last)
+                break;
+            const auto c = static_cast<unsigned char>(*run);
+            switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            case '\b':
+                out += "\\b";
+                break;
+            case '\f':
+                out += "\\f";
+                break;
+            default:
+                out += "\\u00";
+                out.push_back(hex[c >> 4]);
+                out.push_back(hex[c & 0xF]);
+            }
+            first = run + 1;
+        }
+    }
+
+public:
+    json_writer() = default;
+    explicit json_writer(std::size_t reserve) { _out.reserve(reserve); }
+
+    /// Quote and escape a string
+    static std::string quote(const std::string& str) {
+        std::string ret;
+        ret.reserve(str.size() + 2);
+        ret.push_back('"');
+        _escape_into(ret, str.data(), str.data() + str.size());
+        ret.push_back('"');
+        return ret;
+    }
+
+    /// The text for an object key, ready to be passed to `key_literal()`
+    static std::string make_key_literal(const std::string& key) { return quote(key) + ':'; }
+
+    const std::string& str() const { return _out; }
+    std::string release() {
+        _need_comma = false;
+        return std::move(_out);
+    }
+
+    void begin_object() {
+        _separate();
+        _out.push_back('{');
+        _need_comma = false;
+    }
+    void end_object() {
+        _out.push_back('}');
+        _need_comma = true;
+    }
+    void begin_array() {
+        _separate();
+        _out.push_back('[');
+        _need_comma = false;
+    }
+    void end_array() {
+        _out.push_back(']');
+        _need_comma = true;
+    }
+
+    void key(const std::string& k) {
+        _separate();
+        _out.push_back('"');
+        _escape_into(_out, k.data(), k.data() + k.size());
+        _out += "\":";
+        _need_comma = false;
+    }
+
+    /// Write a key prepared by `make_key_literal()`
+    void key_literal(const std::string& literal) {
+        _separate();
+        _out += literal;
+        _need_comma = false;
+    }
+
+    void value(const std::string& str) {
+        _separate();
+        _out.push_back('"');
+        _escape_into(_out, str.data(), str.data() + str.size());
+        _out.push_back('"');
+        _need_comma = true;
+    }
+    void value(const char* str) { value(std::string(str)); }
+    void value(bool b) {
+        _separate();
+        _out += b ? "true" : "false";
+        _need_comma = true;
+    }
+    void value(std::int64_t i) {
+        _separate();
+        _out += std::to_string(i);
+        _need_comma = true;
+    }
+    void value(int i) { value(static_cast<std::int64_t>(i)); }
+    void value(const json& j) { raw(j.dump()); }
+    void null() { raw("null"); }
+
+    /// Write text that is already valid JSON
+    void raw(const std::string& text) {
+        _separate();
+        _out += text;
+        _need_comma = true;
+    }
+};
+}
+
+#endif  // CLS_JSON_RPC_JSON_WRITER_HPP_INCLUDED
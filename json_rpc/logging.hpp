@@ -0,0 +1,186 @@
+#ifndef CLS_JSON_RPC_LOGGING_HPP_INCLUDED
+#define CLS_JSON_RPC_LOGGING_HPP_INCLUDED
+
+#include <boost/lockfree/queue.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace json_rpc {
+
+namespace log {
+
+enum class level {
+    off = 0,
+    error,
+    warning,
+    info,
+    debug,
+    /// Full message transcripts
+    trace,
+};
+
+/**
+ * The process-wide log sink.
+ *
+ * Producers push records onto a lock-free queue and return immediately; a
+ * background thread drains the queue into the log file. The level and file
+ * are read from the environment on first use:
+ *
+ * - CLS_LOG_LEVEL: one of off, error, warning, info, debug or trace.
+ *   Defaults to off, in which case no file is created and no thread started.
+ * - CLS_LOG_FILE: where to write. Defaults to clang-languageservice.log
+ */
+class logger {
+    struct record {
+        level lvl;
+        std::string text;
+    };
+
+    std::atomic<int> _level;
+    std::string _path;
+    boost::lockfree::queue<record*> _queue{ 128 };
+    std::mutex _wake_lock;
+    std::condition_variable _wake;
+    std::atomic_bool _writer_sleeping{ false };
+    std::atomic_bool _stop{ false };
+    std::thread _writer;
+
+    static const char* _level_name(level l) {
+        switch (l) {
+        case level::error:
+            return "error";
+        case level::warning:
+            return "warning";
+        case level::info:
+            return "info";
+        case level::debug:
+            return "debug";
+        case level::trace:
+            return "trace";
+        default:
+            return "";
+        }
+    }
+
+    static level _parse_level(const char* str) {
+        for (auto l : { level::error, level::warning, level::info, level::debug, level::trace }) {
+            if (std::strcmp(str, _level_name(l)) == 0)
+                return l;
+        }
+        return level::off;
+    }
+
+    void _write_loop() {
+        std::ofstream out{ _path, std::ios::app };
+        record* rec;
+        while (true) {
+            bool wrote = false;
+            while (_queue.pop(rec)) {
+                out << '[' << _level_name(rec->lvl) << "] " << rec->text << '\n';
+                delete rec;
+                wrote = true;
+            }
+            if (wrote)
+                out.flush();
+            if (_stop)
+                break;
+            std::unique_lock<std::mutex> lk{ _wake_lock };
+            _writer_sleeping = true;
+            // The timeout covers a producer that pushes just before we sleep
+            _wake.wait_for(lk, std::chrono::milliseconds(100), [this] {
+                return _stop || !_queue.empty();
+            });
+            _writer_sleeping = false;
+        }
+        while (_queue.pop(rec)) {
+            out << '[' << _level_name(rec->lvl) << "] " << rec->text << '\n';
+            delete rec;
+        }
+    }
+
+public:
+    logger() {
+        const auto level_env = std::getenv("CLS_LOG_LEVEL");
+        _level = static_cast<int>(level_env ? _parse_level(level_env) : level::off);
+        const auto path_env = std::getenv("CLS_LOG_FILE");
+        _path = path_env ? path_env : "clang-languageservice.log";
+        if (_level != static_cast<int>(level::off)) {
+            _writer = std::thread([this] { _write_loop(); });
+        }
+    }
+
+    ~logger() {
+        if (_writer.joinable()) {
+            _stop = true;
+            _wake.notify_one();
+            _writer.join();
+        }
+    }
+
+    logger(const logger&) = delete;
+    logger& operator=(const logger&) = delete;
+
+    static logger& instance() {
+        static logger inst;
+        return inst;
+    }
+
+    bool enabled(level l) const {
+        return l != level::off && static_cast<int>(l) <= _level.load(std::memory_order_relaxed);
+    }
+
+    void push(level l, std::string text) {
+        if (!_writer.joinable())
+            return;
+        _queue.push(new record{ l, std::move(text) });
+        if (_writer_sleeping.load(std::memory_order_relaxed)) {
+            _wake.notify_one();
+        }
+    }
+};
+
+namespace detail {
+
+inline void build_string(std::stringstream&) {}
+
+template <typename T, typename... Args>
+void build_string(std::stringstream& strm, const T& t, const Args&... args) {
+    strm << t;
+    build_string(strm, args...);
+}
+}
+
+/// Returns true if messages at the given level are recorded. Useful to
+/// guard building expensive log messages.
+inline bool enabled(level l) { return logger::instance().enabled(l); }
+
+/// Formats the arguments and queues them for the log writer. Formatting is
+/// skipped entirely if the level is disabled
+template <typename... Args> void write(level l, const Args&... args) {
+    auto& inst = logger::instance();
+    if (!inst.enabled(l))
+        return;
+    std::stringstream strm;
+    detail::build_string(strm, args...);
+    inst.push(l, strm.str());
+}
+
+template <typename... Args> void error(const Args&... args) { write(level::error, args...); }
+template <typename... Args> void warning(const Args&... args) { write(level::warning, args...); }
+template <typename... Args> void info(const Args&... args) { write(level::info, args...); }
+template <typename... Args> void debug(const Args&... args) { write(level::debug, args...); }
+template <typename... Args> void trace(const Args&... args) { write(level::trace, args...); }
+
+}  // log
+}
+
+#endif  // CLS_JSON_RPC_LOGGING_HPP_INCLUDED
@@ -0,0 +1,82 @@
+#ifndef CLS_JSON_RPC_MESSAGE_BUFFER_HPP_INCLUDED
+#define CLS_JSON_RPC_MESSAGE_BUFFER_HPP_INCLUDED
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+namespace json_rpc {
+
+/**
+ * A contiguous, growable byte buffer used to frame incoming messages.
+ *
+ * Readers write into the region returned by `prepare()` and `commit()` what
+ * they received. Parsers look at the unconsumed bytes through `data()` and
+ * `size()`, and `consume()` whatever they have finished with. The readable
+ * region is always contiguous, so a message body can be handed off as a
+ * plain pointer range. Space before the read position is reclaimed by
+ * sliding the unconsumed tail to the front, which only happens when the
+ * buffer would otherwise have to grow.
+ */
+class message_buffer {
+    std::unique_ptr<char[]> _storage;
+    std::size_t _capacity = 0;
+    std::size_t _begin = 0;
+    std::size_t _end = 0;
+
+public:
+    message_buffer() = default;
+    explicit message_buffer(std::size_t initial_capacity)
+        : _storage(new char[initial_capacity])
+        , _capacity(initial_capacity) {}
+
+    /// Pointer to the first unconsumed byte
+    const char* data() const { return _storage.get() + _begin; }
+    /// The number of unconsumed bytes
+    std::size_t size() const { return _end - _begin; }
+    bool empty() const { return _begin == _end; }
+
+    /// Returns a pointer to at least `n` writable bytes following the readable
+    /// region. Invalidates pointers previously obtained from `data()`
+    char* prepare(std::size_t n) {
+        if (_capacity - _end >= n) {
+            return _storage.get() + _end;
+        }
+        const auto used = size();
+        if (_capacity - used >= n) {
+            // Enough room if we slide the unconsumed bytes down
+            std::memmove(_storage.get(), data(), used);
+        } else {
+            const auto new_capacity = std::max(_capacity * 2, used + n);
+            std::unique_ptr<char[]> new_storage{ new char[new_capacity] };
+            if (used) {
+                std::memcpy(new_storage.get(), data(), used);
+            }
+            _storage = std::move(new_storage);
+            _capacity = new_capacity;
+        }
+        _begin = 0;
+        _end = used;
+        return _storage.get() + _end;
+    }
+
+    /// Marks `n` bytes of the region returned by `prepare()` as readable
+    void commit(std::size_t n) {
+        assert(_end + n <= _capacity);
+        _end += n;
+    }
+
+    /// Discards `n` bytes from the front of the readable region
+    void consume(std::size_t n) {
+        assert(n <= size());
+        _begin += n;
+        if (_begin == _end) {
+            _begin = _end = 0;
+        }
+    }
+};
+}
+
+#endif  // CLS_JSON_RPC_MESSAGE_BUFFER_HPP_INCLUDED
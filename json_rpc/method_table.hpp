@@ -0,0 +1,162 @@
+#ifndef CLS_JSON_RPC_METHOD_TABLE_HPP_INCLUDED
+#define CLS_JSON_RPC_METHOD_TABLE_HPP_INCLUDED
+
+#include "cancellation.hpp"
+#include "json_writer.hpp"
+#include "params_view.hpp"
+#include "serialize.hpp"
+
+#include <boost/optional.hpp>
+#include <boost/thread/future.hpp>
+
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace json_rpc {
+
+/**
+ * Maps method names to handlers.
+ *
+ * Handlers are registered with the types of their params and result, and the
+ * table takes care of reading the params and serializing the result. Names
+ * are kept in an open-addressed hash table that is at most half full, so a
+ * lookup costs one hash of the name and, almost always, one comparison, no
+ * matter how many methods there are.
+ *
+ * Register everything before dispatching; lookups don't lock, so the table
+ * must not change while messages are being handled.
+ */
+class method_table {
+public:
+    /// A handler for one method. Returns the result for requests, and none
+    /// for notifications
+    using handler = std::function<boost::optional<boost::future<raw_json>>(
+        const params_view&, const cancellation_token&)>;
+
+private:
+    struct entry {
+        std::string name;
+        std::uint64_t hash = 0;
+        handler fn;
+    };
+
+    std::vector<entry> _slots{ 16 };
+    std::size_t _size = 0;
+
+    static std::uint64_t _hash(const char* first, const char* last) {
+        // FNV-1a
+        std::uint64_t h = 14695981039346656037ull;
+        for (; first != last; ++first) {
+            h ^= static_cast<unsigned char>(*first);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    std::size_t _probe(const std::string& name, std::uint64_t hash) const {
+        const auto mask = _slots.size() - 1;
+        auto index = static_cast<std::size_t>(hash) & mask;
+        while (_slots[index].fn && !(_slots[index].hash == hash && _slots[index].name == name)) {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+
+    void _grow() {
+        std::vector<entry> old(_slots.size() * 2);
+        old.swap(_slots);
+        for (auto& e : old) {
+            if (e.fn) {
+                _slots[_probe(e.name, e.hash)] = std::move(e);
+            }
+        }
+    }
+
+    template <typename Result> static boost::future<raw_json> _to_result(Result res) {
+        return boost::make_ready_future(to_raw_json(res));
+    }
+    template <typename Result>
+    static boost::future<raw_json> _to_result(boost::future<Result> fut) {
+        return convert_result(std::move(fut));
+    }
+    static boost::future<raw_json> _to_result(boost::future<raw_json> fut) { return fut; }
+    static boost::future<raw_json> _to_result(raw_json res) {
+        return boost::make_ready_future(std::move(res));
+    }
+
+    template <typename Params, typename Fn>
+    static auto _call(Fn& fn, const params_view& params, const cancellation_token& cancel, int)
+        -> decltype(fn(std::declval<Params>(), cancel)) {
+        return fn(params.get<Params>(), cancel);
+    }
+    template <typename Params, typename Fn>
+    static auto _call(Fn& fn, const params_view& params, const cancellation_token&, long)
+        -> decltype(fn(std::declval<Params>())) {
+        return fn(params.get<Params>());
+    }
+
+public:
+    /// Register a method that is dispatched as-is
+    void add(const std::string& name, handler fn) {
+        assert(fn);
+        if ((_size + 1) * 2 > _slots.size()) {
+            _grow();
+        }
+        const auto hash = _hash(name.data(), name.data() + name.size());
+        auto& slot = _slots[_probe(name, hash)];
+        if (!slot.fn) {
+            ++_size;
+        }
+        slot.name = name;
+        slot.hash = hash;
+        slot.fn = std::move(fn);
+    }
+
+    /**
+     * Register a request. `fn` is called with the params read as `Params`,
+     * and optionally the cancellation token. It may return its result
+     * directly or as a future; either is serialized as the response.
+     */
+    template <typename Params, typename Fn> void add_request(const std::string& name, Fn fn) {
+        add(name, [fn](const params_view& params,
+                       const cancellation_token& cancel) mutable
+                  -> boost::optional<boost::future<raw_json>> {
+            return _to_result(_call<Params>(fn, params, cancel, 0));
+        });
+    }
+
+    /// Register a request without params
+    template <typename Fn> void add_request(const std::string& name, Fn fn) {
+        add(name, [fn](const params_view&, const cancellation_token&) mutable
+                  -> boost::optional<boost::future<raw_json>> { return _to_result(fn()); });
+    }
+
+    /// Register a notification. `fn` is called with the params read as
+    /// `Params`, and its return value is ignored
+    template <typename Params, typename Fn>
+    void add_notification(const std::string& name, Fn fn) {
+        add(name, [fn](const params_view& params,
+                       const cancellation_token& cancel) mutable
+                  -> boost::optional<boost::future<raw_json>> {
+            _call<Params>(fn, params, cancel, 0);
+            return boost::none;
+        });
+    }
+
+    /// The handler for a method, or null if there is none
+    const handler* find(const std::string& name) const {
+        const auto hash = _hash(name.data(), name.data() + name.size());
+        const auto& slot = _slots[_probe(name, hash)];
+        return slot.fn ? &slot.fn : nullptr;
+    }
+
+    std::size_t size() const { return _size; }
+};
+}
+
+#endif  // CLS_JSON_RPC_METHOD_TABLE_HPP_INCLUDED
@@ -0,0 +1,54 @@
+#ifndef CLS_JSON_RPC_PARAMS_VIEW_HPP_INCLUDED
+#define CLS_JSON_RPC_PARAMS_VIEW_HPP_INCLUDED
+
+#include "json_reader.hpp"
+#include "serialize.hpp"
+
+#include <json.hpp>
+
+#include <string>
+
+namespace json_rpc {
+
+using nlohmann::json;
+
+/**
+ * The still-unparsed `params` of a request or notification.
+ *
+ * Only the raw text is kept when a message is dispatched. Handlers that know
+ * the shape of their parameters read them straight into the target type with
+ * `get<T>()`; the rest can ask for a DOM with `to_json()`. Absent parameters
+ * read as `null`.
+ */
+class params_view {
+    std::string _text;
+
+public:
+    params_view() = default;
+    explicit params_view(std::string text)
+        : _text(std::move(text)) {}
+
+    /// True if the message had no params
+    bool empty() const { return _text.empty(); }
+    const std::string& text() const { return _text; }
+
+    json_reader reader() const {
+        static const char null_text[] = "null";
+        if (_text.empty()) {
+            return json_reader{ null_text, null_text + sizeof null_text - 1 };
+        }
+        return json_reader{ _text.data(), _text.data() + _text.size() };
+    }
+
+    template <typename T> T get() const {
+        auto r = reader();
+        auto ret = read_json<T>(r);
+        r.expect_end();
+        return ret;
+    }
+
+    json to_json() const { return _text.empty() ? json() : json::parse(_text); }
+};
+}
+
+#endif  // CLS_JSON_RPC_PARAMS_VIEW_HPP_INCLUDED
@@ -0,0 +1,151 @@
+#ifndef CLS_JSON_RPC_REQUEST_TABLE_HPP_INCLUDED
+#define CLS_JSON_RPC_REQUEST_TABLE_HPP_INCLUDED
+
+#include "error.hpp"
+
+#include <boost/optional.hpp>
+#include <boost/thread/future.hpp>
+
+#include <json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+namespace json_rpc {
+
+using nlohmann::json;
+
+/**
+ * A fixed-capacity table of the requests we have sent and are awaiting a
+ * response for.
+ *
+ * Each request occupies a slot. Its ID encodes the slot index in the low
+ * bits and the slot's generation in the high bits, so finding a request
+ * needs no lookup and a late or duplicate response for a slot that has since
+ * been reused is recognized and dropped. A slot's state and generation live
+ * in one atomic word, and every transition is a compare-and-swap, so
+ * sending, completing and expiring requests don't take any locks.
+ */
+class request_table {
+public:
+    using clock = std::chrono::steady_clock;
+    using id_type = std::uint64_t;
+
+private:
+    enum slot_status : std::uint32_t {
+        slot_free = 0,
+        /// Being filled in by the sender
+        slot_reserved = 1,
+        slot_pending = 2,
+        /// Being completed or expired
+        slot_completing = 3,
+    };
+
+    struct slot {
+        /// (generation << 2) | status
+        std::atomic<std::uint32_t> state{ 0 };
+        std::atomic<clock::rep> deadline{ 0 };
+        boost::promise<json> promise;
+    };
+
+    static std::uint32_t _make_state(std::uint32_t generation, slot_status status) {
+        return (generation << 2) | status;
+    }
+    static std::uint32_t _generation(std::uint32_t state) { return state >> 2; }
+    static slot_status _status(std::uint32_t state) { return slot_status(state & 3u); }
+    /// Generations wrap well before an ID would leave the range JSON
+    /// numbers represent exactly
+    static const std::uint32_t max_generation = 0x3fffffffu;
+    static std::uint32_t _next_generation(std::uint32_t generation) {
+        return (generation + 1) & max_generation;
+    }
+
+    std::unique_ptr<slot[]> _slots;
+    std::size_t _capacity;
+    unsigned _index_bits = 0;
+    std::atomic<std::size_t> _hint{ 0 };
+
+    /// Take a pending request with the given state out of its slot. Returns
+    /// none if someone else got there first
+    boost::optional<boost::promise<json>> _take(slot& s, std::uint32_t expected) {
+        const auto generation = _generation(expected);
+        if (!s.state.compare_exchange_strong(expected, _make_state(generation, slot_completing),
+                                             std::memory_order_acquire)) {
+            return boost::none;
+        }
+        auto prom = std::move(s.promise);
+        s.state.store(_make_state(_next_generation(generation), slot_free),
+                      std::memory_order_release);
+        return std::move(prom);
+    }
+
+public:
+    /// Capacity is rounded up to a power of two
+    explicit request_table(std::size_t capacity = 1024) {
+        while ((std::size_t(1) << _index_bits) < capacity && _index_bits < 16) {
+            ++_index_bits;
+        }
+        _capacity = std::size_t(1) << _index_bits;
+        _slots.reset(new slot[_capacity]);
+    }
+
+    request_table(const request_table&) = delete;
+    request_table& operator=(const request_table&) = delete;
+
+    /// Claim a slot for a new request. Returns none if the table is full
+    boost::optional<id_type> add(boost::future<json>& fut, clock::time_point deadline) {
+        for (std::size_t attempt = 0; attempt < _capacity; ++attempt) {
+            const auto index = _hint.fetch_add(1, std::memory_order_relaxed) & (_capacity - 1);
+            auto& s = _slots[index];
+            auto state = s.state.load(std::memory_order_relaxed);
+            if (_status(state) != slot_free)
+                continue;
+            const auto generation = _generation(state);
+            if (!s.state.compare_exchange_strong(state, _make_state(generation, slot_reserved),
+                                                 std::memory_order_acquire)) {
+                continue;
+            }
+            s.promise = boost::promise<json>{};
+            fut = s.promise.get_future();
+            s.deadline.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+            s.state.store(_make_state(generation, slot_pending), std::memory_order_release);
+            return (id_type(generation) << _index_bits) | index;
+        }
+        return boost::none;
+    }
+
+    /// Remove the request with the given ID and return its promise, or none
+    /// if no such request is pending (it may have timed out)
+    boost::optional<boost::promise<json>> take(id_type id) {
+        const auto index = id & (_capacity - 1);
+        const auto generation = id >> _index_bits;
+        // No request ever had a larger generation. Truncating it could make
+        // a bogus ID match a live request
+        if (generation > max_generation)
+            return boost::none;
+        return _take(_slots[index],
+                     _make_state(static_cast<std::uint32_t>(generation), slot_pending));
+    }
+
+    /// Fail every pending request whose deadline has passed
+    void expire(clock::time_point now) {
+        const auto now_ticks = now.time_since_epoch().count();
+        for (std::size_t index = 0; index < _capacity; ++index) {
+            auto& s = _slots[index];
+            const auto state = s.state.load(std::memory_order_acquire);
+            if (_status(state) != slot_pending
+                || s.deadline.load(std::memory_order_relaxed) > now_ticks) {
+                continue;
+            }
+            auto prom = _take(s, state);
+            if (prom) {
+                prom->set_exception(error{ error_code::internal_error, "Request timed out" });
+            }
+        }
+    }
+};
+}
+
+#endif  // CLS_JSON_RPC_REQUEST_TABLE_HPP_INCLUDED
@@ -1,6 +1,10 @@
 #ifndef JSON_RPC_SERIALIZE_HPP_INCLUDED
 #define JSON_RPC_SERIALIZE_HPP_INCLUDED
 
+#include "error.hpp"
+#include "json_reader.hpp"
+#include "json_writer.hpp"
+
 #include <mirror/mirror.hpp>
 
 #include <json.hpp>
@@ -8,6 +12,7 @@
 #include <boost/optional.hpp>
 #include <boost/thread/future.hpp>
 
+#include <limits>
 #include <string>
 #include <map>
 #include <vector>
@@ -26,14 +31,20 @@ json to_json(const T&);
 template <typename T>
 T from_json(const json&);
 
+template <typename T>
+raw_json to_raw_json(const T&);
+
 template <typename Result>
-boost::future<json> convert_result(boost::future<Result> fut) {
-    return fut.then([](boost::future<Result> f) {
+boost::future<raw_json> convert_result(boost::future<Result> fut) {
+    // Convert on the thread that finishes the result, rather than on a new one
+    return fut.then(boost::launch::sync, [](boost::future<Result> f) {
         try {
             auto res = f.get();
-            return to_json(res);
+            return to_raw_json(res);
+        } catch (const error&) {
+            throw;  // Reported to the client as an error response
         } catch (const std::exception& e) {
-            return json{ { "code", -1 }, { "message", e.what() } };
+            return to_raw_json(json{ { "code", -1 }, { "message", e.what() } });
         }
     });
 }
@@ -50,13 +61,34 @@ template <typename T> json to_json(const T& data) { return serializer<T>::save(d
 
 template <typename T> T from_json(const json& data) { return serializer<T>::load(data); }
 
+/// Read the next value of the reader directly into a T, without a DOM
+template <typename T> T read_json(json_reader& reader) { return serializer<T>::read(reader); }
+
+/// Serialize straight to JSON text, without a DOM
+template <typename T> raw_json to_raw_json(const T& data) {
+    json_writer w;
+    serializer<T>::write(w, data);
+    return raw_json{ w.release() };
+}
+
 template <typename Type> struct serializer_helpers {
     static Type load(const json& j) { return j.get<Type>(); }
     static Type load(const json& j, string key) { return serializer<Type>::load(j[key]); }
 
+    /// Types without a streaming reader go through a DOM of just their value
+    static Type read(json_reader& r) { return serializer<Type>::load(r.read_json()); }
+
     static json save(const Type& t) { return json(t); }
 
     static void save(json& out, string key, const Type& t) { out[key] = to_json(t); }
+
+    /// Types without a streaming writer go through a DOM of just their value
+    static void write(json_writer& w, const Type& t) { w.value(serializer<Type>::save(t)); }
+
+    static void write_member(json_writer& w, const string& key_literal, const Type& t) {
+        w.key_literal(key_literal);
+        serializer<Type>::write(w, t);
+    }
 };
 
 template <> struct serializer<json, void> : serializer_helpers<json> {
@@ -65,6 +97,8 @@ template <> struct serializer<json, void> : serializer_helpers<json> {
 
     static json load(const json& j) { return j; }
     static json save(const json& j) { return j; }
+    static json read(json_reader& r) { return r.read_json(); }
+    static void write(json_writer& w, const json& j) { w.value(j); }
 };
 
 template <typename Type> struct serializer<vector<Type>, void> : serializer_helpers<vector<Type>> {
@@ -78,6 +112,23 @@ template <typename Type> struct serializer<vector<Type>, void> : serializer_help
         }
         return ret;
     }
+
+    static void write(json_writer& w, const vector<Type>& items) {
+        w.begin_array();
+        for (auto&& item : items) {
+            serializer<Type>::write(w, item);
+        }
+        w.end_array();
+    }
+
+    static vector<Type> read(json_reader& r) {
+        vector<Type> ret;
+        r.begin_array();
+        while (r.next_element()) {
+            ret.push_back(serializer<Type>::read(r));
+        }
+        return ret;
+    }
 };
 
 template <typename ValueType>
@@ -100,12 +151,46 @@ struct serializer<map<string, ValueType>, void> : serializer_helpers<map<string,
         }
         return ret;
     }
+
+    static void write(json_writer& w, const map<string, ValueType>& data) {
+        w.begin_object();
+        for (const auto& pair : data) {
+            w.key(pair.first);
+            serializer<ValueType>::write(w, pair.second);
+        }
+        w.end_object();
+    }
+
+    static map<string, ValueType> read(json_reader& r) {
+        map<string, ValueType> ret;
+        string key;
+        r.begin_object();
+        while (r.next_member(key)) {
+            ret.emplace(key, serializer<ValueType>::read(r));
+        }
+        return ret;
+    }
 };
 
-template <> struct serializer<int, void> : serializer_helpers<int> {};
+template <> struct serializer<int, void> : serializer_helpers<int> {
+    static int read(json_reader& r) {
+        const auto value = r.read_integer();
+        if (value < std::numeric_limits<int>::min() || value > std::numeric_limits<int>::max()) {
+            throw error{ error_code::invalid_params, "Integer out of range" };
+        }
+        return static_cast<int>(value);
+    }
+    static void write(json_writer& w, int i) { w.value(i); }
+};
 template <> struct serializer<char, void> : serializer_helpers<char> {};
-template <> struct serializer<bool, void> : serializer_helpers<bool> {};
-template <> struct serializer<string, void> : serializer_helpers<string> {};
+template <> struct serializer<bool, void> : serializer_helpers<bool> {
+    static bool read(json_reader& r) { return r.read_bool(); }
+    static void write(json_writer& w, bool b) { w.value(b); }
+};
+template <> struct serializer<string, void> : serializer_helpers<string> {
+    static string read(json_reader& r) { return r.read_string(); }
+    static void write(json_writer& w, const string& str) { w.value(str); }
+};
 template <typename Type>
 struct serializer<optional<Type>, void> : serializer_helpers<optional<Type>> {
 
@@ -125,6 +210,13 @@ struct serializer<optional<Type>, void> : serializer_helpers<optional<Type>> {
         }
     }
 
+    static optional<Type> read(json_reader& r) {
+        if (r.read_null()) {
+            return boost::none;
+        }
+        return serializer<Type>::read(r);
+    }
+
     static optional<Type> load(const json& data, string key) {
         auto found = data.find(key);
         if (found == end(data)) {
@@ -138,6 +230,22 @@ struct serializer<optional<Type>, void> : serializer_helpers<optional<Type>> {
             out[key] = to_json(*o);
         }
     }
+
+    static void write(json_writer& w, const optional<Type>& o) {
+        if (o) {
+            serializer<Type>::write(w, *o);
+        } else {
+            w.null();
+        }
+    }
+
+    /// Like save(), leaves out the member entirely if it is empty
+    static void write_member(json_writer& w, const string& key_literal, const optional<Type>& o) {
+        if (o) {
+            w.key_literal(key_literal);
+            serializer<Type>::write(w, *o);
+        }
+    }
 };
 
 
@@ -175,6 +283,52 @@ struct serializer<Type, typename std::enable_if<mirror::is_reflected<Type>::valu
         save_nth(ret, data, typename mirror::reflect<Type>::first{});
         return ret;
     }
+
+    /// The escaped `"name":` for a member, built once
+    template <typename Member> static const string& key_literal() {
+        static const string literal = json_writer::make_key_literal(Member::name());
+        return literal;
+    }
+
+    static void write_nth(json_writer&, const Type&, mirror::tail_member<Type>) {}
+
+    template <typename Member> static void write_nth(json_writer& w, const Type& data, Member) {
+        serializer<typename Member::type>::write_member(w, key_literal<Member>(), Member::ref(data));
+        write_nth(w, data, typename Member::next{});
+    }
+
+    static void write(json_writer& w, const Type& data) {
+        w.begin_object();
+        write_nth(w, data, typename mirror::reflect<Type>::first{});
+        w.end_object();
+    }
+
+    static bool read_member(Type&, const string&, json_reader&, mirror::tail_member<Type>) {
+        return false;
+    }
+
+    template <typename Member>
+    static bool read_member(Type& out, const string& key, json_reader& r, Member) {
+        if (key == Member::name()) {
+            Member::ref(out) = serializer<typename Member::type>::read(r);
+            return true;
+        }
+        return read_member(out, key, r, typename Member::next{});
+    }
+
+    /// Members are filled in as their keys come up. Unknown members are
+    /// skipped, and missing ones are left value-initialized
+    static Type read(json_reader& r) {
+        Type ret{};
+        string key;
+        r.begin_object();
+        while (r.next_member(key)) {
+            if (!read_member(ret, key, r, typename mirror::reflect<Type>::first{})) {
+                r.skip();
+            }
+        }
+        return ret;
+    }
 };
 }
 
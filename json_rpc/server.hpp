@@ -5,15 +5,27 @@
 #include <boost/thread/future.hpp>
 
 #include <algorithm>
-#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
-#include <map>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <json.hpp>
 
+#include "cancellation.hpp"
+#include "error.hpp"
+#include "json_reader.hpp"
+#include "json_writer.hpp"
+#include "logging.hpp"
+#include "params_view.hpp"
+#include "request_table.hpp"
+#include "thread_pool.hpp"
+
 namespace json_rpc {
 
 using nlohmann::json;
@@ -26,128 +38,403 @@ namespace {
 transport_init_tag_t transport_init;
 }
 
-class error : public std::runtime_error {
-    int _code = -1;
+/// Computes the ordering key for a message, if it should be ordered
+using ordering_key_fn = std::function<boost::optional<std::string>(const std::string& method,
+                                                                   const params_view& params)>;
 
-public:
-    error(int code, std::string msg)
-        : runtime_error(msg)
-        , _code{ code } {}
+struct server_options {
+    /// The number of threads executing requests
+    unsigned worker_count = std::max(std::thread::hardware_concurrency(), 2u);
+    /// The number of dispatched messages that may wait for a worker before
+    /// reading stalls
+    std::size_t queue_capacity = 1024;
+    /// Messages with the same key are started in the order they arrived
+    ordering_key_fn ordering_key;
+    /// How long to wait for the response to one of our own requests
+    std::chrono::steady_clock::duration request_timeout = std::chrono::seconds(60);
 };
 
 template <typename Transport> class server {
 private:
     Transport _transporter;
-    std::atomic_int _request_id;
-    std::mutex _req_lock;
-    std::map<int, std::shared_ptr<boost::promise<json>>> _outstanding_requests;
-
-    void _fulfill_promise(const json& data,
-                          json::const_iterator result_iter,
-                          json::const_iterator error_iter) {
-        std::shared_ptr<boost::promise<json>> prom_ptr;
-        {
-            std::lock_guard<std::mutex> lk{ _req_lock };
-            auto id_iter = data.find("id");
-            if (id_iter == end(data)) {
-                OUTPUT_STREAM << "Invalid response: 'id' must exist for response/error objects "
-                              << std::endl;
-                std::terminate();
+    server_options _options;
+    request_table _outstanding_requests;
+    cancellation_registry _cancellations;
+
+    void _fulfill_promise(const boost::optional<json>& id,
+                          const boost::optional<json>& result,
+                          const boost::optional<json>& error_data) {
+        if (!id || !id->is_number_unsigned()) {
+            log::error("Invalid response: 'id' must be one we sent for response/error objects");
+            return;
+        }
+        auto prom = _outstanding_requests.take(id->get<request_table::id_type>());
+        if (!prom) {
+            log::warning("Dropping response to unknown or expired request ", id->dump());
+            return;
+        }
+        if (result) {
+            prom->set_value(*result);
+        } else {
+            auto msg_iter = error_data->find("message");
+            auto msg = msg_iter != end(*error_data) && msg_iter->is_string()
+                ? msg_iter->get<std::string>()
+                : "No message attached to error";
+            auto code_iter = error_data->find("code");
+            auto code = code_iter != end(*error_data) && code_iter->is_number_integer()
+                ? code_iter->get<int>()
+                : -1;
+            log::warning("Got an error: ", msg);
+            prom->set_exception(error{ code, msg });
+        }
+    }
+
+    static void _begin_response(json_writer& w, const json& id) {
+        static const std::string id_key = json_writer::make_key_literal("id");
+        static const std::string version_key = json_writer::make_key_literal("jsonrpc");
+        w.begin_object();
+        w.key_literal(id_key);
+        w.value(id);
+        w.key_literal(version_key);
+        w.value("2.0");
+    }
+
+    static std::string _error_response(const json& id, int code, const std::string& message) {
+        static const std::string error_key = json_writer::make_key_literal("error");
+        static const std::string code_key = json_writer::make_key_literal("code");
+        static const std::string message_key = json_writer::make_key_literal("message");
+        json_writer w;
+        _begin_response(w, id);
+        w.key_literal(error_key);
+        w.begin_object();
+        w.key_literal(code_key);
+        w.value(code);
+        w.key_literal(message_key);
+        w.value(message);
+        w.end_object();
+        w.end_object();
+        return w.release();
+    }
+
+    /// Build the response for a finished request. The result is spliced in
+    /// as it is. Exceptions become error responses, keeping the code of
+    /// json_rpc::errors
+    static std::string _make_response(const json& id, future<raw_json>& result) {
+        static const std::string result_key = json_writer::make_key_literal("result");
+        try {
+            auto res = result.get();
+            json_writer w{ res.text.size() + 64 };
+            _begin_response(w, id);
+            w.key_literal(result_key);
+            w.raw(res.text);
+            w.end_object();
+            return w.release();
+        } catch (const error& e) {
+            return _error_response(id, e.code(), e.what());
+        } catch (const std::exception& e) {
+            return _error_response(id, error_code::internal_error, e.what());
+        }
+    }
+
+    /// Run a request or notification on the current thread. The response to
+    /// a request is delivered through `response` once the handler finishes
+    template <typename Func>
+    void _invoke(Func& fn,
+                 const std::string& method,
+                 const params_view& params,
+                 const boost::optional<json>& id,
+                 const cancellation_token& token,
+                 std::shared_ptr<boost::promise<std::string>> response) {
+        if (!id) {
+            // Notifications don't get a response, and can't be cancelled
+            try {
+                fn(method, params, cancellation_token{});
+            } catch (const std::exception& e) {
+                log::error("Unhandled exception while executing '", method, "': ", e.what());
             }
-            auto id = static_cast<int>(*id_iter);
-            auto prom = _outstanding_requests.find(id);
-            if (prom == end(_outstanding_requests)) {
-                OUTPUT_STREAM << "Invalid response: No promise with ID " << id << std::endl;
-                std::terminate();
+            return;
+        }
+
+        boost::optional<future<raw_json>> maybe_fut;
+        try {
+            // We may have been cancelled while waiting for a worker
+            token.throw_if_cancelled();
+            maybe_fut = fn(method, params, token);
+        } catch (const error& e) {
+            maybe_fut = boost::make_exceptional_future<raw_json>(e);
+        } catch (const std::exception& e) {
+            log::error("Unhandled exception while executing '", method, "': ", e.what());
+            maybe_fut = boost::make_exceptional_future<raw_json>(
+                error{ error_code::internal_error, e.what() });
+        }
+        if (!maybe_fut) {
+            maybe_fut = boost::make_ready_future(raw_json{ "null" });
+        }
+        // Respond on whichever thread finishes the request, or right here if
+        // it already has. The default policy would start a thread of its own
+        // for every continuation
+        maybe_fut->then(boost::launch::sync,
+                        [this, id, token, response](future<raw_json> result) {
+                            _cancellations.remove(*id, token);
+                            response->set_value(_make_response(*id, result));
+                        });
+    }
+
+    /**
+     * Dispatch a single message, which may be an element of a batch.
+     *
+     * Only the envelope is parsed here; `params` are passed on as raw text
+     * for the handler to read into whatever type it expects. Responses to
+     * our own requests are handled right away. Requests and notifications
+     * are queued on the pool; for requests, the returned future becomes ready
+     * with the response once the request has been executed.
+     */
+    template <typename Func>
+    boost::optional<future<std::string>> _dispatch(Func& fn,
+                                            const char* first,
+                                            const char* last,
+                                            thread_pool& pool,
+                                            keyed_serializer& ordered) {
+        json_reader reader{ first, last };
+        if (reader.peek() != json_reader::token::object) {
+            reader.skip();
+            reader.expect_end();
+            log::error("Invalid request, expected an object");
+            return boost::make_ready_future(_error_response(
+                nullptr, error_code::invalid_request, "Invalid request, expected an object"));
+        }
+
+        boost::optional<json> id;
+        boost::optional<std::string> method;
+        bool method_valid = true;
+        params_view params;
+        boost::optional<json> result;
+        boost::optional<json> error_data;
+        std::string key;
+        reader.begin_object();
+        while (reader.next_member(key)) {
+            if (key == "id") {
+                id = reader.read_json();
+            } else if (key == "method") {
+                method_valid = reader.peek() == json_reader::token::string;
+                if (method_valid) {
+                    method = reader.read_string();
+                } else {
+                    reader.skip();
+                }
+            } else if (key == "params") {
+                const auto raw = reader.raw_value();
+                params = params_view{ std::string(raw.first, raw.second) };
+            } else if (key == "result") {
+                result = reader.read_json();
+            } else if (key == "error") {
+                error_data = reader.read_json();
+            } else {
+                reader.skip();
             }
-            prom_ptr = prom->second;
-            _outstanding_requests.erase(prom);
-        }
-        assert(prom_ptr);
-        if (result_iter != end(data)) {
-            prom_ptr->set_value(*result_iter);
-        } else if (error_iter != end(data)) {
-            auto& error_data = *error_iter;
-            auto msg_iter = error_data.find("message");
-            auto msg = msg_iter != end(error_data) ? msg_iter->operator std::string()
-                                                   : "No message attached to error";
-            auto code_iter = error_data.find("code");
-            auto code = code_iter != end(error_data) ? int(*code_iter) : -1;
-            OUTPUT_STREAM << "Got an error: " << msg << std::endl;
-            prom_ptr->set_exception(error{ code, msg });
+        }
+        reader.expect_end();
+
+        // Check if this message fulfills a request
+        if (result || error_data) {
+            _fulfill_promise(id, result, error_data);
+            return boost::none;
+        }
+
+        // If not, it must be a request/notification
+        if (!method || !method_valid) {
+            log::error("Invalid body: 'method' must be a string");
+            return boost::make_ready_future(_error_response(id ? *id : json(nullptr),
+                                                            error_code::invalid_request,
+                                                            "'method' must be a string"));
+        }
+
+        if (*method == "$/cancelRequest") {
+            _cancel_request(params);
+            return boost::none;
+        }
+
+        auto key_for_order = _options.ordering_key ? _options.ordering_key(*method, params)
+                                                   : boost::optional<std::string>{};
+        // Register before queueing, so that a cancellation can reach us
+        // while we wait for a worker
+        const auto token = id ? _cancellations.add(*id) : cancellation_token{};
+        std::shared_ptr<boost::promise<std::string>> response;
+        boost::optional<future<std::string>> response_fut;
+        if (id) {
+            response = std::make_shared<boost::promise<std::string>>();
+            response_fut = response->get_future();
+        }
+        auto task = [ this, &fn, method = std::move(*method), params = std::move(params), id, token,
+                      response ] { _invoke(fn, method, params, id, token, response); };
+        if (!key_for_order) {
+            pool.post(std::move(task));
+        } else if (!id) {
+            ordered.post(*key_for_order, std::move(task));
         } else {
-            std::terminate();
+            // Wait our turn, but don't hold up the notifications behind us
+            ordered.post(*key_for_order, [&pool, task] { pool.post(task); });
+        }
+        return response_fut;
+    }
+
+    /**
+     * Dispatch every element of a batch, and answer with a single array once
+     * all requests in it have finished. Elements run concurrently, subject to
+     * the same ordering keys as individual messages. A batch of only
+     * notifications and responses gets no reply.
+     */
+    template <typename Func>
+    boost::optional<future<std::string>> _dispatch_batch(Func& fn,
+                                                  const char* first,
+                                                  const char* last,
+                                                  thread_pool& pool,
+                                                  keyed_serializer& ordered) {
+        // Find all elements first, so that a malformed batch is rejected as a
+        // whole before any of it runs
+        std::vector<std::pair<const char*, const char*>> elements;
+        json_reader reader{ first, last };
+        reader.begin_array();
+        while (reader.next_element()) {
+            elements.push_back(reader.raw_value());
+        }
+        reader.expect_end();
+
+        if (elements.empty()) {
+            log::error("Invalid request, empty batch");
+            return boost::make_ready_future(
+                _error_response(nullptr, error_code::invalid_request, "Empty batch"));
+        }
+        std::vector<future<std::string>> responses;
+        responses.reserve(elements.size());
+        for (const auto& element : elements) {
+            auto maybe_fut = _dispatch(fn, element.first, element.second, pool, ordered);
+            if (maybe_fut) {
+                responses.push_back(std::move(*maybe_fut));
+            }
+        }
+        if (responses.empty()) {
+            return boost::none;
+        }
+        return boost::when_all(responses.begin(), responses.end())
+            .then(boost::launch::sync, [](future<std::vector<future<std::string>>> all) {
+                json_writer w;
+                w.begin_array();
+                for (auto& fut : all.get()) {
+                    w.raw(fut.get());
+                }
+                w.end_array();
+                return w.release();
+            });
+    }
+
+    /// Handle `$/cancelRequest` right away on the reading thread
+    void _cancel_request(const params_view& params) {
+        boost::optional<json> id;
+        auto reader = params.reader();
+        if (reader.peek() == json_reader::token::object) {
+            std::string key;
+            reader.begin_object();
+            while (reader.next_member(key)) {
+                if (key == "id") {
+                    id = reader.read_json();
+                } else {
+                    reader.skip();
+                }
+            }
+        }
+        if (!id) {
+            log::warning("Ignoring $/cancelRequest without an 'id'");
+            return;
+        }
+        if (!_cancellations.cancel(*id)) {
+            log::debug("Got $/cancelRequest for ", id->dump(), ", which is not in flight");
         }
     }
 
 public:
     template <typename... Args>
     server(Args&&... args)
-        : _transporter(std::forward<Args>(args)...) {
-        _request_id = 0;
-    }
+        : _transporter(std::forward<Args>(args)...) {}
 
-    template <typename Func> int run(Func&& fn) {
-        _transporter.run([this, fn](const json& data) -> boost::optional<future<json>> {
-            if (!data.is_object()) {
-                OUTPUT_STREAM << "Invalid JSON, expected an object or array" << std::endl;
-                return boost::make_exceptional_future<json>(
-                    std::invalid_argument("Invalid JSON, expected on object or array"));
-            }
+    /// Configure how requests are executed. Must be called before run()
+    void configure(server_options opts) { _options = std::move(opts); }
 
-            // Check if this message fulfills a request
-            const auto result_iter = data.find("result");
-            const auto error_iter = data.find("error");
-            if (result_iter != end(data) || error_iter != end(data)) {
-                _fulfill_promise(data, result_iter, error_iter);
-                return boost::none;
-            }
+    /**
+     * Read and dispatch messages until the transport closes.
+     *
+     * Responses to our own requests are handled on the reading thread.
+     * Requests and notifications are executed on a pool of worker threads,
+     * including each element of a batch.
+     * Notifications that share an ordering key run in the order they
+     * arrived, and a request with a key starts only once the notifications
+     * before it have finished.
+     */
+    template <typename Func> int run(Func&& fn) {
+        thread_pool pool{ _options.worker_count, _options.queue_capacity };
+        keyed_serializer ordered{ pool };
 
-            // If not, it must be a request/notification
-            auto method_json = data["method"];
-            if (!method_json.is_string()) {
-                OUTPUT_STREAM << "Invalid body: 'method' must be a string\n";
-                return boost::make_exceptional_future<json>(
-                    std::invalid_argument("Invalid body: 'method' must be a string."));
+        // Periodically fail our own requests that never got a response
+        std::mutex sweep_lock;
+        std::condition_variable sweep_cond;
+        bool done_reading = false;
+        std::thread sweeper{ [&] {
+            std::unique_lock<std::mutex> lk{ sweep_lock };
+            while (!sweep_cond.wait_for(lk, std::chrono::seconds(1), [&] { return done_reading; })) {
+                _outstanding_requests.expire(request_table::clock::now());
             }
-            auto method = method_json.operator std::string();
-            auto params_iter = data.find("params");
-            auto params = params_iter == end(data) ? json{} : *params_iter;
+        } };
 
-            auto maybe_fut = fn(method, params);
-            if (maybe_fut) {
-                return maybe_fut->then([data](future<json> result) -> json {
-                    if (result.has_exception())
-                        std::terminate();
-
-                    json ret;
-                    auto id_iter = data.find("id");
-                    if (id_iter != end(data)) {
-                        ret["id"] = data["id"];
-                    }
-                    ret["jsonrpc"] = "2.0";
-                    ret["result"] = result.get();
-                    return ret;
-                });
+        _transporter.run([this, &fn, &pool, &ordered](
+            const char* first, const char* last) -> boost::optional<future<std::string>> {
+            try {
+                json_reader reader{ first, last };
+                if (reader.peek() == json_reader::token::array) {
+                    return _dispatch_batch(fn, first, last, pool, ordered);
+                }
+                return _dispatch(fn, first, last, pool, ordered);
+            } catch (const error& e) {
+                log::error("Invalid message: ", e.what());
+                return boost::make_ready_future(
+                    _error_response(nullptr, error_code::parse_error, e.what()));
+            } catch (const json::parse_error& e) {
+                log::error("Invalid message: ", e.what());
+                return boost::make_ready_future(
+                    _error_response(nullptr, error_code::parse_error, e.what()));
+            } catch (const std::exception& e) {
+                // Anything else is our fault rather than the client's, but
+                // must not take down the reading thread
+                log::error("Failed to dispatch message: ", e.what());
+                return boost::make_ready_future(
+                    _error_response(nullptr, error_code::internal_error, e.what()));
             }
-            return boost::none;
         });
+        {
+            std::lock_guard<std::mutex> lk{ sweep_lock };
+            done_reading = true;
+        }
+        sweep_cond.notify_one();
+        sweeper.join();
+        // Let everything already dispatched finish before `ordered` goes away
+        pool.join();
         return 0;
     }
 
     boost::future<json> send_request(std::string method, json data) {
-        auto prom = std::make_shared<boost::promise<json>>();
-        auto id = _request_id.fetch_add(1);
-        auto iter = _outstanding_requests.find(id);
-        assert(iter == end(_outstanding_requests));
-        _outstanding_requests.insert(std::make_pair(id, prom));
+        boost::future<json> fut;
+        const auto deadline = request_table::clock::now() + _options.request_timeout;
+        const auto id = _outstanding_requests.add(fut, deadline);
+        if (!id) {
+            return boost::make_exceptional_future<json>(
+                error{ error_code::internal_error, "Too many outstanding requests" });
+        }
         json msg;
-        msg["id"] = id;
+        msg["id"] = *id;
         msg["jsonrpc"] = "2.0";
         msg["method"] = method;
         msg["params"] = data;
         _transporter.send_message(msg);
-        return prom->get_future();
+        return fut;
     }
 
     void send_notification(std::string method, json data) {
@@ -159,7 +446,8 @@ public:
     }
 };
 
-using method_handler = std::function<boost::future<json>(const std::string&, const json&)>;
+using method_handler = std::function<boost::optional<boost::future<raw_json>>(
+    const std::string&, const params_view&, const cancellation_token&)>;
 }
 
 #endif  // CLS_JSON_RPC_SERVER_HPP_INCLUDED
\ No newline at end of file
@@ -4,30 +4,99 @@
 #ifdef _WIN32
 #include "windows_stdin_stream.hpp"
 #else
+#include <poll.h>
 #include <unistd.h>
+#include <boost/asio/posix/stream_descriptor.hpp>
 #endif
 
+#include "logging.hpp"
 #include "stream_transport.hpp"
 
-#include <ostream>
-#include <fstream>
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <system_error>
 
 
 namespace json_rpc
 {
 
-static std::ofstream stdin_log{ "cls-stdin.log" };
-static std::ofstream stdout_log{ "cls-stdout.log" };
-
 class stdio_transport
 {
+    std::size_t _read_size;
+
+    /// Set once writing has failed; reads report EOF from then on
+    std::atomic<bool> _shut_down{ false };
+
+    #ifndef _WIN32
+    asio::io_service _ios;
+    asio::posix::stream_descriptor _stdin{ _ios };
+    asio::posix::stream_descriptor _stdout{ _ios };
+    /// Written to by _shutdown() to wake a read() waiting on stdin
+    int _wake[2] = { -1, -1 };
+    #endif
+
+    void _shutdown()
+    {
+        if (_shut_down.exchange(true))
+            return;
+        #ifndef _WIN32
+        const char c = 0;
+        while (::write(_wake[1], &c, 1) < 0 && errno == EINTR) {
+        }
+        #endif
+    }
+
 public:
-    stdio_transport() {}
+    /// The default amount of data we ask for on each read. Large enough that
+    /// a multi-megabyte document arrives in a handful of syscalls.
+    static constexpr std::size_t default_read_size = 64 * 1024;
+
+    explicit stdio_transport(std::size_t read_size = default_read_size)
+        : _read_size(read_size)
+    {
+        #ifndef _WIN32
+        // The descriptor stays in blocking mode: O_NONBLOCK would be set on
+        // the file description the dup shares with fd 0, and so leak to
+        // anything else reading stdin. Readiness is asked of poll() instead,
+        // which unlike epoll also works when stdin is a regular file
+        const auto dup = [](int fd) {
+            const auto ret = ::dup(fd);
+            if (ret == -1)
+                throw std::system_error(errno, std::system_category(), "dup");
+            return ret;
+        };
+        _stdin.assign(dup(STDIN_FILENO));
+        _stdout.assign(dup(STDOUT_FILENO));
+        if (::pipe(_wake) != 0)
+            throw std::system_error(errno, std::system_category(), "pipe");
+        // A client that goes away should make write() fail, not kill us
+        ::signal(SIGPIPE, SIG_IGN);
+        #endif
+    }
 
-    bool read(std::ostream& out)
+    ~stdio_transport()
     {
-        char buffer[256];
+        #ifndef _WIN32
+        ::close(_wake[0]);
+        ::close(_wake[1]);
+        #endif
+    }
+
+    stdio_transport(const stdio_transport&) = delete;
+    stdio_transport& operator=(const stdio_transport&) = delete;
+
+    /// The number of bytes callers should make room for on each read()
+    std::size_t read_chunk_size() const { return _read_size; }
 
+    /// Read up to `size` bytes from stdin into `dest`. Returns zero at EOF.
+    std::size_t read(char* dest, std::size_t size)
+    {
+        if (_shut_down)
+            return 0;
         #ifdef _WIN32
         static const auto input = ::GetStdHandle(STD_INPUT_HANDLE);
         DWORD old_console_flags;
@@ -36,53 +105,78 @@ public:
         ::SetConsoleMode(input, console_flags);
         DWORD nread = 0;
         ::WaitForSingleObject(input, 100);
-        const auto did_read = ::ReadFile(input, buffer, sizeof buffer, &nread, nullptr);
+        const auto did_read = ::ReadFile(input, dest, static_cast<DWORD>(size), &nread, nullptr);
         if (!did_read)
         {
             auto err = std::error_code(::GetLastError(), std::system_category());
             if (err == std::errc::broken_pipe || err.value() == ERROR_BROKEN_PIPE)
-                return false;
+                return 0;
             std::cerr << err.value() << ": " << err.message() << std::endl;
             throw std::system_error(err, "Ouch");
         }
         ::SetConsoleMode(input, old_console_flags);
-        if (nread == 0)
-            return false;
-
-        out.write(buffer, nread);
-        return true;
         #else
-        const auto nread = ::read(STDIN_FILENO, buffer, sizeof buffer);
+        // Block until stdin is readable or the transport is shut down
+        pollfd fds[2] = { { _stdin.native_handle(), POLLIN, 0 }, { _wake[0], POLLIN, 0 } };
+        while (::poll(fds, 2, -1) < 0) {
+            if (errno != EINTR)
+                return 0;
+        }
+        if (fds[1].revents || _shut_down)
+            return 0;
+        boost::system::error_code ec;
+        auto nread = _stdin.read_some(asio::buffer(dest, size), ec);
+        if (ec)
+            return 0;
+        // Keep draining what's already there until the caller's buffer is full
+        while (nread < size) {
+            pollfd ready = { _stdin.native_handle(), POLLIN, 0 };
+            if (::poll(&ready, 1, 0) <= 0)
+                break;
+            const auto more = _stdin.read_some(asio::buffer(dest + nread, size - nread), ec);
+            if (ec)
+                break;  // EOF, which the next read() will report
+            nread += more;
+        }
         #endif
 
-        if (nread == 0)
-            return false;
-
-        stdin_log.write(buffer, nread);
-        stdin_log.flush();
-        out.write(buffer, nread);
-        out.flush();
-        return true;
+        return static_cast<std::size_t>(nread);
     }
 
-    void write(std::string str)
+    /// Write a sequence of buffers to stdout, in as few syscalls as possible.
+    /// If that fails, the transport is shut down: the output is gone, so
+    /// there is no point in reading any more requests
+    template <typename ConstBufferSequence>
+    void write(const ConstBufferSequence& buffers)
     {
+        if (_shut_down)
+            return;
         #ifdef _WIN32
         static const auto output = ::GetStdHandle(STD_OUTPUT_HANDLE);
 
-        auto remaining = str.size();
-        auto data = str.data();
-        while (remaining) {
-            DWORD nwritten = 0;
-            ::WriteFile(output, data, static_cast<DWORD>(remaining), &nwritten, nullptr);
-            remaining -= nwritten;
-            data += nwritten;
+        for (const auto& buf : buffers) {
+            auto remaining = asio::buffer_size(buf);
+            auto data = asio::buffer_cast<const char*>(buf);
+            while (remaining) {
+                DWORD nwritten = 0;
+                if (!::WriteFile(output, data, static_cast<DWORD>(remaining), &nwritten, nullptr)) {
+                    const auto err = std::error_code(::GetLastError(), std::system_category());
+                    log::error("Failed to write to stdout: ", err.message());
+                    _shutdown();
+                    return;
+                }
+                remaining -= nwritten;
+                data += nwritten;
+            }
         }
         #else
-        stdout_log.write(str.data(), str.size());
-        stdout_log.flush();
-        std::cout.write(str.data(), str.size());
-        std::cout.flush();
+        // Gathers the whole sequence into writev() calls
+        boost::system::error_code ec;
+        asio::write(_stdout, buffers, ec);
+        if (ec) {
+            log::error("Failed to write to stdout: ", ec.message());
+            _shutdown();
+        }
         #endif
     }
 };
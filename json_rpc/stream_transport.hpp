@@ -1,6 +1,7 @@
 #ifndef CLS_JSON_RPC_STREAM_TRANSPORT_HPP_INCLUDED
 #define CLS_JSON_RPC_STREAM_TRANSPORT_HPP_INCLUDED
 
+#include <algorithm>
 #include <functional>
 #include <string>
 
@@ -42,24 +43,36 @@ public:
     {
     }
 
-    bool read(std::ostream& buf)
+    std::size_t read_chunk_size() const { return 4096; }
+
+    std::size_t read(char* dest, std::size_t size)
     {
-        auto in = std::istreambuf_iterator<char>(_input_stream);
-        auto out = std::ostreambuf_iterator<char>(buf);
-        if (!_input_stream.rdbuf()->in_avail())
+        std::size_t nread = 0;
+        if (_input_stream.rdbuf()->in_avail() <= 0)
         {
+            // Block for a single character, then take whatever else is ready
+            const auto c = _input_stream.get();
             if (!_input_stream)
-                return false;
-            *out = *in;
+                return 0;
+            *dest++ = static_cast<char>(c);
+            --size;
+            ++nread;
         }
-        const auto avail = _input_stream.rdbuf()->in_avail();
-        std::copy_n(in, avail, out);
-        return true;
+        const auto avail = static_cast<std::size_t>(
+            std::max<std::streamsize>(_input_stream.rdbuf()->in_avail(), 0));
+        return nread + static_cast<std::size_t>(
+            _input_stream.readsome(dest, static_cast<std::streamsize>(std::min(avail, size))));
     }
 
-    void write(std::string str)
+    template <typename ConstBufferSequence>
+    void write(const ConstBufferSequence& buffers)
     {
-        _output_stream.write(str.data(), str.size());
+        for (const auto& buf : buffers)
+        {
+            _output_stream.write(asio::buffer_cast<const char*>(buf),
+                                 asio::buffer_size(buf));
+        }
+        _output_stream.flush();
     }
 
     void run()
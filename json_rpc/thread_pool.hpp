@@ -0,0 +1,246 @@
+#ifndef CLS_JSON_RPC_THREAD_POOL_HPP_INCLUDED
+#define CLS_JSON_RPC_THREAD_POOL_HPP_INCLUDED
+
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace json_rpc {
+
+/**
+ * A fixed-size pool of worker threads with one task queue per worker.
+ *
+ * Tasks posted from outside the pool are spread across the workers' queues;
+ * tasks posted from a worker go to that worker's own queue. A worker takes
+ * from the front of its own queue and, when that runs dry, steals from the
+ * back of the others before going to sleep.
+ *
+ * The pool is bounded: once `capacity` tasks are waiting, posting from
+ * outside the pool blocks until a worker picks something up. Posting from a
+ * worker never blocks, so tasks may always spawn more tasks.
+ *
+ * A task that throws has its exception logged; the worker carries on.
+ */
+class thread_pool {
+public:
+    using task = std::function<void()>;
+
+private:
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> _queues;
+    std::vector<std::thread> _threads;
+    std::size_t _capacity;
+
+    std::mutex _state_lock;
+    std::condition_variable _work_available;
+    std::condition_variable _space_available;
+    std::size_t _pending = 0;
+    std::size_t _next_queue = 0;
+    bool _stopping = false;
+
+    /// The pool and queue index owned by the calling thread, if it is a worker
+    struct worker_identity {
+        const thread_pool* pool = nullptr;
+        std::size_t index = 0;
+    };
+    static worker_identity& _current_worker() {
+        static thread_local worker_identity ident;
+        return ident;
+    }
+
+    bool _try_pop(std::size_t index, task& out) {
+        auto& own = *_queues[index];
+        {
+            std::lock_guard<std::mutex> lk{ own.lock };
+            if (!own.tasks.empty()) {
+                out = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (std::size_t off = 1; off < _queues.size(); ++off) {
+            auto& victim = *_queues[(index + off) % _queues.size()];
+            std::lock_guard<std::mutex> lk{ victim.lock };
+            if (!victim.tasks.empty()) {
+                out = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void _work(std::size_t index) {
+        _current_worker().pool = this;
+        _current_worker().index = index;
+        task t;
+        while (true) {
+            if (_try_pop(index, t)) {
+                {
+                    std::lock_guard<std::mutex> lk{ _state_lock };
+                    --_pending;
+                }
+                _space_available.notify_one();
+                try {
+                    t();
+                } catch (const std::exception& e) {
+                    log::error("Unhandled exception in a worker thread: ", e.what());
+                } catch (...) {
+                    log::error("Unhandled exception in a worker thread");
+                }
+                t = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lk{ _state_lock };
+            _work_available.wait(lk, [this] { return _stopping || _pending != 0; });
+            if (_stopping && _pending == 0)
+                return;
+        }
+    }
+
+public:
+    explicit thread_pool(unsigned nthreads = std::thread::hardware_concurrency(),
+                         std::size_t capacity = 1024)
+        : _capacity(std::max<std::size_t>(capacity, 1)) {
+        nthreads = std::max(nthreads, 1u);
+        for (unsigned i = 0; i < nthreads; ++i) {
+            _queues.emplace_back(new worker_queue);
+        }
+        for (unsigned i = 0; i < nthreads; ++i) {
+            _threads.emplace_back([this, i] { _work(i); });
+        }
+    }
+
+    ~thread_pool() { join(); }
+
+    /// Finishes all outstanding tasks, then joins the workers. No tasks may be
+    /// posted from outside the pool afterwards
+    void join() {
+        {
+            std::lock_guard<std::mutex> lk{ _state_lock };
+            _stopping = true;
+        }
+        _work_available.notify_all();
+        for (auto& thr : _threads) {
+            if (thr.joinable())
+                thr.join();
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    std::size_t size() const { return _threads.size(); }
+    std::size_t capacity() const { return _capacity; }
+    /// Whether the calling thread is one of the pool's workers
+    bool is_worker() const { return _current_worker().pool == this; }
+
+    void post(task t) {
+        const auto& self = _current_worker();
+        std::size_t index;
+        {
+            // The task is counted before a worker can see it, so that taking
+            // it never brings the count below zero
+            std::unique_lock<std::mutex> lk{ _state_lock };
+            if (self.pool == this) {
+                index = self.index;
+            } else {
+                _space_available.wait(lk, [this] { return _pending < _capacity; });
+                index = _next_queue++ % _queues.size();
+            }
+            ++_pending;
+        }
+        {
+            std::lock_guard<std::mutex> lk{ _queues[index]->lock };
+            _queues[index]->tasks.push_back(std::move(t));
+        }
+        _work_available.notify_one();
+    }
+};
+
+/**
+ * Runs tasks that share a key one after another, in the order they were
+ * posted, while tasks with different keys run concurrently on the pool.
+ *
+ * Tasks waiting behind another with the same key count against the pool's
+ * capacity: once that many are waiting, posting from outside the pool
+ * blocks, as thread_pool::post does.
+ */
+class keyed_serializer {
+    thread_pool& _pool;
+    std::mutex _lock;
+    std::condition_variable _space_available;
+    /// Tasks waiting behind the one currently running for each busy key
+    std::map<std::string, std::deque<thread_pool::task>> _waiting;
+    /// The number of tasks in `_waiting`
+    std::size_t _queued = 0;
+
+    /// Start the next task for `key`, or mark the key idle if there is none
+    void _next(const std::string& key) {
+        thread_pool::task next;
+        {
+            std::lock_guard<std::mutex> lk{ _lock };
+            auto iter = _waiting.find(key);
+            assert(iter != _waiting.end());
+            if (iter->second.empty()) {
+                _waiting.erase(iter);
+                return;
+            }
+            next = std::move(iter->second.front());
+            iter->second.pop_front();
+            --_queued;
+        }
+        _space_available.notify_one();
+        _run(key, std::move(next));
+    }
+
+    void _run(std::string key, thread_pool::task t) {
+        _pool.post([this, key, t] {
+            // Even if `t` throws, the key must move on to its next task
+            struct next_guard {
+                keyed_serializer& self;
+                const std::string& key;
+                ~next_guard() { self._next(key); }
+            } guard{ *this, key };
+            t();
+        });
+    }
+
+public:
+    explicit keyed_serializer(thread_pool& pool)
+        : _pool(pool) {}
+
+    void post(const std::string& key, thread_pool::task t) {
+        {
+            std::unique_lock<std::mutex> lk{ _lock };
+            if (!_pool.is_worker()) {
+                _space_available.wait(lk, [this] { return _queued < _pool.capacity(); });
+            }
+            auto iter = _waiting.find(key);
+            if (iter != _waiting.end()) {
+                iter->second.push_back(std::move(t));
+                ++_queued;
+                return;
+            }
+            _waiting.emplace(key, std::deque<thread_pool::task>{});
+        }
+        _run(key, std::move(t));
+    }
+};
+}
+
+#endif  // CLS_JSON_RPC_THREAD_POOL_HPP_INCLUDED
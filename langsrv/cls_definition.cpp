@@ -0,0 +1,86 @@
+#include "language_service.hpp"
+
+#include "types.hpp"
+#include "uri.hpp"
+
+using namespace cls;
+using namespace langsrv;
+
+namespace {
+
+/// The declaration the cursor at `offset` in the unit's main file is on or
+/// refers to, or a null cursor
+clangxx::Cursor declarationAt(clangxx::TranslationUnit& unit, unsigned offset) {
+    const auto cursor = unit.cursorAt(unit.locationAtOffset(offset));
+    const auto decl = cursor.referenced();
+    if (decl.isNull() && cursor.isDeclaration())
+        return cursor;
+    return decl;
+}
+
+bool isConstructorOrDestructor(const clangxx::Cursor& cursor) {
+    const auto kind = cursor.kind();
+    return kind == clangxx::Cursor::Constructor || kind == clangxx::Cursor::Destructor;
+}
+}
+
+std::vector<Location> LanguageService::definition(const TextDocumentPositionParams& params) {
+    const auto& uri = params.textDocument.uri;
+    const auto unsaved = _unsavedBuffers();
+    auto lease = _parseDocument(uri, unsaved);
+    const auto snapshot = _documents.snapshot(uri);
+    if (!lease || !lease->valid() || !snapshot)
+        return {};
+    const Document doc{ snapshot->version, *snapshot->text };
+    const auto offset = static_cast<unsigned>(doc.offsetAt(params.position));
+    const auto decl = declarationAt(lease->unit(), offset);
+    if (decl.isNull())
+        return {};
+
+    // Where the name of `cursor` is, as the client needs it
+    const auto located = [&](const clangxx::Cursor& cursor) {
+        std::vector<Location> ret;
+        const auto location = cursor.location();
+        const auto file = location.filename();
+        if (file.empty())
+            return ret;
+        // Clang reports paths relative to where the unit was compiled
+        const auto path = normalizePath(file, lease->directory());
+        const OccurrencesByFile found{ { path, { location.offset() } } };
+        for (const auto& pair : _rangesOf(found, cursor.spelling().size(), unsaved)) {
+            for (const auto& range : pair.second) {
+                Location loc;
+                loc.uri = _uriOf(pair.first, uri);
+                loc.range = range;
+                ret.push_back(std::move(loc));
+            }
+        }
+        return ret;
+    };
+
+    // The unit defines it, as with anything in the document itself or in an
+    // inline function or template in a header
+    const auto def = decl.definition();
+    if (!def.isNull())
+        return located(def);
+
+    // Otherwise another unit does. Rather than parse it, ask the index. That
+    // records constructors and destructors as naming their class, so it
+    // cannot tell where they are defined
+    const auto index = _indexer.index();
+    const auto usr = decl.USR();
+    if (index && index->unitCount() && !usr.empty() && !isConstructorOrDestructor(decl)) {
+        std::vector<Location> ret;
+        for (const auto& occurrence : index->occurrences(usr, { OccurrenceRole::Definition })) {
+            Location location;
+            location.uri = _uriOf(occurrence.file, uri);
+            location.range = occurrence.range;
+            ret.push_back(std::move(location));
+        }
+        if (!ret.empty())
+            return ret;
+    }
+
+    // Not indexed, or only ever declared: the declaration is the best we have
+    return located(decl);
+}
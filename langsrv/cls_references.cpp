@@ -0,0 +1,71 @@
+#include "language_service.hpp"
+
+#include "opt_bind.hpp"
+
+#include "types.hpp"
+
+#include "compilation_database.hpp"
+
+#include <set>
+#include <tuple>
+
+using namespace cls;
+using namespace langsrv;
+using namespace langsrv::optional_bind_op;
+
+future<std::vector<Location>> LanguageService::references(const ReferenceParams& params,
+                                                          const cancellation_token& cancel) {
+    const auto uri = params.textDocument.uri;
+    const auto unsaved = _unsavedBuffers();
+    const auto target = _symbolAt(uri, params.position, unsaved);
+    if (!target)
+        return boost::make_ready_future(std::vector<Location>{});
+
+    std::vector<OccurrenceRole> roles{ OccurrenceRole::Reference };
+    if (params.context.includeDeclaration) {
+        roles.push_back(OccurrenceRole::Declaration);
+        roles.push_back(OccurrenceRole::Definition);
+    }
+    return getCompilationDatabasePath().then([=](future<GetCompilationDatabasePathResult> fut) {
+        auto res = fut.get();
+        cancel.throw_if_cancelled();
+        std::vector<Location> ret;
+        if (!res.filepath)
+            return ret;
+        const auto db = PathNormalizingCompilationDatabase(*res.filepath);
+
+        // The index answers for what it has seen as the client sees it. The
+        // units it hasn't indexed yet, and those whose open documents have
+        // changed since, are parsed, and replace what it has for those
+        // documents
+        const auto index = _indexer.index();
+        std::set<std::string> stale;
+        const auto files = _unitsToParse(db, index.get(), unsaved, stale);
+        std::set<std::tuple<std::string, int, int>> seen;
+        const auto add = [&](const std::string& path, const Range& range) {
+            if (!seen.emplace(path, range.start.line, range.start.character).second)
+                return;
+            Location location;
+            location.uri = _uriOf(path, uri);
+            location.range = range;
+            ret.push_back(std::move(location));
+        };
+        if (index) {
+            for (const auto& occurrence : index->occurrences(target->usr, roles)) {
+                if (!stale.count(occurrence.file)) {
+                    add(occurrence.file, occurrence.range);
+                }
+            }
+        }
+        if (files.empty())
+            return ret;
+        const auto found = _findOccurrences(db, files, *target, roles, unsaved, cancel);
+        cancel.throw_if_cancelled();
+        for (const auto& pair : _rangesOf(found.result, target->name.size(), unsaved)) {
+            for (const auto& range : pair.second) {
+                add(pair.first, range);
+            }
+        }
+        return ret;
+    });
+}
@@ -6,46 +6,87 @@
 
 #include "compilation_database.hpp"
 
-#include <clang/Tooling/Tooling.h>
-#include <clang/Tooling/CommonOptionsParser.h>
-#include <clang/Tooling/CompilationDatabase.h>
-#include <clang/Frontend/ASTUnit.h>
+#include <algorithm>
+#include <cctype>
+#include <set>
+#include <unordered_set>
 
 using namespace cls;
 using namespace langsrv;
 using namespace langsrv::optional_bind_op;
 
-namespace cl = clang::tooling;
+namespace {
 
-future<WorkspaceEdit> LanguageService::rename(const RenameParams& params) {
+bool isIdentifier(const std::string& name) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])))
+        return false;
+    return std::all_of(name.begin(), name.end(), [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    });
+}
+}
+
+future<WorkspaceEdit> LanguageService::rename(const RenameParams& params,
+                                              const cancellation_token& cancel) {
     const auto uri = params.textDocument.uri;
-    GetCompilationInfoParams req;
-    req.uri = params.textDocument.uri;
+    const auto new_name = params.newName;
+    if (!isIdentifier(new_name)) {
+        _show_message(MessageType::Error, "Rename failed: ", new_name, " is not an identifier");
+        return boost::make_ready_future(WorkspaceEdit{});
+    }
+
+    const auto unsaved = _unsavedBuffers();
+    const auto target = _symbolAt(uri, params.position, unsaved);
+    if (!target) {
+        _show_message(MessageType::Error, "Rename failed: There is no symbol to rename here");
+        return boost::make_ready_future(WorkspaceEdit{});
+    }
+
     return getCompilationDatabasePath().then([=](future<GetCompilationDatabasePathResult> fut) {
         auto res = fut.get();
+        cancel.throw_if_cancelled();
         if (!res.filepath) {
             _show_message(MessageType::Error, "Rename failed: Cannot find compilation database");
+            return WorkspaceEdit{};
         }
 
+        log::info("Renaming ", target->usr, " to ", new_name);
         const auto db = PathNormalizingCompilationDatabase(*res.filepath);
-        cl::ClangTool tool(db.underlying(), db.underlying().getAllFiles());
-        std::vector<std::unique_ptr<clang::ASTUnit>> tus;
-        tool.buildASTs(tus);
-        for (auto& unit_ptr : tus) {
-            if (!unit_ptr) continue;
-            auto& tu = *unit_ptr;
-            auto& sm = tu.getSourceManager();
-            auto& fm = tu.getFileManager();
-            auto file_path = uri.find("file://") != uri.npos ? uri.substr(7) : uri;
-            auto file_entry = fm.getFile(file_path);
-            if (!file_entry) {
-                _show_message(MessageType::Warning, "Unable to find file: ", file_path);
+        // Parse the units the index has seen naming it, and those it can't
+        // answer for, so that every range is where the name is now
+        const auto index = _indexer.index();
+        std::set<std::string> stale;
+        auto files = _unitsToParse(db, index.get(), unsaved, stale);
+        const std::vector<OccurrenceRole> roles{ OccurrenceRole::Reference,
+                                                 OccurrenceRole::Declaration,
+                                                 OccurrenceRole::Definition };
+        if (index) {
+            std::unordered_set<std::string> listed{ files.begin(), files.end() };
+            for (const auto& occurrence : index->occurrences(target->usr, roles)) {
+                if (listed.insert(occurrence.unit).second) {
+                    files.push_back(occurrence.unit);
+                }
             }
+        }
+        const auto found = _findOccurrences(db, files, *target, roles, unsaved, cancel);
+        cancel.throw_if_cancelled();
+        if (!found.failed.empty()) {
+            _show_message(MessageType::Warning,
+                          "Rename: ",
+                          found.failed.size(),
+                          " translation units could not be parsed and may need renaming by hand");
+        }
 
-            auto loc = tu.getLocation(file_entry, params.position.line, params.position.character);
-            _show_message(MessageType::Info, "Found source location");
+        WorkspaceEdit ret;
+        for (auto& pair : _rangesOf(found.result, target->name.size(), unsaved)) {
+            auto& edits = ret.changes[_uriOf(pair.first, uri)];
+            for (const auto& range : pair.second) {
+                TextEdit edit;
+                edit.range = range;
+                edit.newText = new_name;
+                edits.push_back(std::move(edit));
+            }
         }
-        _show_message(MessageType::Info, "Loaded compilation database");
-        return WorkspaceEdit{};
+        return ret;
     });
-}
\ No newline at end of file
+}
@@ -0,0 +1,43 @@
+#include "language_service.hpp"
+
+#include "types.hpp"
+#include "uri.hpp"
+
+using namespace cls;
+using namespace langsrv;
+
+namespace {
+/// How many symbols a search returns at most
+const std::size_t maxWorkspaceSymbols = 100;
+}
+
+std::vector<SymbolInformation> LanguageService::workspaceSymbol(
+    const WorkspaceSymbolParams& params) {
+    std::vector<SymbolInformation> ret;
+    const auto index = _indexer.index();
+    if (!index || !index->unitCount())
+        return ret;
+
+    for (const auto& match : _symbolSearch.search(index, params.query, maxWorkspaceSymbols)) {
+        const auto& symbol = match.symbol;
+        const auto& location = symbol.definition ? symbol.definition : symbol.declaration;
+        if (!location)
+            continue;
+
+        SymbolInformation info;
+        info.name = symbol.name;
+        info.kind = symbol.kind;
+        info.location.uri = pathToUri(location->file);
+        info.location.range = location->range;
+        const auto& qualified = symbol.qualifiedName;
+        if (qualified.size() > symbol.name.size() + 2
+            && qualified.compare(qualified.size() - symbol.name.size(),
+                                 symbol.name.size(),
+                                 symbol.name)
+                   == 0) {
+            info.containerName = qualified.substr(0, qualified.size() - symbol.name.size() - 2);
+        }
+        ret.push_back(std::move(info));
+    }
+    return ret;
+}
@@ -0,0 +1,958 @@
+#include "cross_reference_index.hpp"
+
+#include <json_rpc/logging.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace cls;
+
+namespace bip = boost::interprocess;
+
+namespace {
+
+namespace log = json_rpc::log;
+
+// The index is a manifest, a text file listing the segments by number, and
+// the segment files next to it. A segment file is a header followed by
+// sections of fixed-size records, each section aligned to 8 bytes. It is
+// written and read on the same machine, so it is in the machine's byte order
+
+const char indexMagic[4] = { 'C', 'L', 'S', 'X' };
+const char manifestMagic[] = "cls-index";
+const std::uint32_t indexVersion = 6;
+/// How many segments there may be before they are merged regardless of size
+const std::size_t maxSegments = 12;
+const auto noIndex = std::numeric_limits<std::uint32_t>::max();
+
+struct StringRef {
+    std::uint32_t offset;
+    std::uint32_t size;
+};
+
+struct Section {
+    std::uint64_t offset;
+    std::uint64_t count;
+};
+
+struct Header {
+    char magic[4];
+    std::uint32_t version;
+    /// Bytes of string data
+    Section strings;
+    Section units;
+    Section dependencies;
+    Section files;
+    /// Sorted by USR
+    Section symbols;
+    /// Grouped by symbol, then sorted by file and position
+    Section occurrences;
+};
+
+struct UnitRecord {
+    StringRef file;
+    std::uint32_t firstDependency;
+    std::uint32_t dependencyCount;
+    std::uint64_t commandHash;
+    std::uint64_t contextHash;
+    std::uint32_t flags;
+    std::uint32_t reserved;
+};
+
+enum UnitFlags : std::uint32_t {
+    /// The unit is gone. The record only hides what older segments have for
+    /// it
+    removedFlag = 1,
+};
+
+enum DependencyFlags : std::uint32_t {
+    recordedFlag = 1,
+};
+
+struct DependencyRecord {
+    /// Into the files
+    std::uint32_t file;
+    std::uint32_t flags;
+    std::uint64_t hash;
+};
+
+struct FileRecord {
+    StringRef path;
+};
+
+struct SymbolRecord {
+    StringRef usr;
+    StringRef name;
+    StringRef qualifiedName;
+    std::uint32_t kind;
+    /// The first definition and the first declaration among the symbol's
+    /// occurrences, counted from `firstOccurrence`, or noIndex
+    std::uint32_t definition;
+    std::uint32_t declaration;
+    std::uint32_t reserved;
+    std::uint64_t firstOccurrence;
+    std::uint64_t occurrenceCount;
+};
+
+struct OccurrenceRecord {
+    std::uint32_t unit;
+    std::uint32_t file;
+    std::uint32_t startLine;
+    std::uint32_t startCharacter;
+    std::uint32_t endLine;
+    std::uint32_t endCharacter;
+    std::uint32_t role;
+};
+
+bool operator<(const OccurrenceRecord& a, const OccurrenceRecord& b) {
+    return std::tie(a.file, a.startLine, a.startCharacter, a.role, a.unit)
+           < std::tie(b.file, b.startLine, b.startCharacter, b.role, b.unit);
+}
+
+class StringPool {
+    std::string _data;
+    std::unordered_map<std::string, StringRef> _refs;
+
+public:
+    StringRef add(const std::string& str) {
+        const auto found = _refs.find(str);
+        if (found != _refs.end())
+            return found->second;
+        const StringRef ref{ static_cast<std::uint32_t>(_data.size()),
+                             static_cast<std::uint32_t>(str.size()) };
+        if (_data.size() + str.size() > noIndex)
+            throw std::runtime_error{ "Too many strings for a cross-reference index" };
+        _data += str;
+        _refs.emplace(str, ref);
+        return ref;
+    }
+    const std::string& data() const { return _data; }
+};
+
+class Writer {
+    std::ofstream _out;
+    std::uint64_t _pos = 0;
+
+public:
+    explicit Writer(const std::string& path)
+        : _out(path, std::ios::binary | std::ios::trunc) {
+        if (!_out)
+            throw std::runtime_error{ "Cannot write " + path };
+    }
+
+    std::uint64_t pos() const { return _pos; }
+
+    template <typename T> void write(const T* data, std::size_t count) {
+        _out.write(reinterpret_cast<const char*>(data), std::streamsize(sizeof(T) * count));
+        _pos += sizeof(T) * count;
+    }
+
+    void align() {
+        const char zeros[8] = {};
+        write(zeros, (8 - _pos % 8) % 8);
+    }
+
+    template <typename T> Section writeSection(const std::vector<T>& records) {
+        align();
+        Section ret{ _pos, records.size() };
+        write(records.data(), records.size());
+        return ret;
+    }
+
+    void finish(const Header& header) {
+        _out.seekp(0);
+        _out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        _out.close();
+        if (!_out)
+            throw std::runtime_error{ "Failed to write a cross-reference index" };
+    }
+};
+
+langsrv::Range rangeOf(const OccurrenceRecord& occurrence) {
+    langsrv::Range ret;
+    ret.start.line = static_cast<int>(occurrence.startLine);
+    ret.start.character = static_cast<int>(occurrence.startCharacter);
+    ret.end.line = static_cast<int>(occurrence.endLine);
+    ret.end.character = static_cast<int>(occurrence.endCharacter);
+    return ret;
+}
+
+/// Views of the sections of a mapped segment
+struct Contents {
+    const char* strings;
+    std::size_t stringsSize;
+    const UnitRecord* units;
+    std::size_t unitCount;
+    const DependencyRecord* dependencies;
+    std::size_t dependencyCount;
+    const FileRecord* files;
+    std::size_t fileCount;
+    const SymbolRecord* symbols;
+    std::size_t symbolCount;
+    const OccurrenceRecord* occurrences;
+    std::size_t occurrenceCount;
+
+    std::string string(StringRef ref) const {
+        if (std::size_t(ref.offset) + ref.size > stringsSize)
+            return {};
+        return { strings + ref.offset, ref.size };
+    }
+
+    int compare(StringRef ref, const std::string& str) const {
+        if (std::size_t(ref.offset) + ref.size > stringsSize)
+            return -1;
+        return -str.compare(0, std::string::npos, strings + ref.offset, ref.size);
+    }
+
+    const SymbolRecord* find(const std::string& usr) const {
+        const auto end = symbols + symbolCount;
+        const auto less = [&](const SymbolRecord& rec, const std::string& u) {
+            return compare(rec.usr, u) < 0;
+        };
+        const auto found = std::lower_bound(symbols, end, usr, less);
+        if (found == end || compare(found->usr, usr) != 0)
+            return nullptr;
+        return found;
+    }
+
+    /// The occurrences of a symbol
+    std::pair<const OccurrenceRecord*, const OccurrenceRecord*>
+    occurrencesOf(const SymbolRecord& symbol) const {
+        if (symbol.firstOccurrence + symbol.occurrenceCount > occurrenceCount)
+            return { occurrences, occurrences };
+        const auto first = occurrences + symbol.firstOccurrence;
+        return { first, first + symbol.occurrenceCount };
+    }
+
+    std::pair<const DependencyRecord*, const DependencyRecord*>
+    dependenciesOf(const UnitRecord& unit) const {
+        if (std::size_t(unit.firstDependency) + unit.dependencyCount > dependencyCount)
+            return { dependencies, dependencies };
+        const auto first = dependencies + unit.firstDependency;
+        return { first, first + unit.dependencyCount };
+    }
+
+    std::string file(std::uint32_t index) const {
+        return index < fileCount ? string(files[index].path) : std::string{};
+    }
+
+    IndexedSymbol symbol(const SymbolRecord& rec) const {
+        IndexedSymbol ret;
+        ret.usr = string(rec.usr);
+        ret.name = string(rec.name);
+        ret.qualifiedName = string(rec.qualifiedName);
+        ret.kind = static_cast<int>(rec.kind);
+        return ret;
+    }
+};
+
+/// The contents of a mapped segment file, or none if it isn't one we can
+/// read
+boost::optional<Contents> contentsOf(const bip::mapped_region& region) {
+    const auto base = static_cast<const char*>(region.get_address());
+    const auto size = region.get_size();
+    if (!base || size < sizeof(Header))
+        return boost::none;
+    Header header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, indexMagic, sizeof(indexMagic)) != 0
+        || header.version != indexVersion)
+        return boost::none;
+    bool valid = true;
+    const auto section = [&](const Section& sec, std::size_t record_size) {
+        if (sec.offset % 8 != 0 || sec.offset > size
+            || sec.count > (size - sec.offset) / record_size) {
+            valid = false;
+            return base;
+        }
+        return base + sec.offset;
+    };
+    Contents ret;
+    ret.strings = section(header.strings, 1);
+    ret.stringsSize = header.strings.count;
+    ret.units = reinterpret_cast<const UnitRecord*>(section(header.units, sizeof(UnitRecord)));
+    ret.unitCount = header.units.count;
+    ret.dependencies = reinterpret_cast<const DependencyRecord*>(
+        section(header.dependencies, sizeof(DependencyRecord)));
+    ret.dependencyCount = header.dependencies.count;
+    ret.files = reinterpret_cast<const FileRecord*>(section(header.files, sizeof(FileRecord)));
+    ret.fileCount = header.files.count;
+    ret.symbols =
+        reinterpret_cast<const SymbolRecord*>(section(header.symbols, sizeof(SymbolRecord)));
+    ret.symbolCount = header.symbols.count;
+    ret.occurrences = reinterpret_cast<const OccurrenceRecord*>(
+        section(header.occurrences, sizeof(OccurrenceRecord)));
+    ret.occurrenceCount = header.occurrences.count;
+    if (!valid)
+        return boost::none;
+    return ret;
+}
+
+/// A segment to merge into a new one, and which of its units are live
+struct Source {
+    const Contents* contents;
+    const std::vector<bool>* live;
+};
+
+/**
+ * Write a segment to `path` with the live units of `sources`, oldest first,
+ * and `units`, which replace any of the same file in `sources`.
+ *
+ * If `tombstones`, the segment is to go on top of older ones, and keeps
+ * records of the units in `removed` and of those `sources` had removed, to
+ * hide what the older segments have for them.
+ */
+void writeSegment(const std::string& path,
+                  const std::vector<Source>& sources,
+                  const std::vector<IndexedUnit>& units,
+                  const std::vector<std::string>& removed,
+                  bool tombstones) {
+    std::set<std::string> replaced;
+    for (const auto& unit : units) {
+        replaced.insert(unit.file);
+    }
+    StringPool strings;
+
+    std::vector<FileRecord> out_files;
+    std::unordered_map<std::string, std::uint32_t> file_ids;
+    const auto file_id = [&](const std::string& path) {
+        const auto found = file_ids.find(path);
+        if (found != file_ids.end())
+            return found->second;
+        const auto id = static_cast<std::uint32_t>(out_files.size());
+        out_files.push_back({ strings.add(path) });
+        file_ids.emplace(path, id);
+        return id;
+    };
+    std::vector<std::vector<std::uint32_t>> old_files(sources.size());
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        old_files[i].assign(sources[i].contents->fileCount, noIndex);
+    }
+    const auto old_file_id = [&](std::size_t source, std::uint32_t file) {
+        auto& id = old_files[source][file];
+        if (id == noIndex) {
+            id = file_id(sources[source].contents->file(file));
+        }
+        return id;
+    };
+
+    std::vector<UnitRecord> out_units;
+    std::vector<DependencyRecord> out_dependencies;
+    const auto add_unit = [&](const std::string& file,
+                              std::uint64_t command_hash,
+                              std::uint64_t context_hash,
+                              std::uint32_t flags) {
+        UnitRecord unit = {};
+        unit.file = strings.add(file);
+        unit.firstDependency = static_cast<std::uint32_t>(out_dependencies.size());
+        unit.commandHash = command_hash;
+        unit.contextHash = context_hash;
+        unit.flags = flags;
+        out_units.push_back(unit);
+        return static_cast<std::uint32_t>(out_units.size() - 1);
+    };
+    const auto end_unit = [&] {
+        auto& unit = out_units.back();
+        unit.dependencyCount =
+            static_cast<std::uint32_t>(out_dependencies.size() - unit.firstDependency);
+    };
+    std::vector<std::vector<std::uint32_t>> old_units(sources.size());
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        const auto& old = *sources[i].contents;
+        const auto& live = *sources[i].live;
+        old_units[i].assign(old.unitCount, noIndex);
+        for (std::size_t j = 0; j < old.unitCount; ++j) {
+            const auto& unit = old.units[j];
+            const auto file = old.string(unit.file);
+            if (j >= live.size() || !live[j] || replaced.count(file))
+                continue;
+            if (unit.flags & removedFlag) {
+                if (tombstones) {
+                    add_unit(file, 0, 0, removedFlag);
+                    end_unit();
+                }
+                continue;
+            }
+            old_units[i][j] = add_unit(file, unit.commandHash, unit.contextHash, 0);
+            const auto dependencies = old.dependenciesOf(unit);
+            for (auto dep = dependencies.first; dep != dependencies.second; ++dep) {
+                if (dep->file < old.fileCount) {
+                    out_dependencies.push_back(
+                        { old_file_id(i, dep->file), dep->flags, dep->hash });
+                }
+            }
+            end_unit();
+        }
+    }
+
+    // What the new units found, by USR
+    struct Fresh {
+        const IndexedSymbol* symbol = nullptr;
+        std::vector<OccurrenceRecord> occurrences;
+    };
+    std::map<std::string, Fresh> fresh;
+    for (const auto& unit : units) {
+        const auto unit_id = add_unit(unit.file, unit.commandHash, unit.contextHash, 0);
+        for (const auto& dependency : unit.dependencies) {
+            const std::uint32_t flags = dependency.recorded ? recordedFlag : 0;
+            out_dependencies.push_back({ file_id(dependency.path), flags, dependency.hash });
+        }
+        end_unit();
+        std::vector<std::uint32_t> files;
+        for (const auto& file : unit.files) {
+            files.push_back(file_id(file));
+        }
+        for (const auto& occurrence : unit.occurrences) {
+            const auto& symbol = unit.symbols.at(occurrence.symbol);
+            auto& entry = fresh[symbol.usr];
+            if (!entry.symbol) {
+                entry.symbol = &symbol;
+            }
+            const auto& range = occurrence.range;
+            entry.occurrences.push_back({ unit_id,
+                                          files.at(occurrence.file),
+                                          static_cast<std::uint32_t>(range.start.line),
+                                          static_cast<std::uint32_t>(range.start.character),
+                                          static_cast<std::uint32_t>(range.end.line),
+                                          static_cast<std::uint32_t>(range.end.character),
+                                          static_cast<std::uint32_t>(occurrence.role) });
+        }
+    }
+    if (tombstones) {
+        for (const auto& file : std::set<std::string>(removed.begin(), removed.end())) {
+            if (!replaced.count(file)) {
+                add_unit(file, 0, 0, removedFlag);
+                end_unit();
+            }
+        }
+    }
+
+    // Merge the symbols of the sources with the new ones, all in order of
+    // USR, writing out the occurrences as we go
+    Writer out{ path };
+    Header header = {};
+    out.write(&header, 1);
+    out.align();
+    header.occurrences.offset = out.pos();
+    std::vector<SymbolRecord> out_symbols;
+    std::vector<OccurrenceRecord> occurrences;
+    const auto emit = [&](SymbolRecord symbol) {
+        if (occurrences.empty())
+            return;
+        std::sort(occurrences.begin(), occurrences.end());
+        symbol.definition = symbol.declaration = noIndex;
+        for (auto i = occurrences.size(); i-- > 0;) {
+            const auto role = static_cast<OccurrenceRole>(occurrences[i].role);
+            if (role == OccurrenceRole::Definition) {
+                symbol.definition = static_cast<std::uint32_t>(i);
+            } else if (role == OccurrenceRole::Declaration) {
+                symbol.declaration = static_cast<std::uint32_t>(i);
+            }
+        }
+        symbol.firstOccurrence = header.occurrences.count;
+        symbol.occurrenceCount = occurrences.size();
+        out.write(occurrences.data(), occurrences.size());
+        header.occurrences.count += occurrences.size();
+        out_symbols.push_back(symbol);
+    };
+    // Returns whether the symbol still occurs in a live unit
+    const auto add_old = [&](std::size_t source, const SymbolRecord& symbol) {
+        const auto& old = *sources[source].contents;
+        const auto& units = old_units[source];
+        const auto before = occurrences.size();
+        const auto range = old.occurrencesOf(symbol);
+        for (auto occurrence = range.first; occurrence != range.second; ++occurrence) {
+            if (occurrence->unit >= units.size() || units[occurrence->unit] == noIndex
+                || occurrence->file >= old.fileCount)
+                continue;
+            occurrences.push_back(*occurrence);
+            occurrences.back().unit = units[occurrence->unit];
+            occurrences.back().file = old_file_id(source, occurrence->file);
+        }
+        return occurrences.size() != before;
+    };
+    const auto add_fresh = [&](Fresh& entry) {
+        occurrences.insert(occurrences.end(), entry.occurrences.begin(), entry.occurrences.end());
+        const auto& symbol = *entry.symbol;
+        SymbolRecord ret = {};
+        ret.usr = strings.add(symbol.usr);
+        ret.name = strings.add(symbol.name);
+        ret.qualifiedName = strings.add(symbol.qualifiedName);
+        ret.kind = static_cast<std::uint32_t>(symbol.kind);
+        return ret;
+    };
+    const auto old_symbol = [&](std::size_t source, const SymbolRecord& symbol) {
+        const auto& old = *sources[source].contents;
+        SymbolRecord ret = {};
+        ret.usr = strings.add(old.string(symbol.usr));
+        ret.name = strings.add(old.string(symbol.name));
+        ret.qualifiedName = strings.add(old.string(symbol.qualifiedName));
+        ret.kind = symbol.kind;
+        return ret;
+    };
+
+    // The next symbol of each source, and its USR
+    std::vector<std::size_t> next(sources.size(), 0);
+    std::vector<std::string> next_usr(sources.size());
+    const auto load = [&](std::size_t source) {
+        const auto& old = *sources[source].contents;
+        if (next[source] < old.symbolCount) {
+            next_usr[source] = old.string(old.symbols[next[source]].usr);
+        }
+    };
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        load(i);
+    }
+    auto fresh_iter = fresh.begin();
+    while (true) {
+        const std::string* usr = fresh_iter != fresh.end() ? &fresh_iter->first : nullptr;
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            if (next[i] < sources[i].contents->symbolCount && (!usr || next_usr[i] < *usr)) {
+                usr = &next_usr[i];
+            }
+        }
+        if (!usr)
+            break;
+        const auto current = *usr;
+        occurrences.clear();
+        // What the newest source that has the symbol says about it wins
+        auto newest = noIndex;
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            if (next[i] < sources[i].contents->symbolCount && next_usr[i] == current) {
+                if (add_old(i, sources[i].contents->symbols[next[i]])) {
+                    newest = static_cast<std::uint32_t>(i);
+                }
+                ++next[i];
+                load(i);
+            }
+        }
+        if (fresh_iter != fresh.end() && fresh_iter->first == current) {
+            emit(add_fresh((fresh_iter++)->second));
+        } else if (newest != noIndex) {
+            emit(old_symbol(newest, sources[newest].contents->symbols[next[newest] - 1]));
+        }
+    }
+
+    header.symbols = out.writeSection(out_symbols);
+    header.units = out.writeSection(out_units);
+    header.dependencies = out.writeSection(out_dependencies);
+    header.files = out.writeSection(out_files);
+    out.align();
+    header.strings = { out.pos(), strings.data().size() };
+    out.write(strings.data().data(), strings.data().size());
+    std::memcpy(header.magic, indexMagic, sizeof(indexMagic));
+    header.version = indexVersion;
+    out.finish(header);
+}
+
+/// Where an occurrence is, to find the same place seen by several units
+std::tuple<const std::string&, int, int, OccurrenceRole> placeOf(const IndexedLocation& location) {
+    return std::tie(location.file,
+                    location.range.start.line,
+                    location.range.start.character,
+                    location.role);
+}
+}
+
+/// A mapped segment file
+struct CrossReferenceIndex::Segment {
+    std::uint64_t id;
+    bip::file_mapping file;
+    bip::mapped_region region;
+    Contents contents;
+    /// By unit, whether no newer segment has a record of the unit's file
+    std::vector<bool> live;
+
+    bool isLive(std::uint32_t unit) const { return unit < live.size() && live[unit]; }
+
+    /// Whether the symbol occurs in a live unit here
+    bool hasLive(const SymbolRecord& symbol) const {
+        const auto range = contents.occurrencesOf(symbol);
+        return std::any_of(range.first, range.second, [&](const OccurrenceRecord& occurrence) {
+            return isLive(occurrence.unit);
+        });
+    }
+
+    /// The first occurrence of the symbol in `role` in a live unit. `first`
+    /// is where the record says the first one in any unit is
+    boost::optional<IndexedLocation>
+    locate(const SymbolRecord& symbol, OccurrenceRole role, std::uint32_t first) const {
+        const auto range = contents.occurrencesOf(symbol);
+        if (first == noIndex || first >= range.second - range.first)
+            return boost::none;
+        for (auto occurrence = range.first + first; occurrence != range.second; ++occurrence) {
+            // Only when a newer segment hides its unit is it not the first
+            if (occurrence->role != static_cast<std::uint32_t>(role)
+                || !isLive(occurrence->unit))
+                continue;
+            return IndexedLocation{ contents.file(occurrence->file),
+                                    rangeOf(*occurrence),
+                                    role,
+                                    contents.string(contents.units[occurrence->unit].file) };
+        }
+        return boost::none;
+    }
+
+    /// Fill in where the symbol is defined and declared, where `ret` doesn't
+    /// say yet
+    void locate(const SymbolRecord& symbol, IndexedSymbol& ret) const {
+        if (!ret.definition) {
+            ret.definition = locate(symbol, OccurrenceRole::Definition, symbol.definition);
+        }
+        if (!ret.declaration) {
+            ret.declaration = locate(symbol, OccurrenceRole::Declaration, symbol.declaration);
+        }
+    }
+};
+
+std::uint64_t cls::fingerprintHash(const std::string& data) {
+    // 64-bit FNV-1a
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const auto c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+CrossReferenceIndex::CrossReferenceIndex(std::string path)
+    : _path(std::move(path)) {
+    _load();
+}
+
+CrossReferenceIndex::~CrossReferenceIndex() = default;
+
+std::string CrossReferenceIndex::_segmentPath(std::uint64_t id) const {
+    return _path + "." + std::to_string(id);
+}
+
+std::unique_ptr<CrossReferenceIndex::Segment> CrossReferenceIndex::_open(std::uint64_t id) const {
+    const auto path = _segmentPath(id);
+    std::unique_ptr<Segment> ret{ new Segment };
+    ret->id = id;
+    try {
+        bip::file_mapping file{ path.c_str(), bip::read_only };
+        bip::mapped_region region{ file, bip::read_only };
+        ret->file.swap(file);
+        ret->region.swap(region);
+    } catch (const bip::interprocess_exception&) {
+        return nullptr;
+    }
+    const auto contents = contentsOf(ret->region);
+    if (!contents)
+        return nullptr;
+    ret->contents = *contents;
+    return ret;
+}
+
+void CrossReferenceIndex::_load() {
+    std::ifstream in{ _path };
+    if (!in)
+        return;  // No index yet
+    std::string magic;
+    std::uint32_t version = 0;
+    std::uint64_t next = 0;
+    in >> magic >> version >> next;
+    std::vector<std::unique_ptr<Segment>> segments;
+    std::uint64_t id;
+    while (in >> id) {
+        auto segment = _open(id);
+        if (!segment || id >= next) {
+            version = 0;
+            break;
+        }
+        segments.push_back(std::move(segment));
+    }
+    if (magic != manifestMagic || version != indexVersion) {
+        log::warning("Ignoring ", _path, ", which is not a cross-reference index we can read");
+        return;
+    }
+    _segments = std::move(segments);
+    _nextSegment = next;
+    _refresh();
+}
+
+void CrossReferenceIndex::_refresh() {
+    std::unordered_set<std::string> seen;
+    _unitCount = 0;
+    for (auto segment = _segments.rbegin(); segment != _segments.rend(); ++segment) {
+        const auto& contents = (*segment)->contents;
+        auto& live = (*segment)->live;
+        live.assign(contents.unitCount, false);
+        for (std::size_t i = 0; i < contents.unitCount; ++i) {
+            const auto& unit = contents.units[i];
+            if (!seen.insert(contents.string(unit.file)).second)
+                continue;
+            live[i] = true;
+            if (!(unit.flags & removedFlag)) {
+                ++_unitCount;
+            }
+        }
+    }
+}
+
+void CrossReferenceIndex::_writeManifest() const {
+    const auto tmp_path = _path + ".tmp";
+    {
+        std::ofstream out{ tmp_path, std::ios::trunc };
+        out << manifestMagic << ' ' << indexVersion << '\n' << _nextSegment << '\n';
+        for (const auto& segment : _segments) {
+            out << segment->id << '\n';
+        }
+        out.close();
+        if (!out)
+            throw std::runtime_error{ "Cannot write " + tmp_path };
+    }
+    if (std::rename(tmp_path.c_str(), _path.c_str()) != 0) {
+        // Renaming over an existing file fails on Windows
+        std::remove(_path.c_str());
+        if (std::rename(tmp_path.c_str(), _path.c_str()) != 0) {
+            log::error("Failed to replace ", _path, " with ", tmp_path);
+        }
+    }
+}
+
+void CrossReferenceIndex::update(const std::vector<IndexedUnit>& units,
+                                 const std::vector<std::string>& removed) {
+    std::lock_guard<std::mutex> lk{ _updateLock };
+    if (units.empty() && removed.empty())
+        return;
+    // Only updates change the segments and we are the only one, so they can
+    // be read without locking
+    const auto id = _nextSegment;
+    writeSegment(_segmentPath(id), {}, units, removed, !_segments.empty());
+    auto segment = _open(id);
+    if (!segment)
+        throw std::runtime_error{ "Cannot read back " + _segmentPath(id) };
+    {
+        std::unique_lock<std::shared_timed_mutex> map_lk{ _mapLock };
+        _segments.push_back(std::move(segment));
+        _nextSegment = id + 1;
+        _refresh();
+        _writeManifest();
+    }
+    ++_generation;
+    _compact();
+}
+
+void CrossReferenceIndex::_compact() {
+    // Merge the newest segments while they add up to at least half the size
+    // of the one before them. Each segment is then more than twice the size
+    // of all newer ones together, so there are few segments, and an
+    // occurrence is rewritten a number of times logarithmic in the size of
+    // the index
+    const auto count = _segments.size();
+    if (count < 2)
+        return;
+    auto first = count - 1;
+    std::uint64_t size = _segments[first]->region.get_size();
+    while (first > 0 && (_segments[first - 1]->region.get_size() <= 2 * size
+                         || first >= maxSegments)) {
+        size += _segments[--first]->region.get_size();
+    }
+    if (first == count - 1)
+        return;
+
+    const auto id = _nextSegment;
+    const auto path = _segmentPath(id);
+    std::vector<std::uint64_t> merged;
+    try {
+        std::vector<Source> sources;
+        for (auto i = first; i < count; ++i) {
+            sources.push_back({ &_segments[i]->contents, &_segments[i]->live });
+            merged.push_back(_segments[i]->id);
+        }
+        writeSegment(path, sources, {}, {}, first > 0);
+        auto segment = _open(id);
+        if (!segment)
+            throw std::runtime_error{ "Cannot read back " + path };
+        std::unique_lock<std::shared_timed_mutex> map_lk{ _mapLock };
+        _segments.erase(_segments.begin() + static_cast<std::ptrdiff_t>(first), _segments.end());
+        _segments.push_back(std::move(segment));
+        _nextSegment = id + 1;
+        _refresh();
+        _writeManifest();
+    } catch (const std::exception& e) {
+        // The segments are still there to be merged next time
+        log::error("Failed to merge the segments of ", _path, ": ", e.what());
+        std::remove(path.c_str());
+        return;
+    }
+    for (const auto old : merged) {
+        std::remove(_segmentPath(old).c_str());
+    }
+}
+
+std::vector<std::string> CrossReferenceIndex::units() const {
+    std::vector<std::string> ret;
+    forEachUnit([&](const IndexedUnit& unit) { ret.push_back(unit.file); });
+    return ret;
+}
+
+std::size_t CrossReferenceIndex::unitCount() const {
+    std::shared_lock<std::shared_timed_mutex> lk{ _mapLock };
+    return _unitCount;
+}
+
+void CrossReferenceIndex::forEachUnit(const std::function<void(const IndexedUnit&)>& fn) const {
+    std::shared_lock<std::shared_timed_mutex> lk{ _mapLock };
+    IndexedUnit unit;
+    for (const auto& segment : _segments) {
+        const auto& contents = segment->contents;
+        for (std::size_t i = 0; i < contents.unitCount; ++i) {
+            const auto& rec = contents.units[i];
+            if (!segment->live[i] || (rec.flags & removedFlag))
+                continue;
+            unit.file = contents.string(rec.file);
+            unit.commandHash = rec.commandHash;
+            unit.contextHash = rec.contextHash;
+            unit.dependencies.clear();
+            const auto dependencies = contents.dependenciesOf(rec);
+            for (auto dep = dependencies.first; dep != dependencies.second; ++dep) {
+                unit.dependencies.push_back(
+                    { contents.file(dep->file), dep->hash, (dep->flags & recordedFlag) != 0 });
+            }
+            fn(unit);
+        }
+    }
+}
+
+std::vector<std::pair<std::string, std::uint64_t>>
+CrossReferenceIndex::unitsDependingOn(const std::string& path) const {
+    std::shared_lock<std::shared_timed_mutex> lk{ _mapLock };
+    std::vector<std::pair<std::string, std::uint64_t>> ret;
+    for (const auto& segment : _segments) {
+        const auto& contents = segment->contents;
+        auto file = noIndex;
+        for (std::size_t i = 0; i < contents.fileCount && file == noIndex; ++i) {
+            if (contents.compare(contents.files[i].path, path) == 0) {
+                file = static_cast<std::uint32_t>(i);
+            }
+        }
+        if (file == noIndex)
+            continue;
+        for (std::size_t i = 0; i < contents.unitCount; ++i) {
+            const auto& unit = contents.units[i];
+            if (!segment->live[i] || (unit.flags & removedFlag))
+                continue;
+            const auto dependencies = contents.dependenciesOf(unit);
+            for (auto dep = dependencies.first; dep != dependencies.second; ++dep) {
+                if (dep->file == file) {
+                    ret.emplace_back(contents.string(unit.file), dep->hash);
+                    break;
+                }
+            }
+        }
+    }
+    return ret;
+}
+
+boost::optional<IndexedSymbol> CrossReferenceIndex::symbol(const std::string& usr) const {
+    std::shared_lock<std::shared_timed_mutex> lk{ _mapLock };
+    // The newest segment that has it in a live unit knows best, and older
+    // ones may know where it is defined
+    boost::optional<IndexedSymbol> ret;
+    for (auto segment = _segments.rbegin(); segment != _segments.rend(); ++segment) {
+        const auto found = (*segment)->contents.find(usr);
+        if (!found || !(*segment)->hasLive(*found))
+            continue;
+        if (!ret) {
+            ret = (*segment)->contents.symbol(*found);
+        }
+        (*segment)->locate(*found, *ret);
+    }
+    return ret;
+}
+
+std::vector<IndexedLocation>
+CrossReferenceIndex::occurrences(const std::string& usr,
+                                 const std::vector<OccurrenceRole>& roles) const {
+    std::shared_lock<std::shared_timed_mutex> lk{ _mapLock };
+    std::vector<IndexedLocation> ret;
+    for (const auto& segment : _segments) {
+        const auto& contents = segment->contents;
+        const auto found = contents.find(usr);
+        if (!found)
+            continue;
+        const auto range = contents.occurrencesOf(*found);
+        for (auto occurrence = range.first; occurrence != range.second; ++occurrence) {
+            const auto role = static_cast<OccurrenceRole>(occurrence->role);
+            if (!segment->isLive(occurrence->unit)
+                || std::find(roles.begin(), roles.end(), role) == roles.end())
+                continue;
+            ret.push_back({ contents.file(occurrence->file),
+                            rangeOf(*occurrence),
+                            role,
+                            contents.string(contents.units[occurrence->unit].file) });
+        }
+    }
+    // Headers are seen by every unit that includes them
+    const auto before = [](const IndexedLocation& a, const IndexedLocation& b) {
+        return placeOf(a) < placeOf(b);
+    };
+    const auto same = [](const IndexedLocation& a, const IndexedLocation& b) {
+        return placeOf(a) == placeOf(b);
+    };
+    std::stable_sort(ret.begin(), ret.end(), before);
+    const auto end = std::unique(ret.begin(), ret.end(), same);
+    ret.erase(end, ret.end());
+    return ret;
+}
+
+void CrossReferenceIndex::forEachSymbol(
+    const std::function<void(const IndexedSymbol&)>& fn) const {
+    std::shared_lock<std::shared_timed_mutex> lk{ _mapLock };
+    // Merge the segments' symbols, which each has in order of USR
+    std::vector<std::size_t> next(_segments.size(), 0);
+    std::vector<std::string> next_usr(_segments.size());
+    const auto load = [&](std::size_t i) {
+        const auto& contents = _segments[i]->contents;
+        if (next[i] < contents.symbolCount) {
+            next_usr[i] = contents.string(contents.symbols[next[i]].usr);
+        }
+    };
+    const auto remaining = [&](std::size_t i) {
+        return next[i] < _segments[i]->contents.symbolCount;
+    };
+    for (std::size_t i = 0; i < _segments.size(); ++i) {
+        load(i);
+    }
+    while (true) {
+        const std::string* usr = nullptr;
+        for (std::size_t i = 0; i < _segments.size(); ++i) {
+            if (remaining(i) && (!usr || next_usr[i] < *usr)) {
+                usr = &next_usr[i];
+            }
+        }
+        if (!usr)
+            return;
+        const auto current = *usr;
+        // As in symbol(), newest first
+        boost::optional<IndexedSymbol> symbol;
+        for (auto i = _segments.size(); i-- > 0;) {
+            if (!remaining(i) || next_usr[i] != current)
+                continue;
+            const auto& segment = *_segments[i];
+            const auto& rec = segment.contents.symbols[next[i]];
+            if (segment.hasLive(rec)) {
+                if (!symbol) {
+                    symbol = segment.contents.symbol(rec);
+                }
+                segment.locate(rec, *symbol);
+            }
+            ++next[i];
+            load(i);
+        }
+        if (symbol) {
+            fn(*symbol);
+        }
+    }
+}
@@ -0,0 +1,161 @@
+#ifndef CLS_CROSS_REFERENCE_INDEX_HPP_INCLUDED
+#define CLS_CROSS_REFERENCE_INDEX_HPP_INCLUDED
+
+#include "occurrences.hpp"
+#include "types.hpp"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/optional.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+namespace cls {
+
+/// An occurrence, as the index answers queries with it
+struct IndexedLocation {
+    std::string file;
+    langsrv::Range range;
+    OccurrenceRole role;
+    /// A unit that recorded it, as the compilation database has it
+    std::string unit;
+};
+
+/// A symbol as an indexed unit saw it
+struct IndexedSymbol {
+    std::string usr;
+    std::string name;
+    std::string qualifiedName;
+    /// An LSP SymbolKind
+    int kind = 0;
+    /// Where the index has it defined and declared, if anywhere. Indexing a
+    /// unit leaves these out
+    boost::optional<IndexedLocation> definition;
+    boost::optional<IndexedLocation> declaration;
+};
+
+/// Where an indexed unit names a symbol. `symbol` and `file` index into the
+/// unit's own tables
+struct IndexedOccurrence {
+    std::uint32_t symbol;
+    std::uint32_t file;
+    langsrv::Range range;
+    OccurrenceRole role;
+};
+
+/// A file a unit was built from, with a hash of what it contained then
+struct IndexedDependency {
+    std::string path;
+    std::uint64_t hash;
+    /// Whether the unit recorded the occurrences in the file, rather than
+    /// leaving them to another unit that includes it
+    bool recorded = true;
+};
+
+/// What indexing a translation unit found
+struct IndexedUnit {
+    /// The unit's file, as the compilation database has it
+    std::string file;
+    /// Together with `dependencies`, tells whether the unit needs indexing
+    /// again
+    std::uint64_t commandHash = 0;
+    /// A hash of the options that decide which macros its headers see
+    std::uint64_t contextHash = 0;
+    /// The unit's own file and everything it includes
+    std::vector<IndexedDependency> dependencies;
+    /// Normalized paths of the files the occurrences are in
+    std::vector<std::string> files;
+    std::vector<IndexedSymbol> symbols;
+    std::vector<IndexedOccurrence> occurrences;
+};
+
+/// A hash of file contents or a compile command that stays the same from
+/// one run to the next
+std::uint64_t fingerprintHash(const std::string& data);
+
+/**
+ * Declarations, definitions and references of every symbol in the indexed
+ * translation units, by USR, kept in files.
+ *
+ * The index is a stack of segments, each a memory-mapped file that is
+ * queried in place: symbols are sorted by USR and looked up with a binary
+ * search, and each symbol's occurrences are stored together, so a query
+ * touches only the pages it needs and a server that starts over an existing
+ * index can answer straight away. A manifest at the index's path lists the
+ * segments, oldest first.
+ *
+ * Updating writes the new units, and records of those removed, to a new
+ * segment, so it costs what the change does rather than what the index
+ * does. What a segment has for a unit hides whatever older segments have
+ * for it. The newest segments are merged into one once they are about as
+ * big as the one below them, which keeps the segments few.
+ *
+ * Queries may run concurrently with each other and with an update; only
+ * swapping segments in makes them wait.
+ */
+class CrossReferenceIndex {
+    std::string _path;
+    /// Serializes updates
+    std::mutex _updateLock;
+    /// Guards the segments
+    mutable std::shared_timed_mutex _mapLock;
+    struct Segment;
+    std::vector<std::unique_ptr<Segment>> _segments;
+    /// The number of the next segment file to write
+    std::uint64_t _nextSegment = 0;
+    std::size_t _unitCount = 0;
+    std::atomic<std::uint64_t> _generation{ 0 };
+
+    std::string _segmentPath(std::uint64_t id) const;
+    /// Map a segment file, or return null if it isn't one we can read
+    std::unique_ptr<Segment> _open(std::uint64_t id) const;
+    void _load();
+    /// Work out which units of each segment are hidden by newer ones
+    void _refresh();
+    void _writeManifest() const;
+    /// Merge the newest segments, if it is time to
+    void _compact();
+
+public:
+    /// Use the index whose manifest is at `path`, which need not exist yet
+    explicit CrossReferenceIndex(std::string path);
+    ~CrossReferenceIndex();
+    CrossReferenceIndex(const CrossReferenceIndex&) = delete;
+    CrossReferenceIndex& operator=(const CrossReferenceIndex&) = delete;
+
+    const std::string& path() const { return _path; }
+    /// Goes up with every update that changes what the index holds
+    std::uint64_t generation() const { return _generation; }
+
+    /// Replace what is recorded for `units`, and forget about `removed`
+    void update(const std::vector<IndexedUnit>& units,
+                const std::vector<std::string>& removed = {});
+
+    /// The units that have been indexed
+    std::vector<std::string> units() const;
+    std::size_t unitCount() const;
+    /// Call `fn` for every unit, with what it was indexed from. Its
+    /// `symbols` and `occurrences` are left empty
+    void forEachUnit(const std::function<void(const IndexedUnit&)>& fn) const;
+    /// The units that depend on the file at `path`, with the hash of the
+    /// file they were indexed with
+    std::vector<std::pair<std::string, std::uint64_t>> unitsDependingOn(
+        const std::string& path) const;
+    /// What the index knows about a symbol
+    boost::optional<IndexedSymbol> symbol(const std::string& usr) const;
+    /// Where a symbol occurs in any of the roles in `roles`
+    std::vector<IndexedLocation> occurrences(const std::string& usr,
+                                             const std::vector<OccurrenceRole>& roles) const;
+    /// Call `fn` for every symbol, in order of USR
+    void forEachSymbol(const std::function<void(const IndexedSymbol&)>& fn) const;
+};
+}
+
+#endif  // CLS_CROSS_REFERENCE_INDEX_HPP_INCLUDED
@@ -0,0 +1,230 @@
+#include "diagnostic_publisher.hpp"
+
+#include "document_store.hpp"
+#include "uri.hpp"
+
+#include <json_rpc/serialize.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+using namespace cls;
+
+namespace {
+
+/// LSP DiagnosticSeverity
+enum class Severity { Error = 1, Warning = 2, Information = 3, Hint = 4 };
+
+Severity toSeverity(unsigned clangSeverity) {
+    switch (clangSeverity) {
+    case CXDiagnostic_Note:
+        return Severity::Information;
+    case CXDiagnostic_Warning:
+        return Severity::Warning;
+    default:
+        return Severity::Error;
+    }
+}
+
+/// A diagnostic whose range is still in bytes
+struct Located {
+    std::string path;
+    std::size_t begin;
+    std::size_t end;
+    langsrv::Diagnostic diagnostic;
+};
+
+std::string readFile(const std::string& path) {
+    std::ifstream in{ path, std::ios::binary };
+    return { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+}
+
+Located locate(const clangxx::Diagnostic& diag,
+               const std::string& directory,
+               const std::string& mainPath) {
+    Located ret;
+    const auto loc = diag.location();
+    ret.path = loc.file() ? normalizePath(loc.filename(), directory) : mainPath;
+    ret.begin = ret.end = loc.file() ? loc.offset() : 0;
+    // Highlight the range around the location, if clang gave one
+    for (const auto& range : diag.ranges()) {
+        const auto start = range.start();
+        const auto end = range.end();
+        if (loc.file() && start.file() == loc.file() && end.file() == loc.file()
+            && start.offset() <= ret.begin && ret.begin <= end.offset()) {
+            ret.begin = start.offset();
+            ret.end = end.offset();
+            break;
+        }
+    }
+
+    auto& out = ret.diagnostic;
+    out.severity = static_cast<int>(toSeverity(diag.severity()));
+    out.source = std::string("clang");
+    out.message = diag.spelling();
+    const auto option = diag.option();
+    if (!option.empty()) {
+        out.code = option;
+    }
+    // LSP has nowhere else to put the notes that go with a diagnostic
+    for (const auto& note : diag.children()) {
+        out.message += "\n" + note.location().format() + ": " + note.spelling();
+    }
+    return ret;
+}
+}
+
+DiagnosticsByUri cls::convertDiagnostics(clangxx::TranslationUnit& unit,
+                                         const std::string& directory,
+                                         const std::string& mainPath,
+                                         const std::string& mainUri,
+                                         const std::vector<UnsavedBuffer>& unsaved) {
+    // Every path is normalized once here, so they can be compared as strings
+    const auto mainFile = normalizePath(mainPath, directory);
+    std::map<std::string, std::vector<Located>> byPath;
+    byPath[mainFile];
+    for (const auto& diag : unit.diagnostics()) {
+        if (diag.severity() == CXDiagnostic_Ignored)
+            continue;
+        auto located = locate(diag, directory, mainFile);
+        byPath[located.path].push_back(std::move(located));
+    }
+
+    DiagnosticsByUri ret;
+    for (auto& pair : byPath) {
+        auto& diags = pair.second;
+        std::vector<std::size_t> offsets;
+        for (const auto& d : diags) {
+            offsets.push_back(d.begin);
+            offsets.push_back(d.end);
+        }
+        std::sort(offsets.begin(), offsets.end());
+        offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+
+        // The text clang parsed: an open document's buffer, however clang
+        // and the client each spell its path, or else the file on disk
+        const auto& path = pair.first;
+        const auto buffer =
+            std::find_if(unsaved.begin(), unsaved.end(), [&](const UnsavedBuffer& b) {
+                return normalizePath(b.path, directory) == path;
+            });
+        std::string fromDisk;
+        if (buffer == unsaved.end() && !offsets.empty() && offsets.back() != 0) {
+            fromDisk = readFile(path);
+        }
+        const auto& text = buffer != unsaved.end() ? *buffer->text : fromDisk;
+        const auto positions = positionsAt(text, offsets);
+        const auto positionOf = [&](std::size_t offset) {
+            const auto found = std::lower_bound(offsets.begin(), offsets.end(), offset);
+            return positions[static_cast<std::size_t>(found - offsets.begin())];
+        };
+
+        auto& out = ret[path == mainFile ? mainUri : pathToUri(path)];
+        for (auto& d : diags) {
+            d.diagnostic.range.start = positionOf(d.begin);
+            d.diagnostic.range.end = positionOf(d.end);
+            out.push_back(std::move(d.diagnostic));
+        }
+    }
+    return ret;
+}
+
+DiagnosticPublisher::DiagnosticPublisher(send_fn send, clock::duration interval)
+    : _send(std::move(send))
+    , _interval(interval)
+    , _thread([this] { _work(); }) {}
+
+DiagnosticPublisher::~DiagnosticPublisher() {
+    {
+        std::lock_guard<std::mutex> lk{ _lock };
+        _stopping = true;
+    }
+    _wake.notify_all();
+    _thread.join();
+}
+
+void DiagnosticPublisher::_flush(const std::string& owner, DiagnosticsByUri diagnostics) {
+    std::set<std::string> owned;
+    for (auto& pair : diagnostics) {
+        owned.insert(pair.first);
+        langsrv::PublishDiagnosticsParams params;
+        params.uri = pair.first;
+        params.diagnostics = std::move(pair.second);
+        auto text = json_rpc::to_raw_json(params).text;
+        auto& published = _published[pair.first];
+        published.owner = owner;
+        if (published.text == text)
+            continue;
+        published.text = std::move(text);
+        _send(params);
+    }
+
+    // Clear what this unit reported before but no longer does, unless another
+    // unit has reported on the file since
+    auto& previous = _owned[owner];
+    for (const auto& uri : previous) {
+        if (owned.count(uri))
+            continue;
+        const auto found = _published.find(uri);
+        if (found == _published.end() || found->second.owner != owner)
+            continue;
+        _published.erase(found);
+        langsrv::PublishDiagnosticsParams params;
+        params.uri = uri;
+        _send(params);
+    }
+    previous = std::move(owned);
+}
+
+void DiagnosticPublisher::_work() {
+    std::unique_lock<std::mutex> lk{ _lock };
+    while (!_stopping) {
+        const auto now = clock::now();
+        auto wake_at = clock::time_point::max();
+        for (auto it = _pending.begin(); it != _pending.end();) {
+            if (it->second.due > now) {
+                wake_at = std::min(wake_at, it->second.due);
+                ++it;
+                continue;
+            }
+            _lastSent[it->first] = now;
+            _flush(it->first, std::move(it->second.diagnostics));
+            it = _pending.erase(it);
+        }
+        if (wake_at == clock::time_point::max()) {
+            _wake.wait(lk);
+        } else {
+            _wake.wait_until(lk, wake_at);
+        }
+    }
+}
+
+void DiagnosticPublisher::publish(const std::string& owner,
+                                  DiagnosticsByUri diagnostics,
+                                  const std::function<bool()>& current) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    if (current && !current())
+        return;
+    const auto now = clock::now();
+    const auto last = _lastSent.find(owner);
+    if (last == _lastSent.end() || now - last->second >= _interval) {
+        _lastSent[owner] = now;
+        _pending.erase(owner);
+        _flush(owner, std::move(diagnostics));
+        return;
+    }
+    auto& pending = _pending[owner];
+    pending.due = last->second + _interval;
+    pending.diagnostics = std::move(diagnostics);
+    _wake.notify_one();
+}
+
+void DiagnosticPublisher::clear(const std::string& owner) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    _pending.erase(owner);
+    _flush(owner, {});
+    _owned.erase(owner);
+    _lastSent.erase(owner);
+}
@@ -0,0 +1,101 @@
+#ifndef CLS_DIAGNOSTIC_PUBLISHER_HPP_INCLUDED
+#define CLS_DIAGNOSTIC_PUBLISHER_HPP_INCLUDED
+
+#include "translation_unit_cache.hpp"
+#include "types.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cls {
+
+/// LSP diagnostics by the URI of the file they are in
+using DiagnosticsByUri = std::map<std::string, std::vector<langsrv::Diagnostic>>;
+
+/**
+ * Convert the diagnostics of a parsed unit for the client.
+ *
+ * Positions are converted to LSP with one pass over each file involved,
+ * reading the text clang parsed from `unsaved` or else from the disk.
+ * Diagnostics without a location go to the main file, which is always in the
+ * result, so that the client clears it once it has no more diagnostics.
+ * Clang reports paths relative to `directory`, the one the unit was compiled
+ * in, so they are resolved against it before being compared.
+ */
+DiagnosticsByUri convertDiagnostics(clangxx::TranslationUnit& unit,
+                                    const std::string& directory,
+                                    const std::string& mainPath,
+                                    const std::string& mainUri,
+                                    const std::vector<UnsavedBuffer>& unsaved);
+
+/**
+ * Sends diagnostics to the client with textDocument/publishDiagnostics.
+ *
+ * Each publish comes from a unit, named by its main document, and covers
+ * every file the unit has diagnostics in. Only files whose diagnostics
+ * differ from what was last sent for them are sent again, and files the unit
+ * reported before but doesn't any more are cleared.
+ *
+ * A unit publishes at most once per `interval`. A publish that comes sooner
+ * is held back until the interval is up, and replaced if another comes in
+ * meanwhile, so a burst of reparses sends only the last result.
+ */
+class DiagnosticPublisher {
+public:
+    using clock = std::chrono::steady_clock;
+    using send_fn = std::function<void(const langsrv::PublishDiagnosticsParams&)>;
+
+private:
+    struct Pending {
+        clock::time_point due;
+        DiagnosticsByUri diagnostics;
+    };
+    struct Published {
+        /// The unit that last sent diagnostics for the file
+        std::string owner;
+        /// What it sent, serialized
+        std::string text;
+    };
+
+    send_fn _send;
+    clock::duration _interval;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::map<std::string, Published> _published;
+    /// The files each unit last sent diagnostics for
+    std::map<std::string, std::set<std::string>> _owned;
+    std::map<std::string, clock::time_point> _lastSent;
+    /// Publishes held back, by unit
+    std::map<std::string, Pending> _pending;
+    bool _stopping = false;
+    std::thread _thread;
+
+    /// Send what changed. Called with the lock held
+    void _flush(const std::string& owner, DiagnosticsByUri diagnostics);
+    void _work();
+
+public:
+    DiagnosticPublisher(send_fn send, clock::duration interval);
+    ~DiagnosticPublisher();
+    DiagnosticPublisher(const DiagnosticPublisher&) = delete;
+    DiagnosticPublisher& operator=(const DiagnosticPublisher&) = delete;
+
+    /// Publish the diagnostics of a unit, unless `current` says they are out
+    /// of date. It is asked under the same lock clear() takes, so a unit
+    /// cleared once its document is closed stays cleared
+    void publish(const std::string& owner,
+                 DiagnosticsByUri diagnostics,
+                 const std::function<bool()>& current = {});
+    /// Clear every file the unit has sent diagnostics for
+    void clear(const std::string& owner);
+};
+}
+
+#endif  // CLS_DIAGNOSTIC_PUBLISHER_HPP_INCLUDED
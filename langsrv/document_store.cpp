@@ -0,0 +1,348 @@
+#include "document_store.hpp"
+
+#include <algorithm>
+#include <initializer_list>
+
+using namespace cls;
+
+namespace {
+
+/// Flatten the document once the inserted text outgrows both it and this
+const std::size_t min_added_to_flatten = 64 * 1024;
+
+/// The number of bytes in the UTF-8 sequence starting with `lead`, and the
+/// number of UTF-16 code units it encodes
+std::pair<std::size_t, int> utf8Sequence(unsigned char lead) {
+    if (lead < 0xC0)
+        return { 1, 1 };
+    if (lead < 0xE0)
+        return { 2, 1 };
+    if (lead < 0xF0)
+        return { 3, 1 };
+    return { 4, 2 };
+}
+}
+
+struct Document::Node {
+    Piece piece;
+    /// Of the whole subtree
+    std::size_t length;
+    std::size_t newlines;
+    std::uint32_t priority;
+    NodePtr left;
+    NodePtr right;
+
+    void update() {
+        length = piece.length;
+        newlines = piece.newlines;
+        for (const auto child : { left.get(), right.get() }) {
+            if (child) {
+                length += child->length;
+                newlines += child->newlines;
+            }
+        }
+    }
+};
+
+Document::Document(int version, std::string text)
+    : _version(version) {
+    _reset(std::move(text));
+}
+
+Document::~Document() = default;
+Document::Document(Document&&) = default;
+Document& Document::operator=(Document&&) = default;
+
+std::size_t Document::size() const {
+    return _root ? _root->length : 0;
+}
+
+Document::Piece Document::_makePiece(bool added, std::size_t start, std::size_t length) const {
+    Piece p{ added, start, length, 0 };
+    const auto data = _data(p);
+    p.newlines = static_cast<std::size_t>(std::count(data, data + length, '\n'));
+    return p;
+}
+
+Document::NodePtr Document::_makeNode(const Piece& piece) {
+    // xorshift32
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 17;
+    _seed ^= _seed << 5;
+    NodePtr ret{ new Node{ piece, 0, 0, _seed, nullptr, nullptr } };
+    ret->update();
+    return ret;
+}
+
+std::pair<Document::NodePtr, Document::NodePtr> Document::_split(NodePtr tree,
+                                                                 std::size_t offset) const {
+    if (!tree)
+        return {};
+    const auto left_length = tree->left ? tree->left->length : 0;
+    if (offset <= left_length) {
+        auto parts = _split(std::move(tree->left), offset);
+        tree->left = std::move(parts.second);
+        tree->update();
+        return { std::move(parts.first), std::move(tree) };
+    }
+    if (offset >= left_length + tree->piece.length) {
+        auto parts = _split(std::move(tree->right), offset - left_length - tree->piece.length);
+        tree->right = std::move(parts.first);
+        tree->update();
+        return { std::move(tree), std::move(parts.second) };
+    }
+    // The offset is inside this node's piece: it keeps the head, and the tail
+    // becomes a node of its own, the leftmost of the right part
+    const auto p = tree->piece;
+    const auto head = _makePiece(p.added, p.start, offset - left_length);
+    const Piece tail_piece{ p.added, p.start + head.length, p.length - head.length,
+                            p.newlines - head.newlines };
+    NodePtr tail{ new Node{ tail_piece, 0, 0, tree->priority, nullptr, std::move(tree->right) } };
+    tail->update();
+    tree->piece = head;
+    tree->update();
+    return { std::move(tree), std::move(tail) };
+}
+
+Document::NodePtr Document::_merge(NodePtr left, NodePtr right) {
+    if (!left)
+        return right;
+    if (!right)
+        return left;
+    if (left->priority > right->priority) {
+        left->right = _merge(std::move(left->right), std::move(right));
+        left->update();
+        return left;
+    }
+    right->left = _merge(std::move(left), std::move(right->left));
+    right->update();
+    return right;
+}
+
+boost::optional<std::size_t> Document::_lineStart(std::size_t line) const {
+    if (line == 0)
+        return std::size_t{ 0 };
+    std::size_t offset = 0;
+    auto node = _root.get();
+    while (node) {
+        const auto left = node->left.get();
+        if (left && left->newlines >= line) {
+            node = left;
+            continue;
+        }
+        if (left) {
+            line -= left->newlines;
+            offset += left->length;
+        }
+        const auto& p = node->piece;
+        if (p.newlines >= line) {
+            const auto data = _data(p);
+            std::size_t inner = 0;
+            for (; line; --line) {
+                inner = static_cast<std::size_t>(std::find(data + inner, data + p.length, '\n')
+                                                 - data)
+                    + 1;
+            }
+            return offset + inner;
+        }
+        line -= p.newlines;
+        offset += p.length;
+        node = node->right.get();
+    }
+    return boost::none;
+}
+
+void Document::_copy(const Node* node,
+                     std::size_t first,
+                     std::size_t last,
+                     std::string& out) const {
+    // Offsets are relative to the start of `node`'s subtree
+    while (node && first < last) {
+        const auto left_length = node->left ? node->left->length : 0;
+        if (first < left_length)
+            _copy(node->left.get(), first, std::min(last, left_length), out);
+        const auto piece_end = left_length + node->piece.length;
+        if (first < piece_end && last > left_length) {
+            const auto from = std::max(first, left_length);
+            const auto to = std::min(last, piece_end);
+            out.append(_data(node->piece) + (from - left_length), to - from);
+        }
+        if (last <= piece_end)
+            return;
+        first = first > piece_end ? first - piece_end : 0;
+        last -= piece_end;
+        node = node->right.get();
+    }
+}
+
+void Document::_reset(std::string text) {
+    _original = std::move(text);
+    _added.clear();
+    _root.reset();
+    _text.reset();
+    if (!_original.empty()) {
+        _root = _makeNode(_makePiece(false, 0, _original.size()));
+    }
+}
+
+void Document::_replace(std::size_t first, std::size_t last, const std::string& text) {
+    _text.reset();
+    auto parts = _split(std::move(_root), first);
+    auto before = std::move(parts.first);
+    auto after = _split(std::move(parts.second), last - first).second;
+    if (!text.empty()) {
+        const auto start = _added.size();
+        _added += text;
+        const auto piece = _makePiece(true, start, text.size());
+        // Typing appends to the previous insertion, so extend its piece
+        // rather than adding one per keystroke
+        auto prev = before.get();
+        while (prev && prev->right)
+            prev = prev->right.get();
+        if (prev && prev->piece.added && prev->piece.start + prev->piece.length == start) {
+            for (auto node = before.get(); node; node = node->right.get()) {
+                node->length += piece.length;
+                node->newlines += piece.newlines;
+            }
+            prev->piece.length += piece.length;
+            prev->piece.newlines += piece.newlines;
+        } else {
+            before = _merge(std::move(before), _makeNode(piece));
+        }
+    }
+    _root = _merge(std::move(before), std::move(after));
+    if (_added.size() > std::max(size(), min_added_to_flatten)) {
+        _reset(*this->text());
+    }
+}
+
+std::size_t Document::offsetAt(const langsrv::Position& pos) const {
+    const auto line = static_cast<std::size_t>(std::max(pos.line, 0));
+    const auto start = _lineStart(line);
+    if (!start) {
+        return size();  // Past the last line
+    }
+    const auto next = _lineStart(line + 1);
+    const auto end = next ? *next - 1 : size();
+    std::string text;
+    _copy(_root.get(), *start, end, text);
+
+    // Walk the line one character at a time, up to its end
+    auto units_left = std::max(pos.character, 0);
+    std::size_t at = 0;
+    while (at < text.size() && units_left) {
+        const auto seq = utf8Sequence(static_cast<unsigned char>(text[at]));
+        at = std::min(at + seq.first, text.size());
+        units_left -= std::min(seq.second, units_left);
+    }
+    return *start + at;
+}
+
+void Document::applyChange(const langsrv::TextDocumentContentChangeEvent& change) {
+    if (!change.range) {
+        _reset(change.text);
+        return;
+    }
+    auto first = offsetAt(change.range->start);
+    auto last = offsetAt(change.range->end);
+    if (last < first) {
+        std::swap(first, last);
+    }
+    _replace(first, last, change.text);
+}
+
+std::shared_ptr<const std::string> Document::text() const {
+    if (!_text) {
+        std::string ret;
+        ret.reserve(size());
+        _copy(_root.get(), 0, size(), ret);
+        _text = std::make_shared<const std::string>(std::move(ret));
+    }
+    return _text;
+}
+
+std::vector<langsrv::Position> cls::positionsAt(const std::string& text,
+                                                const std::vector<std::size_t>& offsets) {
+    std::vector<langsrv::Position> ret;
+    ret.reserve(offsets.size());
+    langsrv::Position pos{ 0, 0 };
+    std::size_t at = 0;
+    for (const auto offset : offsets) {
+        const auto stop = std::min(offset, text.size());
+        while (at < stop) {
+            const auto c = static_cast<unsigned char>(text[at]);
+            if (c == '\n') {
+                ++pos.line;
+                pos.character = 0;
+                ++at;
+                continue;
+            }
+            const auto seq = utf8Sequence(c);
+            pos.character += seq.second;
+            at += seq.first;
+        }
+        ret.push_back(pos);
+    }
+    return ret;
+}
+
+std::shared_ptr<DocumentStore::Entry> DocumentStore::_find(const std::string& uri) const {
+    std::lock_guard<std::mutex> lk{ _lock };
+    const auto iter = _documents.find(uri);
+    return iter == _documents.end() ? nullptr : iter->second;
+}
+
+void DocumentStore::open(const langsrv::TextDocumentItem& item) {
+    auto entry = std::make_shared<Entry>(item.version, item.text);
+    std::lock_guard<std::mutex> lk{ _lock };
+    _documents[item.uri] = std::move(entry);
+}
+
+bool DocumentStore::change(const langsrv::DidChangeTextDocumentParams& params) {
+    const auto entry = _find(params.textDocument.uri);
+    if (!entry)
+        return false;
+    std::lock_guard<std::mutex> lk{ entry->lock };
+    for (const auto& change : params.contentChanges) {
+        entry->document.applyChange(change);
+    }
+    entry->document.setVersion(params.textDocument.version);
+    return true;
+}
+
+void DocumentStore::close(const std::string& uri) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    _documents.erase(uri);
+}
+
+boost::optional<int> DocumentStore::version(const std::string& uri) const {
+    const auto entry = _find(uri);
+    if (!entry)
+        return boost::none;
+    std::lock_guard<std::mutex> lk{ entry->lock };
+    return entry->document.version();
+}
+
+boost::optional<DocumentSnapshot> DocumentStore::snapshot(const std::string& uri) const {
+    const auto entry = _find(uri);
+    if (!entry)
+        return boost::none;
+    std::lock_guard<std::mutex> lk{ entry->lock };
+    return DocumentSnapshot{ entry->document.version(), entry->document.text() };
+}
+
+std::map<std::string, DocumentSnapshot> DocumentStore::snapshots() const {
+    std::vector<std::pair<std::string, std::shared_ptr<Entry>>> entries;
+    {
+        std::lock_guard<std::mutex> lk{ _lock };
+        entries.assign(_documents.begin(), _documents.end());
+    }
+    std::map<std::string, DocumentSnapshot> ret;
+    for (const auto& pair : entries) {
+        std::lock_guard<std::mutex> lk{ pair.second->lock };
+        ret.emplace(pair.first,
+                    DocumentSnapshot{ pair.second->document.version(),
+                                      pair.second->document.text() });
+    }
+    return ret;
+}
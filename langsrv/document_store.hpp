@@ -0,0 +1,134 @@
+#ifndef CLS_DOCUMENT_STORE_HPP_INCLUDED
+#define CLS_DOCUMENT_STORE_HPP_INCLUDED
+
+#include "types.hpp"
+
+#include <boost/optional.hpp>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace cls {
+
+/**
+ * The contents of an open document, kept as a piece table.
+ *
+ * The text is the concatenation of pieces, each referring to a run of either
+ * the text the document was opened with or an append-only buffer of inserted
+ * text. The pieces are the nodes of a balanced tree, a treap, in which each
+ * node knows the length of its subtree and how many newlines it holds. That
+ * finds an offset or the start of a line in a number of steps logarithmic in
+ * the number of pieces, and an edit splits and joins the tree at its ends, so
+ * its cost depends on the size of the edit, not on the size of the document.
+ * Once the insertions outgrow the document, it is flattened back into one
+ * piece.
+ */
+class Document {
+    struct Piece {
+        bool added;
+        std::size_t start;
+        std::size_t length;
+        std::size_t newlines;
+    };
+    struct Node;
+    using NodePtr = std::unique_ptr<Node>;
+
+    int _version;
+    std::string _original;
+    std::string _added;
+    NodePtr _root;
+    std::uint32_t _seed = 0x9E3779B9u;
+    /// The whole text, once something has asked for it since the last edit
+    mutable std::shared_ptr<const std::string> _text;
+
+    const char* _data(const Piece& p) const {
+        return (p.added ? _added.data() : _original.data()) + p.start;
+    }
+    Piece _makePiece(bool added, std::size_t start, std::size_t length) const;
+    NodePtr _makeNode(const Piece& piece);
+    /// Splits `tree` into the pieces before `offset` and those from it on
+    std::pair<NodePtr, NodePtr> _split(NodePtr tree, std::size_t offset) const;
+    static NodePtr _merge(NodePtr left, NodePtr right);
+    /// The offset at which `line` starts, or none past the last line
+    boost::optional<std::size_t> _lineStart(std::size_t line) const;
+    /// Append the text in [first, last) to `out`
+    void _copy(const Node* node, std::size_t first, std::size_t last, std::string& out) const;
+    void _replace(std::size_t first, std::size_t last, const std::string& text);
+    void _reset(std::string text);
+
+public:
+    Document(int version, std::string text);
+    ~Document();
+    Document(Document&&);
+    Document& operator=(Document&&);
+
+    int version() const { return _version; }
+    std::size_t size() const;
+
+    /// The byte offset of an LSP position, whose character is counted in
+    /// UTF-16 code units. Positions past the end of a line or of the document
+    /// are clamped
+    std::size_t offsetAt(const langsrv::Position& pos) const;
+
+    /// Apply one change. A change without a range replaces the whole text
+    void applyChange(const langsrv::TextDocumentContentChangeEvent& change);
+    void setVersion(int version) { _version = version; }
+
+    /// The whole text. Until the next change, every call returns the same
+    /// string rather than a copy of it
+    std::shared_ptr<const std::string> text() const;
+};
+
+/// The LSP positions of byte offsets into `text`, found in a single pass over
+/// it. `offsets` must be sorted; offsets past the end map to the end
+std::vector<langsrv::Position> positionsAt(const std::string& text,
+                                           const std::vector<std::size_t>& offsets);
+
+/// The contents of a document at some version. Snapshots of a document that
+/// has not changed in between share their text
+struct DocumentSnapshot {
+    int version;
+    std::shared_ptr<const std::string> text;
+};
+
+/**
+ * The documents the client has opened, by URI.
+ *
+ * Changes to one document are expected to arrive in order, which the server's
+ * ordering by URI guarantees; different documents may be changed and read
+ * concurrently.
+ */
+class DocumentStore {
+    struct Entry {
+        std::mutex lock;
+        Document document;
+
+        Entry(int version, std::string text)
+            : document(version, std::move(text)) {}
+    };
+
+    mutable std::mutex _lock;
+    std::map<std::string, std::shared_ptr<Entry>> _documents;
+
+    std::shared_ptr<Entry> _find(const std::string& uri) const;
+
+public:
+    void open(const langsrv::TextDocumentItem& item);
+    /// Returns false if the document isn't open
+    bool change(const langsrv::DidChangeTextDocumentParams& params);
+    void close(const std::string& uri);
+
+    bool isOpen(const std::string& uri) const { return !!_find(uri); }
+    /// The version of an open document, or none if it isn't open
+    boost::optional<int> version(const std::string& uri) const;
+    boost::optional<DocumentSnapshot> snapshot(const std::string& uri) const;
+    /// Snapshots of every open document, by URI
+    std::map<std::string, DocumentSnapshot> snapshots() const;
+};
+}
+
+#endif  // CLS_DOCUMENT_STORE_HPP_INCLUDED
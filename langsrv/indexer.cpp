@@ -0,0 +1,639 @@
+#include "indexer.hpp"
+
+#include "compilation_database.hpp"
+#include "document_store.hpp"
+#include "occurrences.hpp"
+#include "parallel_ast_builder.hpp"
+#include "project_query.hpp"
+#include "uri.hpp"
+
+#include <json_rpc/logging.hpp>
+
+#include <clang/AST/DeclCXX.h>
+#include <clang/AST/DeclTemplate.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Lex/Lexer.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+
+using namespace cls;
+
+namespace {
+
+namespace log = json_rpc::log;
+
+/// How many units to build between writes to the index, per job
+const std::size_t unitsPerJobPerBatch = 16;
+
+/// The LSP SymbolKind of a declaration
+int symbolKind(const clang::NamedDecl* decl) {
+    if (const auto templ = llvm::dyn_cast<clang::TemplateDecl>(decl)) {
+        if (const auto templated = templ->getTemplatedDecl()) {
+            decl = templated;
+        }
+    }
+    if (llvm::isa<clang::NamespaceDecl>(decl) || llvm::isa<clang::NamespaceAliasDecl>(decl))
+        return 3;
+    if (llvm::isa<clang::EnumDecl>(decl))
+        return 10;
+    if (llvm::isa<clang::TagDecl>(decl) || llvm::isa<clang::TypedefNameDecl>(decl))
+        return 5;
+    if (llvm::isa<clang::CXXConstructorDecl>(decl))
+        return 9;
+    if (llvm::isa<clang::CXXMethodDecl>(decl))
+        return 6;
+    if (llvm::isa<clang::FunctionDecl>(decl))
+        return 12;
+    if (llvm::isa<clang::FieldDecl>(decl))
+        return 8;
+    if (llvm::isa<clang::EnumConstantDecl>(decl))
+        return 14;
+    return 13;
+}
+
+struct Found {
+    clang::FileID file;
+    unsigned offset;
+    unsigned length;
+    std::uint32_t symbol;
+    OccurrenceRole role;
+};
+
+bool operator<(const Found& a, const Found& b) {
+    return std::tie(a.file, a.offset) < std::tie(b.file, b.offset);
+}
+}
+
+IndexedUnit cls::indexUnit(const std::string& file, clang::ASTUnit& unit, const ClaimFn& claim) {
+    const auto& sm = unit.getSourceManager();
+    const auto& directory = unit.getFileManager().getFileSystemOpts().WorkingDir;
+    IndexedUnit ret;
+    ret.file = file;
+
+    // Symbols by declaration, and by USR for the declarations of the same
+    // symbol. Declarations without a USR map to `unnamed`
+    const auto unnamed = std::numeric_limits<std::uint32_t>::max();
+    std::unordered_map<const clang::NamedDecl*, std::uint32_t> by_decl;
+    std::unordered_map<std::string, std::uint32_t> by_usr;
+    const auto symbol_of = [&](const clang::NamedDecl* decl) {
+        const auto found = by_decl.find(decl);
+        if (found != by_decl.end())
+            return found->second;
+        auto id = unnamed;
+        auto usr = usrOf(decl);
+        if (!usr.empty()) {
+            const auto existing = by_usr.find(usr);
+            if (existing != by_usr.end()) {
+                id = existing->second;
+            } else {
+                id = static_cast<std::uint32_t>(ret.symbols.size());
+                by_usr.emplace(usr, id);
+                IndexedSymbol symbol;
+                symbol.usr = std::move(usr);
+                symbol.name = decl->getNameAsString();
+                symbol.qualifiedName = decl->getQualifiedNameAsString();
+                symbol.kind = symbolKind(decl);
+                ret.symbols.push_back(std::move(symbol));
+            }
+        }
+        by_decl.emplace(decl, id);
+        return id;
+    };
+
+    std::vector<Found> found;
+    const auto on_occurrence = [&](const clang::NamedDecl* decl,
+                                   clang::SourceLocation loc,
+                                   OccurrenceRole role) {
+        const auto symbol = symbol_of(decl);
+        if (symbol == unnamed)
+            return;
+        const auto decomposed = sm.getDecomposedLoc(loc);
+        if (!sm.getFileEntryForID(decomposed.first))
+            return;
+        const auto length = clang::Lexer::MeasureTokenLength(loc, sm, unit.getLangOpts());
+        found.push_back({ decomposed.first, decomposed.second, length, symbol, role });
+    };
+    // Whether we record each header, as far as we asked
+    std::unordered_map<const clang::FileEntry*, bool> recorded;
+    const auto skip = [&](clang::FileID fid) {
+        const auto entry = sm.getFileEntryForID(fid);
+        if (!claim || !entry || fid == sm.getMainFileID())
+            return false;
+        auto found = recorded.find(entry);
+        if (found == recorded.end()) {
+            const auto mine = claim(normalizePath(entry->getName(), directory));
+            found = recorded.emplace(entry, mine).first;
+        }
+        return !found->second;
+    };
+    forEachOccurrence(unit, on_occurrence, skip);
+
+    // Work out positions a file at a time, in one pass over each
+    std::sort(found.begin(), found.end());
+    std::map<std::string, std::uint32_t> files;
+    for (auto begin = found.begin(); begin != found.end();) {
+        const auto fid = begin->file;
+        const auto end = std::find_if(begin, found.end(), [&](const Found& f) {
+            return f.file != fid;
+        });
+        std::vector<std::size_t> offsets;
+        for (auto iter = begin; iter != end; ++iter) {
+            offsets.push_back(iter->offset);
+            offsets.push_back(iter->offset + iter->length);
+        }
+        std::sort(offsets.begin(), offsets.end());
+        offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+        const auto positions = positionsAt(sm.getBufferData(fid).str(), offsets);
+        const auto position_of = [&](std::size_t offset) {
+            const auto at = std::lower_bound(offsets.begin(), offsets.end(), offset);
+            return positions[static_cast<std::size_t>(at - offsets.begin())];
+        };
+
+        const auto path = normalizePath(sm.getFileEntryForID(fid)->getName(), directory);
+        const auto file_id = files.emplace(path, static_cast<std::uint32_t>(files.size()));
+        if (file_id.second) {
+            ret.files.push_back(path);
+        }
+        for (auto iter = begin; iter != end; ++iter) {
+            IndexedOccurrence occurrence;
+            occurrence.symbol = iter->symbol;
+            occurrence.file = file_id.first->second;
+            occurrence.range.start = position_of(iter->offset);
+            occurrence.range.end = position_of(iter->offset + iter->length);
+            occurrence.role = iter->role;
+            ret.occurrences.push_back(occurrence);
+        }
+        begin = end;
+    }
+
+    // What the unit was built from, to tell when it needs indexing again
+    const auto main_file = sm.getFileEntryForID(sm.getMainFileID());
+    for (auto iter = sm.fileinfo_begin(); iter != sm.fileinfo_end(); ++iter) {
+        const auto buffer = iter->second->getRawBuffer();
+        if (!buffer)
+            continue;
+        IndexedDependency dependency;
+        dependency.path = normalizePath(iter->first->getName(), directory);
+        dependency.hash = fingerprintHash(buffer->getBuffer().str());
+        if (claim && iter->first != main_file) {
+            const auto found = recorded.find(iter->first);
+            dependency.recorded = found != recorded.end() && found->second;
+        }
+        ret.dependencies.push_back(std::move(dependency));
+    }
+    return ret;
+}
+
+/// What the indexer thread shares with the BackgroundIndexer
+struct BackgroundIndexer::Run {
+    std::atomic_bool stop{ false };
+    std::mutex lock;
+    std::condition_variable wake;
+    /// Saved files not looked at yet
+    std::vector<std::string> saved;
+};
+
+namespace {
+
+std::uint64_t commandHash(const clang::tooling::CompileCommand& command) {
+    auto str = command.Directory;
+    for (const auto& arg : command.CommandLine) {
+        str += '\0';
+        str += arg;
+    }
+    return fingerprintHash(str);
+}
+
+/// The hash of a file's contents, or none if it can't be read
+boost::optional<std::uint64_t> hashFile(const std::string& path) {
+    std::ifstream in{ path, std::ios::binary };
+    if (!in)
+        return boost::none;
+    return fingerprintHash(
+        { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() });
+}
+
+/// Hashes files on disk, each once
+class FileHashes {
+    std::unordered_map<std::string, boost::optional<std::uint64_t>> _hashes;
+
+public:
+    boost::optional<std::uint64_t> operator()(const std::string& path) {
+        const auto found = _hashes.find(path);
+        if (found != _hashes.end())
+            return found->second;
+        return _hashes.emplace(path, hashFile(path)).first->second;
+    }
+};
+
+/// An option whose value decides which macros a header sees, or which file
+/// an #include finds
+struct ContextOption {
+    const char* name;
+    /// Whether the value is a path, which is taken relative to the command's
+    /// directory
+    bool path;
+    /// Whether the value may come as the next argument rather than joined to
+    /// the name, with or without an `=`
+    bool separate;
+};
+
+/// Longer names come before those that are their prefixes
+const ContextOption contextOptions[] = {
+    { "-include-pch", true, true }, { "-include", true, true },
+    { "-imacros", true, true },     { "-isystem", true, true },
+    { "-isysroot", true, true },    { "-iquote", true, true },
+    { "-idirafter", true, true },   { "-iprefix", true, true },
+    { "-iwithprefix", true, true }, { "--sysroot", true, true },
+    { "--gcc-toolchain", true, true }, { "-I", true, true },
+    { "-F", true, true },           { "-D", false, true },
+    { "-U", false, true },          { "-x", false, true },
+    { "-target", false, true },     { "--target", false, false },
+    { "-stdlib", false, false },    { "-std", false, false },
+    { "--std", false, false },      { "-march", false, false },
+    { "-mcpu", false, false },      { "-mfpu", false, false },
+    { "-mfloat-abi", false, false }, { "-mabi", false, false },
+    { "-fms-compatibility-version", false, false }, { "-fsanitize", false, false },
+    { "-O", false, false },
+};
+
+/// Flags that predefine macros or change the search for headers. A `-fno-`
+/// or `-mno-` flag counts as the flag it turns off
+const char* const contextFlags[] = {
+    "-ansi", "-pthread", "-nostdinc", "-nostdinc++", "-nostdlibinc",
+    "-fexceptions", "-fcxx-exceptions", "-frtti", "-fopenmp", "-fopenmp-simd",
+    "-fpic", "-fPIC", "-fpie", "-fPIE", "-fms-extensions", "-fms-compatibility",
+    "-fdeclspec", "-fdelayed-template-parsing", "-fshort-wchar", "-fsigned-char",
+    "-funsigned-char", "-fchar8_t", "-fcoroutines-ts", "-fmodules", "-fsized-deallocation",
+    "-faligned-allocation", "-faligned-new", "-fgnu-keywords", "-fgnu89-inline",
+    "-foperator-names", "-fdigraphs", "-fblocks", "-fobjc-arc", "-ffast-math",
+    "-ffinite-math-only", "-fmath-errno", "-ffreestanding", "-fbuiltin",
+    "-fstack-protector", "-fstack-protector-strong", "-fstack-protector-all",
+    "-m16", "-m32", "-m64", "-mx32", "-mthumb", "-marm", "-msoft-float", "-mhard-float",
+    "-mbig-endian", "-mlittle-endian",
+};
+
+/// Instruction set extensions, each of which predefines a macro. These
+/// match by prefix, so that `-msse` covers `-msse4.2` and `-mavx` `-mavx512f`
+const char* const contextFeaturePrefixes[] = {
+    "-msse", "-mssse", "-mavx", "-mfma", "-mbmi", "-mpopcnt", "-maes", "-mpclmul", "-mf16c",
+    "-mlzcnt", "-mmmx", "-msha", "-mrdrnd", "-mmovbe", "-mxsave", "-madx", "-mrtm",
+    "-mneon", "-mcrc", "-mcrypto", "-maltivec", "-mvsx",
+};
+
+bool startsWith(const std::string& str, const char* prefix) {
+    return str.compare(0, std::strlen(prefix), prefix) == 0;
+}
+
+/// `-fno-x` as `-fx`, and `-mno-x` as `-mx`
+std::string positiveFlag(const std::string& arg) {
+    if (startsWith(arg, "-fno-") || startsWith(arg, "-mno-"))
+        return arg.substr(0, 2) + arg.substr(5);
+    return arg;
+}
+
+/// A hash of the options that decide which macros are defined where a unit
+/// includes a header, and which files its includes find. Units with the
+/// same options are taken to see headers the same, which holds for headers
+/// with include guards that don't depend on what was included before them.
+///
+/// Only options known to matter are hashed, so that units differing in
+/// warnings, debug information or code generation share their headers
+std::uint64_t contextHash(const clang::tooling::CompileCommand& command) {
+    std::string str;
+    const auto& args = command.CommandLine;
+    for (std::size_t i = 1; i < args.size(); ++i) {
+        const auto& arg = args[i];
+        const auto option = std::find_if(std::begin(contextOptions),
+                                         std::end(contextOptions),
+                                         [&](const ContextOption& o) {
+                                             return startsWith(arg, o.name);
+                                         });
+        if (option != std::end(contextOptions)) {
+            auto value = arg.substr(std::strlen(option->name));
+            if (value.empty() && option->separate && i + 1 < args.size()) {
+                value = args[++i];
+            } else if (!value.empty() && value[0] == '=') {
+                value.erase(0, 1);
+            }
+            if (option->path) {
+                value = normalizePath(value, command.Directory);
+            }
+            str += option->name;
+            str += '=';
+            str += value;
+            str += '\0';
+            continue;
+        }
+        const auto flag = positiveFlag(arg);
+        const auto matches = [&](const char* name) { return flag == name; };
+        const auto has_prefix = [&](const char* prefix) { return startsWith(flag, prefix); };
+        if (std::any_of(std::begin(contextFlags), std::end(contextFlags), matches)
+            || std::any_of(std::begin(contextFeaturePrefixes),
+                           std::end(contextFeaturePrefixes),
+                           has_prefix)) {
+            str += arg;
+            str += '\0';
+        }
+    }
+    return fingerprintHash(str);
+}
+
+/// Which unit records the occurrences in each header, for each macro
+/// context
+class HeaderClaims {
+public:
+    using Key = std::pair<std::string, std::uint64_t>;
+
+private:
+    mutable std::mutex _lock;
+    std::map<Key, std::string> _owners;
+
+public:
+    /// Whether `unit` is the one to record `header`, which it becomes if no
+    /// unit is yet
+    bool claim(const std::string& header, std::uint64_t context, const std::string& unit) {
+        std::lock_guard<std::mutex> lk{ _lock };
+        return _owners.emplace(Key{ header, context }, unit).first->second == unit;
+    }
+
+    bool claimed(const Key& key) const {
+        std::lock_guard<std::mutex> lk{ _lock };
+        return _owners.count(key) != 0;
+    }
+
+    /// Give up the headers `units` record, and return them
+    std::vector<Key> release(const std::set<std::string>& units) {
+        std::lock_guard<std::mutex> lk{ _lock };
+        std::vector<Key> ret;
+        for (auto iter = _owners.begin(); iter != _owners.end();) {
+            if (units.count(iter->second)) {
+                ret.push_back(iter->first);
+                iter = _owners.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+        return ret;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lk{ _lock };
+        _owners.clear();
+    }
+};
+
+/// Builds units and writes what they contain to the index
+class UnitIndexer {
+    const clang::tooling::CompilationDatabase& _db;
+    CrossReferenceIndex& _index;
+    HeaderClaims& _claims;
+    unsigned _jobs;
+    const json_rpc::cancellation_token& _cancel;
+
+public:
+    UnitIndexer(const clang::tooling::CompilationDatabase& db,
+                CrossReferenceIndex& index,
+                HeaderClaims& claims,
+                unsigned jobs,
+                const json_rpc::cancellation_token& cancel)
+        : _db(db)
+        , _index(index)
+        , _claims(claims)
+        , _jobs(std::max(jobs, 1u))
+        , _cancel(cancel) {}
+
+    void operator()(const std::vector<std::string>& files,
+                    const std::vector<std::string>& removed = {}) const {
+        std::set<std::string> leaving(files.begin(), files.end());
+        leaving.insert(removed.begin(), removed.end());
+        const auto released = _claims.release(leaving);
+        if (files.empty()) {
+            if (!removed.empty()) {
+                _index.update({}, removed);
+            }
+        } else {
+            _indexUnits(files, removed);
+        }
+        if (_cancel.cancelled())
+            return;
+
+        // Hand the headers nobody records any more to another unit that
+        // includes them
+        std::set<HeaderClaims::Key> orphans;
+        for (const auto& key : released) {
+            if (!_claims.claimed(key)) {
+                orphans.insert(key);
+            }
+        }
+        if (orphans.empty())
+            return;
+        std::set<std::string> adopters;
+        _index.forEachUnit([&](const IndexedUnit& unit) {
+            if (leaving.count(unit.file))
+                return;
+            for (const auto& dep : unit.dependencies) {
+                if (orphans.erase({ dep.path, unit.contextHash })) {
+                    adopters.insert(unit.file);
+                }
+            }
+        });
+        if (!adopters.empty()) {
+            (*this)({ adopters.begin(), adopters.end() });
+        }
+    }
+
+private:
+    void _indexUnits(const std::vector<std::string>& files,
+                     const std::vector<std::string>& removed) const {
+        log::info("Indexing ", files.size(), " translation units into ", _index.path());
+        // Hash the commands up front, the database isn't ours to use from
+        // several threads
+        std::unordered_map<std::string, std::pair<std::uint64_t, std::uint64_t>> hashes;
+        for (const auto& file : files) {
+            const auto commands = _db.getCompileCommands(file);
+            if (!commands.empty()) {
+                hashes.emplace(file,
+                               std::make_pair(commandHash(commands.front()),
+                                              contextHash(commands.front())));
+            }
+        }
+        const auto hashes_of = [&](const std::string& file) {
+            const auto found = hashes.find(file);
+            return found != hashes.end() ? found->second
+                                         : std::pair<std::uint64_t, std::uint64_t>{};
+        };
+
+        const ParallelASTBuilder builder{ _db, _jobs };
+        const auto map = [&](const std::string& file, clang::ASTUnit& unit) {
+            const auto unit_hashes = hashes_of(file);
+            const auto claim = [&](const std::string& header) {
+                return _claims.claim(header, unit_hashes.second, file);
+            };
+            auto ret = indexUnit(file, unit, claim);
+            ret.commandHash = unit_hashes.first;
+            ret.contextHash = unit_hashes.second;
+            return ret;
+        };
+        const auto merge = [](std::vector<IndexedUnit>& units, IndexedUnit unit) {
+            units.push_back(std::move(unit));
+        };
+        const auto batch_size = unitsPerJobPerBatch * _jobs;
+        for (std::size_t first = 0; first < files.size() && !_cancel.cancelled();
+             first += batch_size) {
+            const auto last = std::min(first + batch_size, files.size());
+            const std::vector<std::string> batch(files.begin() + first, files.begin() + last);
+            auto res = queryUnits<std::vector<IndexedUnit>>(builder, batch, map, merge, _cancel);
+            // Units that fail to build are recorded with just their own file,
+            // so they are tried again when it or their command changes rather
+            // than on every start
+            for (auto& file : res.failed) {
+                IndexedUnit unit;
+                const auto path = normalizePath(file, {});
+                unit.dependencies.push_back({ path, hashFile(path).value_or(0) });
+                unit.commandHash = hashes_of(file).first;
+                unit.contextHash = hashes_of(file).second;
+                unit.file = std::move(file);
+                res.result.push_back(std::move(unit));
+            }
+            _index.update(res.result, first == 0 ? removed : std::vector<std::string>{});
+            log::info("Indexed ", last, " of ", files.size(), " translation units");
+        }
+    }
+};
+}
+
+BackgroundIndexer::~BackgroundIndexer() {
+    stop();
+}
+
+void BackgroundIndexer::start(const std::string& database_path,
+                              const std::string& index_path,
+                              unsigned jobs) {
+    stop();
+    std::lock_guard<std::mutex> lk{ _lock };
+    _index = std::make_shared<CrossReferenceIndex>(index_path);
+    _run = std::make_shared<Run>();
+    _thread = std::thread(&BackgroundIndexer::_work, database_path, jobs, _index, _run);
+}
+
+void BackgroundIndexer::stop() {
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> lk{ _lock };
+        if (_run) {
+            std::lock_guard<std::mutex> run_lk{ _run->lock };
+            _run->stop = true;
+            _run->wake.notify_all();
+        }
+        thread = std::move(_thread);
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void BackgroundIndexer::fileSaved(const std::string& path) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    if (!_run)
+        return;
+    std::lock_guard<std::mutex> run_lk{ _run->lock };
+    _run->saved.push_back(normalizePath(path, {}));
+    _run->wake.notify_all();
+}
+
+std::shared_ptr<const CrossReferenceIndex> BackgroundIndexer::index() const {
+    std::lock_guard<std::mutex> lk{ _lock };
+    return _index;
+}
+
+void BackgroundIndexer::_work(const std::string& database_path,
+                              unsigned jobs,
+                              std::shared_ptr<CrossReferenceIndex> index,
+                              std::shared_ptr<Run> run) {
+    try {
+        const json_rpc::cancellation_token cancel{
+            std::shared_ptr<const std::atomic_bool>(run, &run->stop)
+        };
+        std::unique_ptr<PathNormalizingCompilationDatabase> db;
+        HeaderClaims claims;
+
+        // Index whatever is new or has changed since the index was written
+        const auto catch_up = [&] {
+            db.reset(new PathNormalizingCompilationDatabase(database_path));
+            const auto all_files = db->underlying().getAllFiles();
+            std::set<std::string> pending(all_files.begin(), all_files.end());
+            std::vector<std::string> removed;
+            FileHashes hashes;
+            claims.clear();
+            index->forEachUnit([&](const IndexedUnit& unit) {
+                const auto path = normalizePath(unit.file, {});
+                for (const auto& dep : unit.dependencies) {
+                    if (dep.recorded && dep.path != path) {
+                        claims.claim(dep.path, unit.contextHash, unit.file);
+                    }
+                }
+                if (!pending.count(unit.file)) {
+                    removed.push_back(unit.file);
+                    return;
+                }
+                const auto commands = db->underlying().getCompileCommands(unit.file);
+                bool changed =
+                    commands.empty() || commandHash(commands.front()) != unit.commandHash;
+                for (std::size_t i = 0; i < unit.dependencies.size() && !changed; ++i) {
+                    const auto& dep = unit.dependencies[i];
+                    changed = hashes(dep.path) != dep.hash;
+                }
+                if (!changed) {
+                    pending.erase(unit.file);
+                }
+            });
+            log::info(pending.size(),
+                      " of ",
+                      all_files.size(),
+                      " translation units need indexing, ",
+                      removed.size(),
+                      " are gone from the compilation database");
+            const UnitIndexer index_units{ db->underlying(), *index, claims, jobs, cancel };
+            index_units({ pending.begin(), pending.end() }, removed);
+        };
+        catch_up();
+
+        const auto normalized_database_path = normalizePath(database_path, {});
+        while (!cancel.cancelled()) {
+            std::vector<std::string> saved;
+            {
+                std::unique_lock<std::mutex> lk{ run->lock };
+                run->wake.wait(lk, [&] { return run->stop || !run->saved.empty(); });
+                saved.swap(run->saved);
+            }
+            if (std::find(saved.begin(), saved.end(), normalized_database_path) != saved.end()) {
+                catch_up();
+                continue;
+            }
+            std::set<std::string> stale;
+            FileHashes hashes;
+            for (const auto& path : saved) {
+                for (const auto& unit : index->unitsDependingOn(path)) {
+                    if (hashes(path) != unit.second) {
+                        stale.insert(unit.first);
+                    }
+                }
+            }
+            const UnitIndexer index_units{ db->underlying(), *index, claims, jobs, cancel };
+            index_units({ stale.begin(), stale.end() });
+        }
+    } catch (const std::exception& e) {
+        log::error("Indexing failed: ", e.what());
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef CLS_INDEXER_HPP_INCLUDED
+#define CLS_INDEXER_HPP_INCLUDED
+
+#include "cross_reference_index.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace clang {
+class ASTUnit;
+}
+
+namespace cls {
+
+/// Whether a unit is the one to record the occurrences in a header
+using ClaimFn = std::function<bool(const std::string& header)>;
+
+/// What the cross-reference index records about a unit. The occurrences in
+/// a header are only looked for if `claim` says so, or there is no `claim`;
+/// those in the unit's own file always are
+IndexedUnit indexUnit(const std::string& file, clang::ASTUnit& unit, const ClaimFn& claim = {});
+
+/**
+ * Builds a CrossReferenceIndex of a compilation database on a thread of its
+ * own, and keeps it up to date.
+ *
+ * Units are built with a ParallelASTBuilder and written to the index in
+ * batches, so that queries see the index grow and an interrupted run loses
+ * at most a batch.
+ *
+ * The index records what each unit was built from: a hash of its compile
+ * command, and a hash of the contents of its own file and of every header it
+ * includes. On start, only units that are new, or where one of those has
+ * changed, are indexed again, and units that left the compilation database
+ * are dropped. After that, saving a file has the units that depend on it
+ * indexed again if its contents changed.
+ *
+ * A header is only indexed by the first unit that includes it, as long as
+ * the units that include it are compiled with the same macro-related
+ * options; the rest leave it out. Which unit records which header is
+ * kept in the index too, and a header whose unit no longer includes it is
+ * handed to another unit that does.
+ */
+class BackgroundIndexer {
+    struct Run;
+    mutable std::mutex _lock;
+    std::shared_ptr<CrossReferenceIndex> _index;
+    std::shared_ptr<Run> _run;
+    std::thread _thread;
+
+    static void _work(const std::string& database_path,
+                      unsigned jobs,
+                      std::shared_ptr<CrossReferenceIndex> index,
+                      std::shared_ptr<Run> run);
+
+public:
+    BackgroundIndexer() = default;
+    ~BackgroundIndexer();
+    BackgroundIndexer(const BackgroundIndexer&) = delete;
+    BackgroundIndexer& operator=(const BackgroundIndexer&) = delete;
+
+    /// Start indexing the compilation database at `database_path` into the
+    /// index at `index_path` with `jobs` workers, stopping whatever was being
+    /// indexed before
+    void start(const std::string& database_path, const std::string& index_path, unsigned jobs);
+    /// Stop indexing, once the units being built are done
+    void stop();
+
+    /// Tell the indexer the file at `path` was saved
+    void fileSaved(const std::string& path);
+
+    /// The index being built, or null before start()
+    std::shared_ptr<const CrossReferenceIndex> index() const;
+};
+}
+
+#endif  // CLS_INDEXER_HPP_INCLUDED
@@ -3,10 +3,13 @@
 #include "types.hpp"
 
 #include "opt_bind.hpp"
+#include "uri.hpp"
 
 #include <mirror/mirror.hpp>
 
 #include <algorithm>
+#include <fstream>
+#include <iterator>
 
 using namespace cls;
 using namespace langsrv;
@@ -18,12 +21,51 @@ using std::string;
 using boost::make_ready_future;
 using boost::none;
 
+namespace {
+
+/// The symbol declared or referred to at `offset` in the unit's main file
+boost::optional<std::pair<string, string>> symbolAt(clangxx::TranslationUnit& unit,
+                                                    unsigned offset) {
+    const auto cursor = unit.cursorAt(unit.locationAtOffset(offset));
+    auto decl = cursor.referenced();
+    if (decl.isNull() && cursor.isDeclaration()) {
+        decl = cursor;
+    }
+    if (decl.isNull())
+        return none;
+    // Constructors and destructors stand for their class
+    const auto kind = decl.kind();
+    if (kind == clangxx::Cursor::Constructor || kind == clangxx::Cursor::Destructor) {
+        decl = decl.semanticParent();
+    }
+    auto usr = decl.USR();
+    auto name = decl.spelling();
+    if (usr.empty() || name.empty())
+        return none;
+    return std::make_pair(std::move(usr), std::move(name));
+}
+
+string readFile(const string& path) {
+    std::ifstream in{ path, std::ios::binary };
+    return { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+}
+}
+
 void LanguageService::didOpenTextDocument(const langsrv::DidOpenTextDocumentParams& p) {
-    langsrv::TextDocumentItem doc = p.textDocument;
-    getCompilationInfo(GetCompilationInfoParams{ doc.uri })
-        .then([=](future<GetCompilationInfoResult> fci) {
+    const auto& doc = p.textDocument;
+    _documents.open(doc);
+    _reparses.focus(doc.uri);
+    const auto uri = doc.uri;
+    getCompilationInfo(GetCompilationInfoParams{ uri })
+        .then([this, uri](future<GetCompilationInfoResult> fci) {
             auto res = fci.get();
-            res.compilationInfo | [=](CompilationInfo info) {
+            res.compilationInfo | [this, uri](CompilationInfo info) {
+                {
+                    std::lock_guard<std::mutex> lk{ _compilationLock };
+                    _compilationInfo[uri] = std::move(info);
+                }
+                // Have the unit warm by the time the first query comes in
+                _reparses.schedule(uri, false);
             };
         })
         .then([this](future<void> f) {
@@ -35,6 +77,213 @@ void LanguageService::didOpenTextDocument(const langsrv::DidOpenTextDocumentPara
         });
 }
 
+void LanguageService::didChangeTextDocument(const langsrv::DidChangeTextDocumentParams& p) {
+    if (!_documents.change(p)) {
+        log::warning("Got changes for ", p.textDocument.uri, ", which is not open");
+        return;
+    }
+    _reparses.focus(p.textDocument.uri);
+    _reparses.schedule(p.textDocument.uri);
+}
+
+void LanguageService::didCloseTextDocument(const langsrv::DidCloseTextDocumentParams& p) {
+    const auto& uri = p.textDocument.uri;
+    _documents.close(uri);
+    _reparses.cancel(uri);
+    _diagnostics.clear(uri);
+    std::lock_guard<std::mutex> lk{ _compilationLock };
+    const auto found = _compilationInfo.find(uri);
+    if (found != _compilationInfo.end()) {
+        _units.evict(found->second.file);
+        _compilationInfo.erase(found);
+    }
+}
+
+void LanguageService::didSaveTextDocument(const langsrv::DidSaveTextDocumentParams& p) {
+    _indexer.fileSaved(uriToPath(p.textDocument.uri));
+}
+
+std::vector<UnsavedBuffer> LanguageService::_unsavedBuffers() const {
+    std::vector<UnsavedBuffer> ret;
+    for (auto& pair : _documents.snapshots()) {
+        ret.push_back(
+            UnsavedBuffer{ uriToPath(pair.first), pair.second.version, std::move(pair.second.text) });
+    }
+    return ret;
+}
+
+boost::optional<TranslationUnitCache::Lease> LanguageService::_parseDocument(const string& uri) {
+    return _parseDocument(uri, _unsavedBuffers());
+}
+
+boost::optional<TranslationUnitCache::Lease>
+LanguageService::_parseDocument(const string& uri, const std::vector<UnsavedBuffer>& unsaved) {
+    CompilationInfo info;
+    {
+        std::lock_guard<std::mutex> lk{ _compilationLock };
+        const auto found = _compilationInfo.find(uri);
+        if (found == _compilationInfo.end())
+            return none;
+        info = found->second;
+    }
+    return _units.acquire(info, unsaved);
+}
+
+std::vector<string> LanguageService::_unitsToParse(const PathNormalizingCompilationDatabase& db,
+                                                   const CrossReferenceIndex* index,
+                                                   const std::vector<UnsavedBuffer>& unsaved,
+                                                   std::set<string>& stale) const {
+    const auto all_files = db.underlying().getAllFiles();
+    if (!index)
+        return all_files;
+    std::map<string, std::uint64_t> open;
+    for (const auto& buf : unsaved) {
+        open.emplace(normalizePath(buf.path, {}), fingerprintHash(*buf.text));
+    }
+
+    std::set<string> indexed;
+    std::set<string> outdated;
+    index->forEachUnit([&](const IndexedUnit& unit) {
+        const auto path = normalizePath(unit.file, {});
+        indexed.insert(path);
+        // The unit recorded what the document held when it was indexed
+        for (const auto& dep : unit.dependencies) {
+            const auto found = open.find(dep.path);
+            if (dep.recorded && found != open.end() && found->second != dep.hash) {
+                outdated.insert(path);
+                stale.insert(dep.path);
+            }
+        }
+    });
+
+    std::vector<string> ret;
+    for (const auto& file : all_files) {
+        const auto path = normalizePath(file, {});
+        if (!indexed.count(path) || outdated.count(path)) {
+            ret.push_back(file);
+        }
+    }
+    return ret;
+}
+
+boost::optional<LanguageService::Symbol>
+LanguageService::_symbolAt(const string& uri,
+                           const Position& position,
+                           const std::vector<UnsavedBuffer>& unsaved) {
+    // The document's own unit is as up to date as the position the client
+    // sent
+    auto lease = _parseDocument(uri, unsaved);
+    const auto snapshot = _documents.snapshot(uri);
+    if (!lease || !lease->valid() || !snapshot)
+        return none;
+    const Document doc{ snapshot->version, *snapshot->text };
+    const auto found = symbolAt(lease->unit(), static_cast<unsigned>(doc.offsetAt(position)));
+    if (!found)
+        return none;
+    return Symbol{ found->first, found->second };
+}
+
+ProjectQueryResult<OccurrencesByFile>
+LanguageService::_findOccurrences(const PathNormalizingCompilationDatabase& db,
+                                  const std::vector<string>& files,
+                                  const Symbol& symbol,
+                                  const std::vector<OccurrenceRole>& roles,
+                                  const std::vector<UnsavedBuffer>& unsaved,
+                                  const cancellation_token& cancel) {
+    log::info("Looking for ", symbol.usr, " in ", files.size(), " translation units");
+    ParallelASTBuilder builder{ db.underlying(), _parseJobs };
+    for (const auto& buf : unsaved) {
+        builder.mapVirtualFile(buf.path, *buf.text);
+    }
+    return findOccurrences(builder, files, symbol.usr, symbol.name, roles, cancel);
+}
+
+std::map<string, std::vector<Range>>
+LanguageService::_rangesOf(const OccurrencesByFile& occurrences,
+                           std::size_t length,
+                           const std::vector<UnsavedBuffer>& unsaved) const {
+    std::map<string, std::vector<Range>> ret;
+    for (const auto& pair : occurrences) {
+        const auto& path = pair.first;
+        std::vector<std::size_t> offsets;
+        for (const auto offset : pair.second) {
+            offsets.push_back(offset);
+            offsets.push_back(offset + length);
+        }
+        std::sort(offsets.begin(), offsets.end());
+        offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+        const auto buffer =
+            std::find_if(unsaved.begin(), unsaved.end(), [&](const UnsavedBuffer& b) {
+                return normalizePath(b.path, {}) == path;
+            });
+        const auto text = buffer != unsaved.end() ? *buffer->text : readFile(path);
+        const auto positions = positionsAt(text, offsets);
+        const auto position_of = [&](std::size_t offset) {
+            const auto at = std::lower_bound(offsets.begin(), offsets.end(), offset);
+            return positions[static_cast<std::size_t>(at - offsets.begin())];
+        };
+
+        auto& ranges = ret[path];
+        for (const auto offset : pair.second) {
+            Range range;
+            range.start = position_of(offset);
+            range.end = position_of(offset + length);
+            ranges.push_back(range);
+        }
+    }
+    return ret;
+}
+
+string LanguageService::_uriOf(const string& path, const string& uri) {
+    return normalizePath(uriToPath(uri), {}) == path ? uri : pathToUri(path);
+}
+
+void LanguageService::_reparseDocument(const string& uri) {
+    const auto unsaved = _unsavedBuffers();
+    auto lease = _parseDocument(uri, unsaved);
+    if (!lease || !lease->valid())
+        return;
+    const auto path = uriToPath(uri);
+    const auto parsed = std::find_if(unsaved.begin(), unsaved.end(), [&](const UnsavedBuffer& b) {
+        return b.path == path;
+    });
+    if (parsed == unsaved.end())
+        return;  // Closed before we took the buffers
+    // A parse that was already running when the document was closed must not
+    // publish after its diagnostics were cleared, and one that a later
+    // change has overtaken will be followed by a parse of that change
+    const auto version = parsed->version;
+    _diagnostics.publish(uri,
+                         convertDiagnostics(
+                             lease->unit(), lease->directory(), lease->file(), uri, unsaved),
+                         [&] { return _documents.version(uri) == version; });
+}
+
+void LanguageService::_startIndexing() {
+    getCompilationDatabasePath()
+        .then([this](future<GetCompilationDatabasePathResult> fut) {
+            const auto res = fut.get();
+            if (!res.filepath) {
+                _log_message("Not indexing, as there is no compilation database");
+                return;
+            }
+            const auto& db_path = *res.filepath;
+            auto index_path = _indexPath;
+            if (index_path.empty()) {
+                index_path = db_path.substr(0, db_path.find_last_of("/\\") + 1) + ".cls-index";
+            }
+            // Leave most of the machine to the open documents
+            _indexer.start(db_path, index_path, std::max(_parseJobs / 2, 1u));
+        })
+        .then([this](future<void> f) {
+            try {
+                f.get();
+            } catch (const std::exception& e) {
+                _log_message("Failed to start indexing: ", e.what());
+            }
+        });
+}
+
 future<GetCompilationInfoResult>
 LanguageService::getCompilationInfo(GetCompilationInfoParams param) {
     return _sendRequest<GetCompilationInfoResult>("vob/cls/getCompilationInfo", param);
@@ -51,47 +300,130 @@ InitializeResult LanguageService::initialize(const InitializeParams& params) {
     comp.resolveProvider = true;
     // comp.triggerChars = { ":", ".", ">" };
     // ret.capabilities.completionProvider = comp;
-    // ret.capabilities.referencesProvider = true;
-    // ret.capabilities.definitionProvider = true;
-    // ret.capabilities.workspaceSymbolProvider = true;
+    ret.capabilities.referencesProvider = true;
+    ret.capabilities.definitionProvider = true;
+    ret.capabilities.workspaceSymbolProvider = true;
     ret.capabilities.renameProvider = true;
+    ret.capabilities.textDocumentSync = static_cast<int>(TextDocumentSyncKind::Incremental);
+    if (params.initializationOptions) {
+        const auto options = from_json<InitializationOptions>(*params.initializationOptions);
+        options.astMemoryBudget | [&](int megabytes) {
+            _units.setMemoryBudget(std::size_t(std::max(megabytes, 0)) << 20,
+                                   options.astSpillDirectory.value_or(""));
+        };
+        options.parseJobs | [&](int jobs) {
+            _parseJobs = static_cast<unsigned>(std::max(jobs, 1));
+        };
+        options.indexPath | [&](const string& path) { _indexPath = path; };
+    }
     _log_message("Initialized clang language server with ", to_json(ret));
     return ret;
 }
 
-boost::optional<boost::future<json>> LanguageService::_dispatchMethod(string method, json params) {
-    _log_message("Got request ", method);
-    if (method == "initialize") {
-        auto res = initialize(from_json<langsrv::InitializeParams>(params));
-        auto rj = to_json(res);
+boost::optional<string> LanguageService::orderingKey(const string&, const params_view& params) {
+    // Only look as far as params.textDocument.uri, without parsing the rest
+    try {
+        auto reader = params.reader();
+        if (reader.peek() != json_rpc::json_reader::token::object)
+            return none;
+        string key;
+        reader.begin_object();
+        while (reader.next_member(key)) {
+            if (key != "textDocument" || reader.peek() != json_rpc::json_reader::token::object) {
+                reader.skip();
+                continue;
+            }
+            reader.begin_object();
+            while (reader.next_member(key)) {
+                if (key == "uri" && reader.peek() == json_rpc::json_reader::token::string)
+                    return reader.read_string();
+                reader.skip();
+            }
+        }
+    } catch (const json_rpc::error&) {
+    }
+    return none;
+}
+
+void LanguageService::_registerMethods() {
+    _methods.add_request<InitializeParams>("initialize", [this](const InitializeParams& params) {
+        auto res = initialize(params);
         _show_message(MessageType::Info, "Hello, from clang-languageservice!");
-        return boost::make_ready_future(rj);
-    } else if (method == "textDocument/didOpen") {
-        didOpenTextDocument(from_json<langsrv::DidOpenTextDocumentParams>(params));
-        return none;
-    } else if (method == "textDocument/rename") {
-        return json_rpc::convert_result(rename(from_json<langsrv::RenameParams>(params)));
-    } else if (method == "shutdown") {
+        return res;
+    });
+    _methods.add("initialized", [this](const params_view&, const cancellation_token&) {
+        _startIndexing();
+        return boost::optional<future<raw_json>>{};
+    });
+    _methods.add_request("shutdown", [this] {
         shutdown();
-        return boost::make_ready_future(json());
-    } else {
-        unknown_message(method, params);
-        return boost::make_ready_future(json());
+        return json();
+    });
+    _methods.add_notification<DidOpenTextDocumentParams>(
+        "textDocument/didOpen",
+        [this](const DidOpenTextDocumentParams& params) { didOpenTextDocument(params); });
+    _methods.add_notification<DidChangeTextDocumentParams>(
+        "textDocument/didChange",
+        [this](const DidChangeTextDocumentParams& params) { didChangeTextDocument(params); });
+    _methods.add_notification<DidCloseTextDocumentParams>(
+        "textDocument/didClose",
+        [this](const DidCloseTextDocumentParams& params) { didCloseTextDocument(params); });
+    _methods.add_notification<DidSaveTextDocumentParams>(
+        "textDocument/didSave",
+        [this](const DidSaveTextDocumentParams& params) { didSaveTextDocument(params); });
+    _methods.add_request<ReferenceParams>(
+        "textDocument/references",
+        [this](const ReferenceParams& params, const cancellation_token& cancel) {
+            return references(params, cancel);
+        });
+    _methods.add_request<TextDocumentPositionParams>(
+        "textDocument/definition",
+        [this](const TextDocumentPositionParams& params) { return definition(params); });
+    _methods.add_request<WorkspaceSymbolParams>(
+        "workspace/symbol",
+        [this](const WorkspaceSymbolParams& params) { return workspaceSymbol(params); });
+    _methods.add_request<RenameParams>(
+        "textDocument/rename",
+        [this](const RenameParams& params, const cancellation_token& cancel) {
+            return rename(params, cancel);
+        });
+}
+
+boost::optional<future<raw_json>>
+LanguageService::_dispatchMethod(const string& method,
+                                 const params_view& params,
+                                 const cancellation_token& cancel) {
+    log::debug("Got request ", method);
+    const auto handler = _methods.find(method);
+    if (!handler) {
+        unknown_message(method);
+        // The server drops the result of a notification, so only requests
+        // see the error
+        return boost::make_exceptional_future<raw_json>(json_rpc::error{
+            json_rpc::error_code::method_not_found, "Method not found: " + method });
     }
+    return (*handler)(params, cancel);
 }
 
-boost::optional<boost::future<json>> LanguageService::dispatchMethod(string method, json params) {
+boost::optional<future<raw_json>>
+LanguageService::dispatchMethod(const string& method,
+                                const params_view& params,
+                                const cancellation_token& cancel) {
     try {
-        return _dispatchMethod(method, params) | [this](future<json> f) {
-            return f.then([this](future<json> f) {
+        return _dispatchMethod(method, params, cancel) | [this](future<raw_json> f) {
+            return f.then(boost::launch::sync, [this](future<raw_json> f) {
                 try {
                     return f.get();
+                } catch (const json_rpc::error&) {
+                    throw;  // Becomes an error response
                 } catch (const std::exception& e) {
                     _log_message("There was an uncaught exception in the language service: ", e.what());
-                    return json();
+                    return raw_json{ "null" };
                 }
             });
         };
+    } catch (const json_rpc::error&) {
+        throw;  // e.g. invalid params, reported to the client
     } catch (const std::exception& e) {
         _log_message("There was an uncaught exception in the language service: ", e.what());
         return none;
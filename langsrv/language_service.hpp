@@ -1,16 +1,32 @@
 #ifndef LANGUAGE_SERVICE_HPP_INCLUDED
 #define LANGUAGE_SERVICE_HPP_INCLUDED
 
+#include "compilation_database.hpp"
+#include "diagnostic_publisher.hpp"
+#include "document_store.hpp"
+#include "indexer.hpp"
+#include "project_query.hpp"
 #include "protocol_types.hpp"
-
+#include "reparse_scheduler.hpp"
+#include "symbol_search.hpp"
+#include "translation_unit_cache.hpp"
+
+#include <json_rpc/cancellation.hpp>
+#include <json_rpc/logging.hpp>
+#include <json_rpc/method_table.hpp>
+#include <json_rpc/params_view.hpp>
 #include <json_rpc/serialize.hpp>
 
 #include <json.hpp>
 
 #include <boost/thread/future.hpp>
 
-#include <fstream>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <thread>
 
 namespace cls {
 
@@ -20,8 +36,12 @@ using boost::optional;
 
 using json_rpc::to_json;
 using json_rpc::from_json;
+using json_rpc::cancellation_token;
+using json_rpc::params_view;
+using json_rpc::raw_json;
+using json_rpc::to_raw_json;
 
-static std::ofstream cls_log{ "cls-messages.log" };
+namespace log = json_rpc::log;
 }
 
 namespace cls {
@@ -56,6 +76,69 @@ class LanguageService {
     };
 
     std::unique_ptr<ErasedServer> _server;
+    json_rpc::method_table _methods;
+    DocumentStore _documents;
+    TranslationUnitCache _units;
+    /// How to compile each open document, by URI, once the client has told us
+    std::mutex _compilationLock;
+    std::map<std::string, CompilationInfo> _compilationInfo;
+    DiagnosticPublisher _diagnostics;
+    /// How many units project-wide operations parse at once
+    unsigned _parseJobs = std::max(std::thread::hardware_concurrency(), 1u);
+    /// Where to keep the cross-reference index, if not next to the
+    /// compilation database
+    std::string _indexPath;
+    BackgroundIndexer _indexer;
+    /// Finds symbols by name in what `_indexer` has indexed
+    SymbolSearch _symbolSearch;
+    /// Declared last so that its threads stop before what they use goes away
+    ReparseScheduler _reparses;
+
+    std::vector<UnsavedBuffer> _unsavedBuffers() const;
+    /// Bring the translation unit of an open document up to date. Returns
+    /// none if we don't know how to compile the document yet
+    boost::optional<TranslationUnitCache::Lease> _parseDocument(const std::string& uri);
+    boost::optional<TranslationUnitCache::Lease>
+    _parseDocument(const std::string& uri, const std::vector<UnsavedBuffer>& unsaved);
+    /// A symbol as project-wide queries look for it
+    struct Symbol {
+        std::string usr;
+        std::string name;
+    };
+    /// The symbol declared or referred to at a position in an open document
+    boost::optional<Symbol> _symbolAt(const std::string& uri,
+                                      const langsrv::Position& position,
+                                      const std::vector<UnsavedBuffer>& unsaved);
+    /// Find where a symbol occurs in any of `roles` by parsing the units of
+    /// `files`
+    ProjectQueryResult<OccurrencesByFile>
+    _findOccurrences(const PathNormalizingCompilationDatabase& db,
+                     const std::vector<std::string>& files,
+                     const Symbol& symbol,
+                     const std::vector<OccurrenceRole>& roles,
+                     const std::vector<UnsavedBuffer>& unsaved,
+                     const cancellation_token& cancel);
+    /// The ranges of the occurrences of a name `length` bytes long, by path
+    std::map<std::string, std::vector<langsrv::Range>>
+    _rangesOf(const OccurrencesByFile& occurrences,
+              std::size_t length,
+              const std::vector<UnsavedBuffer>& unsaved) const;
+    /// The URI to give the client for `path`: `uri` if that is the same file,
+    /// so that it matches the document the request was about
+    static std::string _uriOf(const std::string& path, const std::string& uri);
+    /// Start building the cross-reference index of the compilation database
+    void _startIndexing();
+    /// The units of `db` that `index` can't answer for: those it hasn't
+    /// indexed yet, and those that recorded an open document with other text
+    /// than the client has now. The paths of those documents go in `stale`
+    std::vector<std::string> _unitsToParse(const PathNormalizingCompilationDatabase& db,
+                                           const CrossReferenceIndex* index,
+                                           const std::vector<UnsavedBuffer>& unsaved,
+                                           std::set<std::string>& stale) const;
+    /// Reparse a document in the background and publish its diagnostics
+    void _reparseDocument(const std::string& uri);
+
+    void _registerMethods();
 
     void _build_string(std::stringstream&) const {}
 
@@ -73,7 +156,7 @@ class LanguageService {
             langsrv::ShowMessageRequestParams req;
             req.type = static_cast<int>(type);
             req.message = strm.str();
-            cls_log << strm.str() << std::endl;
+            log::info(strm.str());
             _server->sendNotification("window/showMessage", req);
         }
     }
@@ -82,8 +165,7 @@ class LanguageService {
         if (_server) {
             std::stringstream strm;
             _build_string(strm, "[clang-languageservice] ", args...);
-            cls_log << strm.str() << std::endl;
-            std::cerr << strm.str() << std::endl;
+            log::info(strm.str());
             langsrv::LogMessageParams req;
             req.type = 4;
             req.message = strm.str();
@@ -102,7 +184,17 @@ class LanguageService {
 public:
     template <typename ServerType>
     explicit LanguageService(ServerType& server)
-        : _server(new ErasedServerImpl<ServerType>(server)) {}
+        : _server(new ErasedServerImpl<ServerType>(server))
+        , _diagnostics(
+              [this](const langsrv::PublishDiagnosticsParams& params) {
+                  _server->sendNotification("textDocument/publishDiagnostics", params);
+              },
+              std::chrono::milliseconds(500))
+        , _reparses([this](const std::string& uri) { _reparseDocument(uri); },
+                    std::max(std::thread::hardware_concurrency() / 2, 1u),
+                    std::chrono::milliseconds(300)) {
+        _registerMethods();
+    }
     LanguageService(const LanguageService&) = delete;
     LanguageService& operator=(const LanguageService&) = delete;
 
@@ -110,17 +202,38 @@ public:
     future<GetCompilationDatabasePathResult> getCompilationDatabasePath();
 
     langsrv::InitializeResult initialize(const langsrv::InitializeParams& params);
-    future<langsrv::WorkspaceEdit> rename(const langsrv::RenameParams& params);
+    future<langsrv::WorkspaceEdit> rename(const langsrv::RenameParams& params,
+                                          const cancellation_token& cancel);
+    future<std::vector<langsrv::Location>> references(const langsrv::ReferenceParams& params,
+                                                      const cancellation_token& cancel);
+    /// Where the symbol at a position is defined. Found in the document's
+    /// own unit where it can be, and in the cross-reference index otherwise
+    std::vector<langsrv::Location> definition(const langsrv::TextDocumentPositionParams& params);
+    std::vector<langsrv::SymbolInformation> workspaceSymbol(
+        const langsrv::WorkspaceSymbolParams& params);
 
     void shutdown() {}
 
-    void unknown_message(std::string method, json params) const {
+    void unknown_message(const std::string& method) const {
         _log_message("Got an unknown message with method '", method, "'");
     }
 
     void didOpenTextDocument(const langsrv::DidOpenTextDocumentParams&);
-    boost::optional<future<json>> dispatchMethod(std::string method, json params);
-    boost::optional<future<json>> _dispatchMethod(std::string method, json params);
+    void didChangeTextDocument(const langsrv::DidChangeTextDocumentParams&);
+    void didCloseTextDocument(const langsrv::DidCloseTextDocumentParams&);
+    void didSaveTextDocument(const langsrv::DidSaveTextDocumentParams&);
+
+    /// Messages about the same document must be handled in the order they
+    /// arrive. Returns the document's URI for those messages.
+    static boost::optional<std::string> orderingKey(const std::string& method,
+                                                    const params_view& params);
+
+    boost::optional<future<raw_json>> dispatchMethod(const std::string& method,
+                                                     const params_view& params,
+                                                     const cancellation_token& cancel);
+    boost::optional<future<raw_json>> _dispatchMethod(const std::string& method,
+                                                      const params_view& params,
+                                                      const cancellation_token& cancel);
 };
 }
 
@@ -0,0 +1,188 @@
+#include "occurrences.hpp"
+
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Index/USRGeneration.h>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallString.h>
+
+using namespace cls;
+
+namespace {
+
+/// The declaration `decl` was instantiated from, or its class if it's a
+/// constructor or destructor
+const clang::NamedDecl* userFacing(const clang::NamedDecl* decl) {
+    if (!decl)
+        return nullptr;
+    if (llvm::isa<clang::CXXConstructorDecl>(decl) || llvm::isa<clang::CXXDestructorDecl>(decl)) {
+        decl = llvm::cast<clang::CXXMethodDecl>(decl)->getParent();
+    }
+    if (const auto record = llvm::dyn_cast<clang::CXXRecordDecl>(decl)) {
+        if (const auto pattern = record->getTemplateInstantiationPattern())
+            return pattern;
+    } else if (const auto function = llvm::dyn_cast<clang::FunctionDecl>(decl)) {
+        if (const auto pattern = function->getTemplateInstantiationPattern())
+            return pattern;
+    } else if (const auto var = llvm::dyn_cast<clang::VarDecl>(decl)) {
+        if (const auto pattern = var->getTemplateInstantiationPattern())
+            return pattern;
+    }
+    return decl;
+}
+
+/// Whether `decl` is where its entity is defined rather than only declared
+bool isDefinition(const clang::NamedDecl* decl) {
+    if (const auto templ = llvm::dyn_cast<clang::TemplateDecl>(decl)) {
+        if (const auto templated = templ->getTemplatedDecl()) {
+            decl = templated;
+        }
+    }
+    if (const auto tag = llvm::dyn_cast<clang::TagDecl>(decl))
+        return tag->isThisDeclarationADefinition();
+    if (const auto function = llvm::dyn_cast<clang::FunctionDecl>(decl))
+        return function->isThisDeclarationADefinition();
+    if (const auto var = llvm::dyn_cast<clang::VarDecl>(decl))
+        return var->isThisDeclarationADefinition() != clang::VarDecl::DeclarationOnly;
+    // Fields, enumerators, typedefs, namespaces and the like can only be
+    // declared where they are defined
+    return true;
+}
+
+class OccurrenceVisitor : public clang::RecursiveASTVisitor<OccurrenceVisitor> {
+    using Base = clang::RecursiveASTVisitor<OccurrenceVisitor>;
+
+    const clang::SourceManager& _sm;
+    const OccurrenceFn& _fn;
+    const SkipFileFn& _skip;
+    /// What _skip said, by file
+    llvm::DenseMap<clang::FileID, bool> _skipped;
+
+    bool _isSkipped(clang::SourceLocation loc) {
+        if (!_skip || loc.isInvalid())
+            return false;
+        const auto file = _sm.getFileID(_sm.getExpansionLoc(loc));
+        const auto found = _skipped.find(file);
+        if (found != _skipped.end())
+            return found->second;
+        return _skipped[file] = _skip(file);
+    }
+
+    void _report(const clang::NamedDecl* decl,
+                 clang::SourceLocation loc,
+                 OccurrenceRole role = OccurrenceRole::Reference) {
+        decl = userFacing(decl);
+        if (!decl || loc.isInvalid())
+            return;
+        if (loc.isMacroID()) {
+            // A name passed to a macro is still in the file, one in the
+            // macro's body isn't ours to report
+            if (!_sm.isMacroArgExpansion(loc))
+                return;
+            loc = _sm.getSpellingLoc(loc);
+        }
+        // A destructor is named after the ~
+        const auto data = _sm.getCharacterData(loc);
+        if (*data == '~') {
+            auto skip = 1;
+            while (data[skip] == ' ' || data[skip] == '\t') {
+                ++skip;
+            }
+            loc = loc.getLocWithOffset(skip);
+        }
+        if (_isSkipped(loc))
+            return;
+        _fn(decl, loc, role);
+    }
+
+public:
+    OccurrenceVisitor(const clang::SourceManager& sm,
+                      const OccurrenceFn& fn,
+                      const SkipFileFn& skip)
+        : _sm(sm)
+        , _fn(fn)
+        , _skip(skip) {}
+
+    bool TraverseDecl(clang::Decl* decl) {
+        if (decl && !llvm::isa<clang::TranslationUnitDecl>(decl)
+            && _isSkipped(decl->getLocation()))
+            return true;
+        return Base::TraverseDecl(decl);
+    }
+
+    bool VisitNamedDecl(clang::NamedDecl* decl) {
+        if (!decl->isImplicit()) {
+            auto role = OccurrenceRole::Reference;
+            if (userFacing(decl) == decl) {
+                role = isDefinition(decl) ? OccurrenceRole::Definition
+                                          : OccurrenceRole::Declaration;
+            }
+            _report(decl, decl->getLocation(), role);
+        }
+        return true;
+    }
+
+    bool VisitDeclRefExpr(clang::DeclRefExpr* expr) {
+        _report(expr->getDecl(), expr->getLocation());
+        return true;
+    }
+
+    bool VisitMemberExpr(clang::MemberExpr* expr) {
+        _report(expr->getMemberDecl(), expr->getMemberLoc());
+        return true;
+    }
+
+    bool VisitTagTypeLoc(clang::TagTypeLoc loc) {
+        _report(loc.getDecl(), loc.getNameLoc());
+        return true;
+    }
+
+    bool VisitTypedefTypeLoc(clang::TypedefTypeLoc loc) {
+        _report(loc.getTypedefNameDecl(), loc.getNameLoc());
+        return true;
+    }
+
+    bool VisitInjectedClassNameTypeLoc(clang::InjectedClassNameTypeLoc loc) {
+        _report(loc.getDecl(), loc.getNameLoc());
+        return true;
+    }
+
+    bool VisitTemplateSpecializationTypeLoc(clang::TemplateSpecializationTypeLoc loc) {
+        _report(loc.getTypePtr()->getTemplateName().getAsTemplateDecl(), loc.getTemplateNameLoc());
+        return true;
+    }
+
+    bool TraverseNestedNameSpecifierLoc(clang::NestedNameSpecifierLoc loc) {
+        if (loc) {
+            if (const auto ns = loc.getNestedNameSpecifier()->getAsNamespace()) {
+                _report(ns, loc.getLocalBeginLoc());
+            }
+        }
+        return Base::TraverseNestedNameSpecifierLoc(loc);
+    }
+
+    bool TraverseConstructorInitializer(clang::CXXCtorInitializer* init) {
+        if (init->isMemberInitializer() && init->isWritten()) {
+            _report(init->getMember(), init->getMemberLocation());
+        }
+        return Base::TraverseConstructorInitializer(init);
+    }
+};
+}
+
+void cls::forEachOccurrence(clang::ASTUnit& unit, const OccurrenceFn& fn) {
+    forEachOccurrence(unit, fn, {});
+}
+
+void cls::forEachOccurrence(clang::ASTUnit& unit, const OccurrenceFn& fn, const SkipFileFn& skip) {
+    OccurrenceVisitor visitor{ unit.getSourceManager(), fn, skip };
+    visitor.TraverseDecl(unit.getASTContext().getTranslationUnitDecl());
+}
+
+std::string cls::usrOf(const clang::Decl* decl) {
+    llvm::SmallString<128> buf;
+    if (clang::index::generateUSRForDecl(decl, buf))
+        return {};
+    return buf.str();
+}
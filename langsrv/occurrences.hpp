@@ -0,0 +1,53 @@
+#ifndef CLS_OCCURRENCES_HPP_INCLUDED
+#define CLS_OCCURRENCES_HPP_INCLUDED
+
+#include <clang/Basic/SourceLocation.h>
+
+#include <functional>
+#include <string>
+
+namespace clang {
+class ASTUnit;
+class Decl;
+class NamedDecl;
+}
+
+namespace cls {
+
+/// How an occurrence names its declaration
+enum class OccurrenceRole {
+    Reference,
+    /// Where it is declared but not defined
+    Declaration,
+    Definition,
+};
+
+using OccurrenceFn = std::function<void(const clang::NamedDecl* decl,
+                                        clang::SourceLocation loc,
+                                        OccurrenceRole role)>;
+
+/**
+ * Call `fn` for every place in `unit` where a declaration is named, both
+ * where it is declared and where it is referred to. `loc` is where the name
+ * is spelled, in a file rather than in a macro.
+ *
+ * `decl` is the declaration the way a user thinks of it: constructors and
+ * destructors are reported as their class, and members of template
+ * instantiations as the members of the template. The name of a constructor
+ * or destructor is a reference to its class rather than its declaration.
+ */
+void forEachOccurrence(clang::ASTUnit& unit, const OccurrenceFn& fn);
+
+/// Whether to leave out the declarations in a file
+using SkipFileFn = std::function<bool(clang::FileID file)>;
+
+/// Like the above, but without looking into the declarations that are in a
+/// file for which `skip` returns true, nor reporting what is in such a file
+void forEachOccurrence(clang::ASTUnit& unit, const OccurrenceFn& fn, const SkipFileFn& skip);
+
+/// The USR of a declaration, which is the same as libclang's
+/// clang_getCursorUSR gives for it. Empty if it has none
+std::string usrOf(const clang::Decl* decl);
+}
+
+#endif  // CLS_OCCURRENCES_HPP_INCLUDED
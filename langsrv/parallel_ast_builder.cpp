@@ -0,0 +1,133 @@
+#include "parallel_ast_builder.hpp"
+
+#include <json_rpc/logging.hpp>
+
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Tooling/ArgumentsAdjusters.h>
+#include <clang/Tooling/Tooling.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+using namespace cls;
+
+namespace cl = clang::tooling;
+
+namespace {
+
+namespace log = json_rpc::log;
+
+/// Like the ASTBuilderAction used by ClangTool::buildASTs, but hands the unit
+/// to a visitor rather than keeping it
+class VisitingASTBuilder : public cl::ToolAction {
+    std::function<void(clang::ASTUnit&)> _visit;
+
+public:
+    explicit VisitingASTBuilder(std::function<void(clang::ASTUnit&)> visit)
+        : _visit(std::move(visit)) {}
+
+    bool runInvocation(clang::CompilerInvocation* invocation,
+                       clang::FileManager* files,
+                       std::shared_ptr<clang::PCHContainerOperations> pch_ops,
+                       clang::DiagnosticConsumer* diag_consumer) override {
+        auto diags = clang::CompilerInstance::createDiagnostics(&invocation->getDiagnosticOpts(),
+                                                                diag_consumer,
+                                                                /*ShouldOwnClient=*/false);
+        auto unit = clang::ASTUnit::LoadFromCompilerInvocation(invocation,
+                                                               std::move(pch_ops),
+                                                               diags,
+                                                               files);
+        if (!unit)
+            return false;
+        _visit(*unit);
+        return true;
+    }
+};
+}
+
+ParallelASTBuilder::ParallelASTBuilder(const clang::tooling::CompilationDatabase& db, unsigned jobs)
+    : _db(db)
+    , _jobs(std::max(jobs, 1u)) {}
+
+void ParallelASTBuilder::mapVirtualFile(std::string path, std::string contents) {
+    _virtualFiles.emplace_back(std::move(path), std::move(contents));
+}
+
+std::vector<std::string> ParallelASTBuilder::run(const std::vector<std::string>& files,
+                                                 const visit_fn& visit,
+                                                 const json_rpc::cancellation_token& cancel) const {
+    std::vector<std::string> failed;
+    // Look the commands up front, the database isn't ours to use from
+    // several threads, and order them so that workers mostly get units with
+    // the same working directory one after another
+    using FileCommand = std::pair<std::string, cl::CompileCommand>;
+    std::vector<FileCommand> commands;
+    for (const auto& file : files) {
+        auto found = _db.getCompileCommands(file);
+        if (found.empty()) {
+            failed.push_back(file);
+        } else {
+            commands.emplace_back(file, std::move(found.front()));
+        }
+    }
+    const auto by_directory = [](const FileCommand& a, const FileCommand& b) {
+        return a.second.Directory < b.second.Directory;
+    };
+    std::stable_sort(commands.begin(), commands.end(), by_directory);
+
+    const auto adjust = cl::combineAdjusters(cl::getClangStripOutputAdjuster(),
+                                             cl::getClangSyntaxOnlyAdjuster());
+    std::mutex lock;
+    std::atomic<std::size_t> next{ 0 };
+    const auto work = [&] {
+        llvm::IntrusiveRefCntPtr<clang::FileManager> file_manager;
+        clang::IgnoringDiagConsumer ignore_diags;
+        for (auto i = next++; i < commands.size() && !cancel.cancelled(); i = next++) {
+            const auto& file = commands[i].first;
+            const auto& command = commands[i].second;
+            // The stat cache is only good for one working directory
+            if (!file_manager
+                || file_manager->getFileSystemOpts().WorkingDir != command.Directory) {
+                clang::FileSystemOptions options;
+                options.WorkingDir = command.Directory;
+                file_manager = new clang::FileManager(options);
+            }
+            auto args = adjust(command.CommandLine, command.Filename);
+            if (!args.empty()) {
+                args.insert(args.begin() + 1, "-working-directory=" + command.Directory);
+            }
+
+            VisitingASTBuilder action{ [&](clang::ASTUnit& unit) { visit(file, unit); } };
+            cl::ToolInvocation invocation(std::move(args), &action, file_manager.get());
+            invocation.setDiagnosticConsumer(&ignore_diags);
+            for (const auto& mapped : _virtualFiles) {
+                invocation.mapVirtualFile(mapped.first, mapped.second);
+            }
+            bool ok = false;
+            try {
+                ok = invocation.run();
+            } catch (const std::exception& e) {
+                log::error("Failed to visit ", file, ": ", e.what());
+            }
+            if (!ok) {
+                std::lock_guard<std::mutex> lk{ lock };
+                failed.push_back(file);
+            }
+        }
+    };
+
+    const auto jobs = std::min<std::size_t>(_jobs, commands.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < jobs; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thr : threads) {
+        thr.join();
+    }
+    return failed;
+}
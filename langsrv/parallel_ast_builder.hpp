@@ -0,0 +1,61 @@
+#ifndef CLS_PARALLEL_AST_BUILDER_HPP_INCLUDED
+#define CLS_PARALLEL_AST_BUILDER_HPP_INCLUDED
+
+#include <json_rpc/cancellation.hpp>
+
+#include <clang/Tooling/CompilationDatabase.h>
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace clang {
+class ASTUnit;
+}
+
+namespace cls {
+
+/**
+ * Builds the ASTs of many files of a compilation database at once.
+ *
+ * Each of `jobs` workers builds one unit at a time with its own compiler
+ * instance and hands it to the visitor as soon as it is built, then disposes
+ * of it, so no more than `jobs` ASTs are ever alive at once. Workers keep
+ * their FileManager, and with it the stat cache, from one unit to the next
+ * while the units share a working directory; FileManager isn't thread-safe,
+ * so workers don't share one.
+ *
+ * Unlike ClangTool, the builder never changes the process's working
+ * directory, which clang 3.9 does for every unit and which makes ClangTool
+ * unusable from several threads. Units get `-working-directory` instead.
+ */
+class ParallelASTBuilder {
+public:
+    /// Called from the workers, concurrently, with the compilation database
+    /// file and its unit. The unit is disposed of once this returns
+    using visit_fn = std::function<void(const std::string& file, clang::ASTUnit& unit)>;
+
+private:
+    const clang::tooling::CompilationDatabase& _db;
+    unsigned _jobs;
+    std::vector<std::pair<std::string, std::string>> _virtualFiles;
+
+public:
+    ParallelASTBuilder(const clang::tooling::CompilationDatabase& db,
+                       unsigned jobs = std::thread::hardware_concurrency());
+
+    /// Have units read `contents` rather than the file at `path`
+    void mapVirtualFile(std::string path, std::string contents);
+
+    /// Build and visit the units of `files`, in no particular order. Returns
+    /// the files whose units could not be built. Once `cancel` is cancelled
+    /// no more units are started
+    std::vector<std::string> run(const std::vector<std::string>& files,
+                                 const visit_fn& visit,
+                                 const json_rpc::cancellation_token& cancel) const;
+};
+}
+
+#endif  // CLS_PARALLEL_AST_BUILDER_HPP_INCLUDED
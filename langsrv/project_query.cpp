@@ -0,0 +1,55 @@
+#include "project_query.hpp"
+
+#include "occurrences.hpp"
+#include "uri.hpp"
+
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Frontend/ASTUnit.h>
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+using namespace cls;
+
+ProjectQueryResult<OccurrencesByFile>
+cls::findOccurrences(const ParallelASTBuilder& builder,
+                     const std::vector<std::string>& files,
+                     const std::string& usr,
+                     const std::string& name,
+                     const std::vector<OccurrenceRole>& roles,
+                     const json_rpc::cancellation_token& cancel) {
+    using Found = std::vector<std::pair<std::string, unsigned>>;
+    const auto map = [&](const std::string&, clang::ASTUnit& unit) {
+        const auto& sm = unit.getSourceManager();
+        const auto& directory = unit.getFileManager().getFileSystemOpts().WorkingDir;
+        std::unordered_map<const clang::Decl*, std::string> usrs;
+        Found found;
+        const auto on_occurrence = [&](const clang::NamedDecl* decl,
+                                       clang::SourceLocation loc,
+                                       OccurrenceRole role) {
+            if (std::find(roles.begin(), roles.end(), role) == roles.end())
+                return;
+            auto decl_usr = usrs.find(decl);
+            if (decl_usr == usrs.end()) {
+                decl_usr = usrs.emplace(decl, usrOf(decl)).first;
+            }
+            if (decl_usr->second != usr)
+                return;
+            // Only where the name is spelled out
+            const auto entry = sm.getFileEntryForID(sm.getFileID(loc));
+            if (!entry || std::strncmp(sm.getCharacterData(loc), name.data(), name.size()) != 0)
+                return;
+            found.emplace_back(normalizePath(entry->getName(), directory), sm.getFileOffset(loc));
+        };
+        forEachOccurrence(unit, on_occurrence);
+        return found;
+    };
+    const auto merge = [](OccurrencesByFile& result, Found found) {
+        for (const auto& occurrence : found) {
+            result[occurrence.first].insert(occurrence.second);
+        }
+    };
+    return queryUnits<OccurrencesByFile>(builder, files, map, merge, cancel);
+}
@@ -0,0 +1,69 @@
+#ifndef CLS_PROJECT_QUERY_HPP_INCLUDED
+#define CLS_PROJECT_QUERY_HPP_INCLUDED
+
+#include "occurrences.hpp"
+#include "parallel_ast_builder.hpp"
+
+#include <json_rpc/cancellation.hpp>
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace clang {
+class ASTUnit;
+}
+
+namespace cls {
+
+template <typename Result> struct ProjectQueryResult {
+    Result result;
+    /// The files whose units could not be built, and so weren't looked at
+    std::vector<std::string> failed;
+};
+
+/**
+ * Answer a query by looking at the units of `files` one by one as the
+ * builder builds them.
+ *
+ * `map(file, unit)` runs on the builder's workers and turns a unit into
+ * whatever part of the answer it holds; it must not keep anything that
+ * points into the unit, which is gone once it returns. `merge(result, part)`
+ * folds the parts into the result one at a time, so it needs no locking of
+ * its own. Doing the work in `map` and only merging under the lock keeps
+ * the workers from waiting on each other.
+ */
+template <typename Result, typename Map, typename Merge>
+ProjectQueryResult<Result> queryUnits(const ParallelASTBuilder& builder,
+                                      const std::vector<std::string>& files,
+                                      Map map,
+                                      Merge merge,
+                                      const json_rpc::cancellation_token& cancel) {
+    ProjectQueryResult<Result> ret;
+    std::mutex lock;
+    const auto visit = [&](const std::string& file, clang::ASTUnit& unit) {
+        auto part = map(file, unit);
+        std::lock_guard<std::mutex> lk{ lock };
+        merge(ret.result, std::move(part));
+    };
+    ret.failed = builder.run(files, visit, cancel);
+    return ret;
+}
+
+/// Offsets into files, by normalized path
+using OccurrencesByFile = std::map<std::string, std::set<unsigned>>;
+
+/// Where the symbol `usr` is named as `name`, in any of `roles`, in the units
+/// of `files`
+ProjectQueryResult<OccurrencesByFile> findOccurrences(const ParallelASTBuilder& builder,
+                                                      const std::vector<std::string>& files,
+                                                      const std::string& usr,
+                                                      const std::string& name,
+                                                      const std::vector<OccurrenceRole>& roles,
+                                                      const json_rpc::cancellation_token& cancel);
+}
+
+#endif  // CLS_PROJECT_QUERY_HPP_INCLUDED
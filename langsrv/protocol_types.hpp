@@ -12,6 +12,12 @@ enum class MessageType {
     Log = 4,
 };
 
+enum class TextDocumentSyncKind {
+    None = 0,
+    Full = 1,
+    Incremental = 2,
+};
+
 }
 
 #endif // LANGSRV_PROTOCOL_TYPES_HPP_INCLUDED
\ No newline at end of file
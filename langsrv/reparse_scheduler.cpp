@@ -0,0 +1,119 @@
+#include "reparse_scheduler.hpp"
+
+#include <json_rpc/logging.hpp>
+
+#include <algorithm>
+
+using namespace cls;
+
+namespace {
+namespace log = json_rpc::log;
+}
+
+ReparseScheduler::ReparseScheduler(parse_fn parse, unsigned threads, clock::duration delay)
+    : _parse(std::move(parse))
+    , _delay(delay) {
+    threads = std::max(threads, 1u);
+    for (unsigned i = 0; i < threads; ++i) {
+        _threads.emplace_back([this] { _work(); });
+    }
+}
+
+ReparseScheduler::~ReparseScheduler() {
+    {
+        std::lock_guard<std::mutex> lk{ _lock };
+        _stopping = true;
+    }
+    _wake.notify_all();
+    for (auto& thr : _threads) {
+        thr.join();
+    }
+}
+
+ReparseScheduler::JobMap::iterator ReparseScheduler::_next(clock::time_point now,
+                                                           clock::time_point& wake_at) {
+    auto best = _jobs.end();
+    for (auto it = _jobs.begin(); it != _jobs.end(); ++it) {
+        const auto& job = it->second;
+        if (!job.queued || job.running)
+            continue;
+        if (job.due > now) {
+            wake_at = std::min(wake_at, job.due);
+            continue;
+        }
+        if (it->first == _focused)
+            return it;
+        if (best == _jobs.end() || job.due < best->second.due) {
+            best = it;
+        }
+    }
+    return best;
+}
+
+void ReparseScheduler::_work() {
+    std::unique_lock<std::mutex> lk{ _lock };
+    while (!_stopping) {
+        auto wake_at = clock::time_point::max();
+        const auto job = _next(clock::now(), wake_at);
+        if (job == _jobs.end()) {
+            if (wake_at == clock::time_point::max()) {
+                _wake.wait(lk);
+            } else {
+                _wake.wait_until(lk, wake_at);
+            }
+            continue;
+        }
+
+        const auto uri = job->first;
+        job->second.queued = false;
+        job->second.running = true;
+        lk.unlock();
+        try {
+            _parse(uri);
+        } catch (const std::exception& e) {
+            log::error("Reparsing ", uri, " failed: ", e.what());
+        }
+        lk.lock();
+
+        const auto found = _jobs.find(uri);
+        if (found == _jobs.end())
+            continue;
+        found->second.running = false;
+        if (found->second.queued) {
+            // Changed again meanwhile, another thread may take it now
+            _wake.notify_one();
+        } else {
+            _jobs.erase(found);
+        }
+    }
+}
+
+void ReparseScheduler::schedule(const std::string& uri, bool debounce) {
+    {
+        std::lock_guard<std::mutex> lk{ _lock };
+        auto& job = _jobs[uri];
+        job.queued = true;
+        job.due = clock::now() + (debounce ? _delay : clock::duration::zero());
+    }
+    _wake.notify_one();
+}
+
+void ReparseScheduler::focus(const std::string& uri) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    _focused = uri;
+}
+
+void ReparseScheduler::cancel(const std::string& uri) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    const auto found = _jobs.find(uri);
+    if (found == _jobs.end())
+        return;
+    if (found->second.running) {
+        found->second.queued = false;
+    } else {
+        _jobs.erase(found);
+    }
+    if (_focused == uri) {
+        _focused.clear();
+    }
+}
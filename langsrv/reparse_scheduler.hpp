@@ -0,0 +1,74 @@
+#ifndef CLS_REPARSE_SCHEDULER_HPP_INCLUDED
+#define CLS_REPARSE_SCHEDULER_HPP_INCLUDED
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cls {
+
+/**
+ * Reparses documents in the background after they change.
+ *
+ * A document is reparsed only once it has gone `delay` without changing, so
+ * a burst of edits costs one parse rather than one per keystroke. Scheduling
+ * a document that is already waiting just pushes its deadline back, and the
+ * parse reads the document when it starts, so it always gets the latest
+ * version. A document changed while it is being parsed is parsed again
+ * afterwards; no document is ever parsed by two threads at once.
+ *
+ * When several documents are due, the focused one goes first and the rest
+ * go in the order they became due. Parses run on the scheduler's own
+ * threads, so they never hold up request handling.
+ */
+class ReparseScheduler {
+public:
+    using clock = std::chrono::steady_clock;
+    using parse_fn = std::function<void(const std::string& uri)>;
+
+private:
+    struct Job {
+        clock::time_point due;
+        /// Waiting for its deadline
+        bool queued = false;
+        /// Being parsed right now
+        bool running = false;
+    };
+    using JobMap = std::map<std::string, Job>;
+
+    parse_fn _parse;
+    clock::duration _delay;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    JobMap _jobs;
+    std::string _focused;
+    bool _stopping = false;
+    std::vector<std::thread> _threads;
+
+    /// The job to run next, if any is due. Otherwise, `wake_at` is lowered to
+    /// when the next one will be
+    JobMap::iterator _next(clock::time_point now, clock::time_point& wake_at);
+    void _work();
+
+public:
+    ReparseScheduler(parse_fn parse, unsigned threads, clock::duration delay);
+    ~ReparseScheduler();
+    ReparseScheduler(const ReparseScheduler&) = delete;
+    ReparseScheduler& operator=(const ReparseScheduler&) = delete;
+
+    /// Reparse a document once it has settled, or right away if `debounce`
+    /// is false
+    void schedule(const std::string& uri, bool debounce = true);
+    /// Have a document go ahead of the others
+    void focus(const std::string& uri);
+    /// Forget about a document. A parse already running is left to finish
+    void cancel(const std::string& uri);
+};
+}
+
+#endif  // CLS_REPARSE_SCHEDULER_HPP_INCLUDED
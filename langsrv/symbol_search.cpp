@@ -0,0 +1,614 @@
+#include "symbol_search.hpp"
+
+#include <json_rpc/logging.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <unordered_map>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLS_SYMBOL_SEARCH_SSE2 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace cls;
+
+namespace {
+
+namespace log = json_rpc::log;
+
+/// Only this many characters of a name take part in matching
+const std::size_t maxMatched = 64;
+/// Bytes after the last folded name, so that it can be loaded whole
+const std::size_t foldedPadding = maxMatched;
+
+int lowestBit(std::uint64_t bits) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long ret;
+    _BitScanForward64(&ret, bits);
+    return static_cast<int>(ret);
+#elif defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    int ret = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ++ret;
+    }
+    return ret;
+#endif
+}
+
+int bitCount(std::uint64_t bits) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(bits);
+#else
+    int ret = 0;
+    for (; bits; bits &= bits - 1)
+        ++ret;
+    return ret;
+#endif
+}
+
+/// The bits below `count`
+std::uint64_t lowBits(std::size_t count) {
+    return count >= 64 ? ~0ull : (1ull << count) - 1;
+}
+
+/// The bits from `first` up
+std::uint64_t bitsFrom(std::size_t first) {
+    return first >= 64 ? 0 : ~0ull << first;
+}
+
+/// Bit i is set where `name[i]` is `c`, for the first 64 bytes of `name`,
+/// all of which must be readable
+std::uint64_t positionsOf(const char* name, char c) {
+#ifdef CLS_SYMBOL_SEARCH_SSE2
+    const auto needle = _mm_set1_epi8(c);
+    std::uint64_t ret = 0;
+    for (int i = 0; i < 4; ++i) {
+        const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(name + 16 * i));
+        const auto equal = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        ret |= static_cast<std::uint64_t>(static_cast<std::uint16_t>(equal)) << (16 * i);
+    }
+    return ret;
+#else
+    std::uint64_t ret = 0;
+    for (std::size_t i = 0; i < maxMatched; ++i) {
+        if (name[i] == c)
+            ret |= 1ull << i;
+    }
+    return ret;
+#endif
+}
+
+char fold(char c) {
+    return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+}
+
+std::string folded(const std::string& str) {
+    std::string ret;
+    ret.reserve(str.size());
+    for (const auto c : str)
+        ret += fold(c);
+    return ret;
+}
+
+/// Where the words in a name start: at its start, after an underscore or
+/// other separator, at an uppercase letter after a lowercase one or before
+/// one, and where digits begin or end
+std::uint64_t wordHeads(const std::string& name) {
+    const auto size = std::min(name.size(), maxMatched);
+    std::uint64_t ret = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        const auto c = static_cast<unsigned char>(name[i]);
+        if (!std::isalnum(c))
+            continue;
+        if (i == 0) {
+            ret |= 1;
+            continue;
+        }
+        const auto prev = static_cast<unsigned char>(name[i - 1]);
+        const auto next = i + 1 < name.size() ? static_cast<unsigned char>(name[i + 1]) : 0;
+        const bool head = !std::isalnum(prev)
+            || (std::isupper(c) && !std::isupper(prev))
+            || (std::isupper(c) && std::islower(next))
+            || (!std::isdigit(c) != !std::isdigit(prev));
+        if (head)
+            ret |= 1ull << i;
+    }
+    return ret;
+}
+
+std::uint32_t trigram(char a, char b, char c) {
+    return static_cast<std::uint32_t>(static_cast<unsigned char>(a)) << 16
+        | static_cast<std::uint32_t>(static_cast<unsigned char>(b)) << 8
+        | static_cast<std::uint32_t>(static_cast<unsigned char>(c));
+}
+
+/// The trigrams of a folded name: each character followed by either the
+/// next one or the start of the next word, twice over
+std::vector<std::uint32_t> nameTrigrams(const char* name, std::size_t size, std::uint64_t heads) {
+    size = std::min(size, maxMatched);
+    const auto steps = [&](std::size_t from, std::size_t (&to)[2]) {
+        std::size_t count = 0;
+        if (from + 1 < size)
+            to[count++] = from + 1;
+        const auto later = heads & bitsFrom(from + 2) & lowBits(size);
+        if (later)
+            to[count++] = static_cast<std::size_t>(lowestBit(later));
+        return count;
+    };
+    std::vector<std::uint32_t> ret;
+    // Queries too short for a trigram look for names starting with them
+    if (size > 0) {
+        ret.push_back(trigram('\0', '\0', name[0]));
+        std::size_t second[2];
+        const auto seconds = steps(0, second);
+        for (std::size_t j = 0; j < seconds; ++j)
+            ret.push_back(trigram('\0', name[0], name[second[j]]));
+    }
+    for (std::size_t i = 0; i < size; ++i) {
+        std::size_t second[2];
+        const auto seconds = steps(i, second);
+        for (std::size_t j = 0; j < seconds; ++j) {
+            std::size_t third[2];
+            const auto thirds = steps(second[j], third);
+            for (std::size_t k = 0; k < thirds; ++k)
+                ret.push_back(trigram(name[i], name[second[j]], name[third[k]]));
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+/// Whether `needle` is a subsequence of `haystack`
+bool isSubsequence(const std::string& needle, const char* haystack, std::size_t size) {
+    std::size_t i = 0;
+    for (std::size_t j = 0; i < needle.size() && j < size; ++j) {
+        if (fold(haystack[j]) == needle[i])
+            ++i;
+    }
+    return i == needle.size();
+}
+
+/// The trigrams of a folded scope, which are those of each of its parts
+/// between "::" as if it were a name
+std::vector<std::uint32_t> trigramsOfScope(const std::string& scope) {
+    std::vector<std::uint32_t> ret;
+    std::size_t start = 0;
+    while (start < scope.size()) {
+        auto end = scope.find("::", start);
+        if (end == std::string::npos)
+            end = scope.size();
+        const auto part = scope.substr(start, end - start);
+        const auto trigrams = nameTrigrams(folded(part).c_str(), part.size(), wordHeads(part));
+        ret.insert(ret.end(), trigrams.begin(), trigrams.end());
+        start = end + 2;
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+/// Adds the trigrams every name that the folded `query` matches has
+void addQueryTrigrams(const std::string& query, std::vector<std::uint32_t>& out) {
+    if (query.size() == 1)
+        out.push_back(trigram('\0', '\0', query[0]));
+    else if (query.size() == 2)
+        out.push_back(trigram('\0', query[0], query[1]));
+    for (std::size_t i = 0; i + 2 < query.size(); ++i)
+        out.push_back(trigram(query[i], query[i + 1], query[i + 2]));
+}
+
+/// A search, split at its last "::"
+struct Query {
+    std::string name;
+    /// Folded
+    std::string foldedName;
+    /// Folded, without any "::"
+    std::string qualifier;
+    /// The parts of the qualifier between "::", folded
+    std::vector<std::string> scopes;
+    /// Where each character of `foldedName` is in the name being matched
+    std::vector<std::uint64_t> positions;
+
+    explicit Query(const std::string& query) {
+        const auto split = query.rfind("::");
+        name = split == std::string::npos ? query : query.substr(split + 2);
+        foldedName = folded(name);
+        if (split != std::string::npos) {
+            std::string scope;
+            for (const auto c : query.substr(0, split) + ':') {
+                if (c != ':') {
+                    qualifier += fold(c);
+                    scope += fold(c);
+                } else if (!scope.empty()) {
+                    scopes.push_back(std::move(scope));
+                    scope.clear();
+                }
+            }
+        }
+        positions.resize(foldedName.size());
+    }
+
+    /// The trigrams every matching name has
+    std::vector<std::uint32_t> trigrams() const {
+        std::vector<std::uint32_t> ret;
+        addQueryTrigrams(foldedName, ret);
+        std::sort(ret.begin(), ret.end());
+        ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+        return ret;
+    }
+
+    /// The trigrams the scope of every matching name has. Only the part of
+    /// each name that is indexed counts
+    std::vector<std::uint32_t> scopeTrigrams() const {
+        std::vector<std::uint32_t> ret;
+        for (const auto& scope : scopes)
+            addQueryTrigrams(scope.substr(0, maxMatched), ret);
+        std::sort(ret.begin(), ret.end());
+        ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+        return ret;
+    }
+};
+
+using Postings = std::unordered_map<std::uint32_t, std::vector<std::uint32_t>>;
+
+/// The ids in the postings of every one of `trigrams`, in order
+std::vector<std::uint32_t> intersect(const Postings& all,
+                                     const std::vector<std::uint32_t>& trigrams) {
+    std::vector<std::uint32_t> ret;
+    std::vector<const std::vector<std::uint32_t>*> postings;
+    for (const auto tri : trigrams) {
+        const auto it = all.find(tri);
+        if (it == all.end())
+            return ret;
+        postings.push_back(&it->second);
+    }
+    if (postings.empty())
+        return ret;
+    std::sort(postings.begin(), postings.end(), [](const auto* a, const auto* b) {
+        return a->size() < b->size();
+    });
+    ret = *postings.front();
+    std::vector<std::uint32_t> both;
+    for (std::size_t i = 1; i < postings.size() && !ret.empty(); ++i) {
+        both.clear();
+        std::set_intersection(ret.begin(),
+                              ret.end(),
+                              postings[i]->begin(),
+                              postings[i]->end(),
+                              std::back_inserter(both));
+        ret.swap(both);
+    }
+    return ret;
+}
+
+/// The positions `query` matches a name at, one bit per character, taking
+/// each character at the earliest place after the previous one. With
+/// `prefer_heads`, a character that continues the previous one or starts a
+/// word is taken over an earlier one that does neither. 0 if it does not match
+std::uint64_t matchedBits(const std::vector<std::uint64_t>& positions,
+                          std::uint64_t heads,
+                          bool prefer_heads) {
+    std::uint64_t ret = 0;
+    std::size_t next = 0;
+    for (std::size_t i = 0; i < positions.size(); ++i) {
+        const auto candidates = positions[i] & bitsFrom(next);
+        if (!candidates)
+            return 0;
+        auto pick = candidates;
+        if (prefer_heads) {
+            const auto following = i > 0 ? candidates & (1ull << next) : 0;
+            const auto starting = candidates & heads;
+            pick = following ? following : starting ? starting : candidates;
+        }
+        const auto at = lowestBit(pick);
+        ret |= 1ull << at;
+        next = static_cast<std::size_t>(at) + 1;
+    }
+    return ret;
+}
+
+int scoreOf(std::uint64_t matched, std::uint64_t heads) {
+    const auto consecutive = bitCount(matched & (matched << 1));
+    return 10 * bitCount(matched & heads) + 6 * consecutive + ((matched & 1) ? 15 : 0);
+}
+}
+
+class SymbolSearch::Snapshot {
+    /// Offsets into `_text`, where a symbol's USR, qualified name and name
+    /// follow each other, and into `_folded`
+    struct Entry {
+        std::uint32_t text;
+        std::uint32_t folded;
+        std::uint32_t usrSize;
+        std::uint32_t qualifiedNameSize;
+        std::uint32_t nameSize;
+        int kind;
+        std::uint64_t heads;
+        /// Into `_scopes`
+        std::uint32_t scope;
+        /// Where the symbol is defined, or else declared. `file` is into
+        /// `_files`
+        std::uint32_t file;
+        OccurrenceRole role;
+        langsrv::Range range;
+    };
+
+    std::string _text;
+    std::vector<std::string> _files;
+    /// Lowercase names, padded so that each can be loaded 64 bytes at a time
+    std::string _folded;
+    std::vector<Entry> _entries;
+    /// The entries that have each trigram, in order
+    Postings _postings;
+    /// The entries in each distinct scope, the qualified name before the
+    /// last "::", in order
+    std::vector<std::vector<std::uint32_t>> _scopes;
+    /// The scopes that have each trigram, in order. Kept apart from the
+    /// names', so that a query's qualifier has to match within a scope
+    Postings _scopePostings;
+
+    std::vector<std::uint32_t> _candidates(const Query& query) const;
+    /// How well `query` matches an entry, or a negative number if it does not
+    int _score(const Entry& entry, Query& query) const;
+    IndexedSymbol _symbol(const Entry& entry) const;
+
+public:
+    std::weak_ptr<const CrossReferenceIndex> index;
+    std::uint64_t generation;
+
+    explicit Snapshot(const std::shared_ptr<const CrossReferenceIndex>& index);
+
+    bool of(const std::shared_ptr<const CrossReferenceIndex>& other) const {
+        return !index.owner_before(other) && !other.owner_before(index);
+    }
+
+    std::vector<SymbolMatch> search(const std::string& query, std::size_t limit) const;
+};
+
+SymbolSearch::Snapshot::Snapshot(const std::shared_ptr<const CrossReferenceIndex>& index)
+    : index(index)
+    , generation(index->generation()) {
+    const auto started = std::chrono::steady_clock::now();
+    std::unordered_map<std::string, std::uint32_t> file_ids;
+    std::unordered_map<std::string, std::uint32_t> scope_ids;
+    index->forEachSymbol([&](const IndexedSymbol& symbol) {
+        // What has no location is of no use to the client
+        const auto& location = symbol.definition ? symbol.definition : symbol.declaration;
+        if (symbol.name.empty() || !location)
+            return;
+        Entry entry;
+        const auto file = file_ids.emplace(location->file, _files.size());
+        if (file.second)
+            _files.push_back(location->file);
+        entry.file = file.first->second;
+        entry.role = location->role;
+        entry.range = location->range;
+        entry.text = static_cast<std::uint32_t>(_text.size());
+        entry.folded = static_cast<std::uint32_t>(_folded.size());
+        entry.usrSize = static_cast<std::uint32_t>(symbol.usr.size());
+        entry.qualifiedNameSize = static_cast<std::uint32_t>(symbol.qualifiedName.size());
+        entry.nameSize = static_cast<std::uint32_t>(symbol.name.size());
+        entry.kind = symbol.kind;
+        entry.heads = wordHeads(symbol.name);
+        _text += symbol.usr;
+        _text += symbol.qualifiedName;
+        _text += symbol.name;
+        _folded += folded(symbol.name.substr(0, maxMatched));
+
+        const auto id = static_cast<std::uint32_t>(_entries.size());
+        for (const auto tri : nameTrigrams(&_folded[entry.folded], entry.nameSize, entry.heads))
+            _postings[tri].push_back(id);
+
+        const auto& qualified = symbol.qualifiedName;
+        auto scopeSize = qualified.size() >= symbol.name.size()
+            ? qualified.size() - symbol.name.size()
+            : qualified.size();
+        if (qualified.compare(scopeSize, std::string::npos, symbol.name) != 0)
+            scopeSize = qualified.size();
+        const auto scope = scope_ids.emplace(qualified.substr(0, scopeSize), _scopes.size());
+        if (scope.second) {
+            _scopes.emplace_back();
+            const auto scopeId = static_cast<std::uint32_t>(scope.first->second);
+            for (const auto tri : trigramsOfScope(scope.first->first))
+                _scopePostings[tri].push_back(scopeId);
+        }
+        entry.scope = scope.first->second;
+        _scopes[entry.scope].push_back(id);
+        _entries.push_back(entry);
+    });
+    _folded.append(foldedPadding, '\0');
+    _text.shrink_to_fit();
+    _folded.shrink_to_fit();
+    _entries.shrink_to_fit();
+    for (auto& posting : _postings)
+        posting.second.shrink_to_fit();
+    for (auto& scope : _scopes)
+        scope.shrink_to_fit();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started);
+    log::info("Built symbol search over ",
+              _entries.size(),
+              " symbols in ",
+              _scopes.size(),
+              " scopes and ",
+              _postings.size(),
+              " trigrams in ",
+              elapsed.count(),
+              " ms");
+}
+
+std::vector<std::uint32_t> SymbolSearch::Snapshot::_candidates(const Query& query) const {
+    std::vector<std::uint32_t> ret;
+    const auto scopeTrigrams = query.scopeTrigrams();
+    std::vector<std::uint32_t> scopes;
+    if (!scopeTrigrams.empty()) {
+        scopes = intersect(_scopePostings, scopeTrigrams);
+        if (scopes.empty())
+            return ret;
+    }
+
+    const auto trigrams = query.trigrams();
+    if (!trigrams.empty()) {
+        ret = intersect(_postings, trigrams);
+        if (!scopeTrigrams.empty()) {
+            ret.erase(std::remove_if(ret.begin(),
+                                     ret.end(),
+                                     [&](std::uint32_t id) {
+                                         return !std::binary_search(
+                                             scopes.begin(), scopes.end(), _entries[id].scope);
+                                     }),
+                      ret.end());
+        }
+    } else if (!scopeTrigrams.empty()) {
+        // Only a qualifier, as in "ns::": everything in the scopes it matches
+        for (const auto scope : scopes)
+            ret.insert(ret.end(), _scopes[scope].begin(), _scopes[scope].end());
+    } else {
+        ret.resize(_entries.size());
+        for (std::uint32_t i = 0; i < ret.size(); ++i)
+            ret[i] = i;
+    }
+    return ret;
+}
+
+int SymbolSearch::Snapshot::_score(const Entry& entry, Query& query) const {
+    const auto size = std::min<std::size_t>(entry.nameSize, maxMatched);
+    const auto& name = query.foldedName;
+    if (name.size() > size)
+        return -1;
+    if (!query.qualifier.empty()) {
+        const auto qualified = &_text[entry.text + entry.usrSize];
+        const auto qualifiedSize = entry.qualifiedNameSize >= entry.nameSize
+            ? entry.qualifiedNameSize - entry.nameSize
+            : entry.qualifiedNameSize;
+        if (!isSubsequence(query.qualifier, qualified, qualifiedSize))
+            return -1;
+    }
+    if (name.empty())
+        return 0;
+
+    const auto folded = &_folded[entry.folded];
+    const auto inName = lowBits(size);
+    for (std::size_t i = 0; i < name.size(); ++i)
+        query.positions[i] = positionsOf(folded, name[i]) & inName;
+
+    const auto leftmost = matchedBits(query.positions, entry.heads, false);
+    if (!leftmost)
+        return -1;
+    const auto preferred = matchedBits(query.positions, entry.heads, true);
+    auto ret = std::max(scoreOf(leftmost, entry.heads), scoreOf(preferred, entry.heads));
+
+    if (leftmost == lowBits(name.size())) {
+        ret += 40;
+        if (name.size() == entry.nameSize) {
+            ret += 100;
+            const auto original = &_text[entry.text + entry.usrSize + entry.qualifiedNameSize];
+            if (std::equal(query.name.begin(), query.name.end(), original))
+                ret += 20;
+        }
+    }
+    return ret - static_cast<int>(entry.nameSize - name.size());
+}
+
+IndexedSymbol SymbolSearch::Snapshot::_symbol(const Entry& entry) const {
+    IndexedSymbol ret;
+    auto at = _text.data() + entry.text;
+    ret.usr.assign(at, entry.usrSize);
+    at += entry.usrSize;
+    ret.qualifiedName.assign(at, entry.qualifiedNameSize);
+    at += entry.qualifiedNameSize;
+    ret.name.assign(at, entry.nameSize);
+    ret.kind = entry.kind;
+    auto& location = entry.role == OccurrenceRole::Definition ? ret.definition : ret.declaration;
+    location = IndexedLocation{ _files[entry.file], entry.range, entry.role, {} };
+    return ret;
+}
+
+std::vector<SymbolMatch> SymbolSearch::Snapshot::search(const std::string& text,
+                                                        std::size_t limit) const {
+    Query query{ text };
+    std::vector<std::pair<int, std::uint32_t>> scored;
+    if (query.foldedName.size() <= maxMatched) {
+        for (const auto id : _candidates(query)) {
+            const auto score = _score(_entries[id], query);
+            if (score >= 0)
+                scored.emplace_back(score, id);
+        }
+    }
+
+    const auto better = [this](const auto& a, const auto& b) {
+        if (a.first != b.first)
+            return a.first > b.first;
+        const auto& x = _entries[a.second];
+        const auto& y = _entries[b.second];
+        if (x.nameSize != y.nameSize)
+            return x.nameSize < y.nameSize;
+        return a.second < b.second;
+    };
+    limit = std::min(limit, scored.size());
+    std::partial_sort(scored.begin(), scored.begin() + limit, scored.end(), better);
+
+    std::vector<SymbolMatch> ret;
+    ret.reserve(limit);
+    for (std::size_t i = 0; i < limit; ++i)
+        ret.push_back({ _symbol(_entries[scored[i].second]), scored[i].first });
+    return ret;
+}
+
+SymbolSearch::~SymbolSearch() {
+    if (_builder.joinable())
+        _builder.join();
+}
+
+std::shared_ptr<const SymbolSearch::Snapshot> SymbolSearch::_current(
+    std::shared_ptr<const CrossReferenceIndex> index) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    const auto ready = _snapshot && _snapshot->of(index);
+    const auto now = clock::now();
+    const auto stale = !ready
+        || (_snapshot->generation != index->generation() && now - _lastBuild >= _interval);
+    if (stale && !_building) {
+        _building = true;
+        _lastBuild = now;
+        if (_builder.joinable())
+            _builder.join();
+        _builder = std::thread{ [this, index] {
+            std::shared_ptr<const Snapshot> snapshot;
+            try {
+                snapshot = std::make_shared<const Snapshot>(index);
+            } catch (const std::exception& e) {
+                log::error("Failed to build symbol search: ", e.what());
+            }
+            std::lock_guard<std::mutex> lk{ _lock };
+            if (snapshot)
+                _snapshot = snapshot;
+            _building = false;
+        } };
+    }
+    // Until there is a snapshot of this index, there is nothing to answer with
+    return ready ? _snapshot : nullptr;
+}
+
+std::vector<SymbolMatch> SymbolSearch::search(std::shared_ptr<const CrossReferenceIndex> index,
+                                              const std::string& query,
+                                              std::size_t limit) {
+    if (!index)
+        return {};
+    const auto snapshot = _current(std::move(index));
+    if (!snapshot)
+        return {};
+    return snapshot->search(query, limit);
+}
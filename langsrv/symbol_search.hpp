@@ -0,0 +1,75 @@
+#ifndef CLS_SYMBOL_SEARCH_HPP_INCLUDED
+#define CLS_SYMBOL_SEARCH_HPP_INCLUDED
+
+#include "cross_reference_index.hpp"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cls {
+
+/// A symbol whose name matched a search. Of its locations, it has its
+/// definition or, if the index has none, its declaration
+struct SymbolMatch {
+    IndexedSymbol symbol;
+    int score;
+};
+
+/**
+ * Fuzzy search over the names of the symbols in a CrossReferenceIndex.
+ *
+ * Candidates are found through the trigrams of the query. A name has the
+ * trigrams of its consecutive characters, and also those that jump to the
+ * start of the next word, as in "LanguageService" having "lse". That lets
+ * "lanser" find it. A query of one or two characters, too short for a
+ * trigram, only finds names that start with it. Candidates are then scored
+ * by matching the query against the name as a subsequence. Words starting,
+ * consecutive characters and a match at the very start all score higher. A
+ * query with "::" also has to match the qualified name up to the last "::".
+ * Those scopes are indexed by trigrams too, each part between "::" as if it
+ * were a name, so that "ns::" only looks at what is in scopes matching "ns".
+ *
+ * The trigram index is a snapshot of the cross-reference index, taken
+ * together with where each symbol is defined or declared. Symbols the index
+ * has neither for are left out. A search that finds the snapshot out of date
+ * starts building a new one in the background and uses the old one
+ * meanwhile, but at most once per `interval`, as indexing bumps the
+ * generation of the index for every unit it finishes. Until there is a
+ * snapshot of the index at all, searches find nothing rather than wait for
+ * one.
+ */
+class SymbolSearch {
+public:
+    using clock = std::chrono::steady_clock;
+
+private:
+    class Snapshot;
+    std::mutex _lock;
+    std::shared_ptr<const Snapshot> _snapshot;
+    std::thread _builder;
+    bool _building = false;
+    clock::duration _interval;
+    /// When the last build started
+    clock::time_point _lastBuild;
+
+    std::shared_ptr<const Snapshot> _current(std::shared_ptr<const CrossReferenceIndex> index);
+
+public:
+    explicit SymbolSearch(clock::duration interval = std::chrono::seconds(5))
+        : _interval(interval) {}
+    ~SymbolSearch();
+    SymbolSearch(const SymbolSearch&) = delete;
+    SymbolSearch& operator=(const SymbolSearch&) = delete;
+
+    /// The `limit` best matches for `query`, best first
+    std::vector<SymbolMatch> search(std::shared_ptr<const CrossReferenceIndex> index,
+                                    const std::string& query,
+                                    std::size_t limit);
+};
+}
+
+#endif  // CLS_SYMBOL_SEARCH_HPP_INCLUDED
@@ -0,0 +1,375 @@
+#include "translation_unit_cache.hpp"
+
+#include "uri.hpp"
+
+#include <json_rpc/logging.hpp>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <set>
+#include <utility>
+
+using namespace cls;
+
+namespace {
+
+namespace log = json_rpc::log;
+
+/// Split a compile command into arguments, the way a POSIX shell would
+std::vector<std::string> splitCommand(const std::string& command) {
+    std::vector<std::string> ret;
+    std::string current;
+    bool in_arg = false;
+    char quote = 0;
+    for (std::size_t i = 0; i < command.size(); ++i) {
+        const auto c = command[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && i + 1 < command.size()) {
+                current.push_back(command[++i]);
+            } else {
+                current.push_back(c);
+            }
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            in_arg = true;
+        } else if (c == '\\' && i + 1 < command.size()) {
+            current.push_back(command[++i]);
+            in_arg = true;
+        } else if (c == ' ' || c == '\t' || c == '\n') {
+            if (in_arg) {
+                ret.push_back(std::move(current));
+                current.clear();
+                in_arg = false;
+            }
+        } else {
+            current.push_back(c);
+            in_arg = true;
+        }
+    }
+    if (in_arg) {
+        ret.push_back(std::move(current));
+    }
+    return ret;
+}
+
+/**
+ * The arguments libclang needs to parse `info.file`: the compiler, the input
+ * file and the output options are dropped, since libclang gets the file
+ * separately, and the command's directory is passed along so that relative
+ * paths resolve as they would in the build.
+ */
+std::vector<std::string> parseArguments(const CompilationInfo& info) {
+    const auto words = splitCommand(info.command);
+    std::vector<std::string> ret;
+    for (std::size_t i = 1; i < words.size(); ++i) {
+        const auto& arg = words[i];
+        if (arg == "-c")
+            continue;
+        if (arg == "-o") {
+            ++i;
+            continue;
+        }
+        if (arg == info.file || info.directory + "/" + arg == info.file)
+            continue;
+        ret.push_back(arg);
+    }
+    if (!info.directory.empty()) {
+        ret.push_back("-working-directory=" + info.directory);
+    }
+    return ret;
+}
+
+/// The stamp of `path`, or an empty one if it can't be read
+FileStamp fileStamp(const std::string& path) {
+    struct stat st;
+    FileStamp ret;
+    if (::stat(path.data(), &st) != 0)
+        return ret;
+    ret.seconds = static_cast<std::int64_t>(st.st_mtime);
+#if defined(__APPLE__)
+    ret.nanoseconds = st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    ret.nanoseconds = 0;
+#else
+    ret.nanoseconds = st.st_mtim.tv_nsec;
+#endif
+    ret.size = static_cast<std::int64_t>(st.st_size);
+    return ret;
+}
+
+/// The current time, as a stamp to compare modification times with
+FileStamp now() {
+    FileStamp ret;
+    const auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+    ret.seconds = seconds.count();
+    ret.nanoseconds = static_cast<long>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch - seconds).count());
+    return ret;
+}
+
+/// Whether `stamp` was modified before `time`
+bool modifiedBefore(const FileStamp& stamp, const FileStamp& time) {
+    return std::make_pair(stamp.seconds, stamp.nanoseconds)
+        < std::make_pair(time.seconds, time.nanoseconds);
+}
+
+/// Whether the contents of `path` matter to a unit built from `dependencies`.
+/// Before the first parse we can't tell, so every buffer does
+bool isDependency(const std::map<std::string, FileStamp>& dependencies,
+                  const std::string& path) {
+    return dependencies.empty() || dependencies.count(path) != 0;
+}
+
+std::size_t hashUnsaved(const std::map<std::string, FileStamp>& dependencies,
+                        const std::vector<UnsavedBuffer>& unsaved) {
+    std::size_t ret = 0;
+    for (const auto& buf : unsaved) {
+        // Edits to documents the unit doesn't include don't call for a reparse
+        if (!isDependency(dependencies, normalizePath(buf.path, {})))
+            continue;
+        // Order-independent, the buffers come in no particular order
+        ret += std::hash<std::string>()(buf.path) ^ (std::hash<int>()(buf.version) * 31);
+    }
+    return ret;
+}
+
+/// Whether a file the unit was built from has been changed on disk. Files
+/// open in the editor are read from their buffers instead, so don't count
+bool dependenciesChanged(const std::map<std::string, FileStamp>& dependencies,
+                         const std::vector<UnsavedBuffer>& unsaved) {
+    std::set<std::string> overridden;
+    for (const auto& buf : unsaved) {
+        overridden.insert(normalizePath(buf.path, {}));
+    }
+    for (const auto& dep : dependencies) {
+        if (overridden.count(dep.first) == 0 && fileStamp(dep.first) != dep.second)
+            return true;
+    }
+    return false;
+}
+}
+
+TranslationUnitCache::Entry::~Entry() {
+    if (!spillPath.empty()) {
+        std::remove(spillPath.data());
+    }
+}
+
+TranslationUnitCache::TranslationUnitCache(std::size_t capacity)
+    : _index(false, false)
+    , _capacity(std::max<std::size_t>(capacity, 1)) {}
+
+std::shared_ptr<TranslationUnitCache::Entry>
+TranslationUnitCache::_entryFor(const CompilationInfo& info) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    auto found = _entries.find(info.file);
+    if (found != _entries.end()) {
+        auto entry = *found->second;
+        if (entry->command == info.command) {
+            _lru.splice(_lru.begin(), _lru, found->second);
+            return entry;
+        }
+        // The file is now built differently, so the old unit is of no use
+        _lru.erase(found->second);
+        _entries.erase(found);
+    }
+
+    auto entry = std::make_shared<Entry>();
+    entry->file = info.file;
+    entry->command = info.command;
+    entry->directory = info.directory;
+    entry->args = parseArguments(info);
+    _lru.push_front(entry);
+    _entries[info.file] = _lru.begin();
+    while (_lru.size() > _capacity) {
+        log::debug("Dropping translation unit for ", _lru.back()->file);
+        _entries.erase(_lru.back()->file);
+        _lru.pop_back();
+    }
+    return entry;
+}
+
+void TranslationUnitCache::_recordDependencies(Entry& entry, const FileStamp& started) {
+    entry.dependencies.clear();
+    for (const auto& file : entry.unit.inclusions()) {
+        const auto path = normalizePath(file.filename(), entry.directory);
+        auto stamp = fileStamp(path);
+        // Modified since the parse began: we can't tell which version the
+        // unit saw, so assume it is out of date
+        if (!modifiedBefore(stamp, started))
+            stamp = FileStamp{ -1, 0, -2 };
+        entry.dependencies.emplace(path, stamp);
+    }
+}
+
+bool TranslationUnitCache::_loadSpilled(Entry& entry,
+                                        std::size_t unsavedHash,
+                                        const std::vector<UnsavedBuffer>& unsaved) {
+    if (entry.spillPath.empty() || entry.unsavedHash != unsavedHash
+        || dependenciesChanged(entry.dependencies, unsaved))
+        return false;
+    log::debug("Loading ", entry.file, " from ", entry.spillPath);
+    entry.unit = clangxx::TranslationUnit::createFromASTFile(_index.ptr(), entry.spillPath.data());
+    entry.fromAst = entry.unit.valid();
+    return entry.fromAst;
+}
+
+bool TranslationUnitCache::_parse(Entry& entry, const std::vector<UnsavedBuffer>& unsaved) {
+    const auto hash = hashUnsaved(entry.dependencies, unsaved);
+    if (entry.unit.valid() && entry.unsavedHash == hash
+        && !dependenciesChanged(entry.dependencies, unsaved))
+        return false;
+    if (!entry.unit.valid() && _loadSpilled(entry, hash, unsaved))
+        return true;
+
+    // Whatever was saved is out of date now
+    if (!entry.spillPath.empty()) {
+        std::remove(entry.spillPath.data());
+        entry.spillPath.clear();
+    }
+
+    const auto started = now();
+    std::vector<clangxx::UnsavedFile> files;
+    files.reserve(unsaved.size());
+    for (const auto& buf : unsaved) {
+        files.emplace_back(*buf.text, buf.path);
+    }
+
+    if (entry.unit.valid() && !entry.fromAst) {
+        // libclang checks whether the preamble still matches the include
+        // block and the headers, and only rebuilds it if it doesn't
+        log::debug("Reparsing ", entry.file);
+        const auto err = entry.unit.reparse(files, entry.unit.defaultReparseOptions());
+        if (err == 0) {
+            _recordDependencies(entry, started);
+            entry.unsavedHash = hashUnsaved(entry.dependencies, unsaved);
+            return true;
+        }
+        // A unit that failed to reparse can only be disposed of
+        log::warning("Reparsing ", entry.file, " failed, parsing it again");
+    }
+    entry.unit = clangxx::TranslationUnit{};
+    entry.fromAst = false;
+
+    log::debug("Parsing ", entry.file);
+    std::vector<const char*> argv;
+    for (const auto& arg : entry.args) {
+        argv.push_back(arg.data());
+    }
+    // Build the preamble right away rather than on the first reparse, so
+    // that the first edit is as quick as the ones after it
+    const auto options = unsigned(clangxx::TranslationUnit::defaultEditingOptions())
+        | CXTranslationUnit_PrecompiledPreamble | CXTranslationUnit_CreatePreambleOnFirstParse;
+    entry.unit = clangxx::TranslationUnit::parseTranslationUnit(_index.ptr(),
+                                                                entry.file.data(),
+                                                                int(argv.size()),
+                                                                argv.data(),
+                                                                files,
+                                                                options);
+    if (entry.unit.valid()) {
+        _recordDependencies(entry, started);
+        entry.unsavedHash = hashUnsaved(entry.dependencies, unsaved);
+    } else {
+        entry.dependencies.clear();
+        log::error("Failed to parse ", entry.file);
+    }
+    return true;
+}
+
+void TranslationUnitCache::_spill(Entry& entry, const std::string& directory) {
+    if (!entry.unit.valid())
+        return;
+    // A unit loaded from its spill file is still there as it was
+    if (!directory.empty() && entry.spillPath.empty()) {
+        const auto key = entry.file + '\0' + entry.command;
+        const auto path = directory + "/" + std::to_string(std::hash<std::string>()(key)) + ".ast";
+        if (entry.unit.save(path) == CXSaveError_None) {
+            entry.spillPath = path;
+        } else {
+            log::warning("Failed to save the translation unit for ", entry.file, " to ", path);
+            std::remove(path.data());
+        }
+    }
+    log::debug("Disposing of the translation unit for ", entry.file, " to save memory");
+    entry.unit = clangxx::TranslationUnit{};
+    entry.fromAst = false;
+    entry.memory = 0;
+}
+
+void TranslationUnitCache::_enforceBudget(const std::shared_ptr<Entry>& keep) {
+    std::vector<std::shared_ptr<Entry>> victims;
+    std::string directory;
+    {
+        std::lock_guard<std::mutex> lk{ _lock };
+        if (_memoryBudget == 0)
+            return;
+        std::size_t total = 0;
+        for (const auto& entry : _lru) {
+            total += entry->memory;
+        }
+        for (auto it = _lru.rbegin(); it != _lru.rend() && total > _memoryBudget; ++it) {
+            if (*it == keep || (*it)->memory == 0)
+                continue;
+            total -= (*it)->memory;
+            victims.push_back(*it);
+        }
+        directory = _spillDirectory;
+    }
+    for (const auto& victim : victims) {
+        // A unit someone is using right now isn't worth dropping
+        std::unique_lock<std::mutex> lk{ victim->lock, std::try_to_lock };
+        if (lk) {
+            _spill(*victim, directory);
+        }
+    }
+}
+
+TranslationUnitCache::Lease TranslationUnitCache::acquire(const CompilationInfo& info,
+                                                          const std::vector<UnsavedBuffer>& unsaved) {
+    Lease lease{ _entryFor(info) };
+    auto& entry = *lease._entry;
+    if (_parse(entry, unsaved)) {
+        entry.memory = entry.unit.valid() ? entry.unit.resourceUsage().total() : 0;
+        _enforceBudget(lease._entry);
+    }
+    return lease;
+}
+
+void TranslationUnitCache::evict(const std::string& file) {
+    std::lock_guard<std::mutex> lk{ _lock };
+    const auto found = _entries.find(file);
+    if (found == _entries.end())
+        return;
+    _lru.erase(found->second);
+    _entries.erase(found);
+}
+
+void TranslationUnitCache::setMemoryBudget(std::size_t bytes, std::string spillDirectory) {
+    {
+        std::lock_guard<std::mutex> lk{ _lock };
+        _memoryBudget = bytes;
+        _spillDirectory = std::move(spillDirectory);
+    }
+    _enforceBudget(nullptr);
+}
+
+std::size_t TranslationUnitCache::size() const {
+    std::lock_guard<std::mutex> lk{ _lock };
+    return _lru.size();
+}
+
+std::size_t TranslationUnitCache::memoryUsage() const {
+    std::lock_guard<std::mutex> lk{ _lock };
+    std::size_t ret = 0;
+    for (const auto& entry : _lru) {
+        ret += entry->memory;
+    }
+    return ret;
+}
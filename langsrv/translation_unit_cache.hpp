@@ -0,0 +1,153 @@
+#ifndef CLS_TRANSLATION_UNIT_CACHE_HPP_INCLUDED
+#define CLS_TRANSLATION_UNIT_CACHE_HPP_INCLUDED
+
+#include "types.hpp"
+
+#include <libclangxx/index.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace cls {
+
+/// When a file was last modified, to the nanosecond, and how large it was
+struct FileStamp {
+    std::int64_t seconds = -1;
+    long nanoseconds = 0;
+    std::int64_t size = -1;
+
+    bool operator==(const FileStamp& other) const {
+        return seconds == other.seconds && nanoseconds == other.nanoseconds
+            && size == other.size;
+    }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+/// A file whose contents come from the editor rather than from the disk
+struct UnsavedBuffer {
+    std::string path;
+    int version;
+    /// Shared with the document's snapshot rather than copied from it
+    std::shared_ptr<const std::string> text;
+};
+
+/**
+ * Keeps the translation units of recently used files alive.
+ *
+ * Units are keyed by their main file and compile command. Asking for a unit
+ * that is already cached reparses it only if one of the files it was built
+ * from has changed since, either in the editor or on disk; a changed compile
+ * command starts over. At most `capacity` units are kept, dropping the least
+ * recently used.
+ *
+ * With a memory budget set, the cache also measures what each unit uses
+ * after parsing it and, once the total goes over the budget, disposes of
+ * the least recently used units until it fits again. If a spill directory is
+ * set, those units are saved there first and loaded back, rather than parsed
+ * again, when next needed unchanged. A unit loaded that way can't be
+ * reparsed, so the first change to it parses it from scratch.
+ *
+ * Units are built with a precompiled preamble: the headers included at the
+ * top of the main file are compiled once and reused by every reparse, so
+ * long as neither the include block nor any of those headers changes. A
+ * reparse then costs about as much as parsing the main file alone.
+ *
+ * A libclang translation unit must not be used from two threads at once, so
+ * access goes through a Lease, which holds the unit's lock.
+ */
+class TranslationUnitCache {
+    struct Entry {
+        std::mutex lock;
+        std::string file;
+        std::string command;
+        std::string directory;
+        std::vector<std::string> args;
+        clangxx::TranslationUnit unit;
+        /// Identifies the editor buffers the unit was last parsed with
+        std::size_t unsavedHash = 0;
+        /// The files the unit was last parsed from, each with its stamp then.
+        /// A file modified while the unit was parsed gets a stamp no file
+        /// has, so that it counts as changed
+        std::map<std::string, FileStamp> dependencies;
+        /// The bytes the unit used when last measured
+        std::atomic<std::size_t> memory{ 0 };
+        /// Where the unit was saved when it was evicted, if it was
+        std::string spillPath;
+        /// Whether the unit was loaded from `spillPath`
+        bool fromAst = false;
+
+        Entry() = default;
+        ~Entry();
+    };
+    using EntryList = std::list<std::shared_ptr<Entry>>;
+
+    clangxx::Index _index;
+    std::size_t _capacity;
+    mutable std::mutex _lock;
+    std::size_t _memoryBudget = 0;
+    std::string _spillDirectory;
+    /// Most recently used first
+    EntryList _lru;
+    std::map<std::string, EntryList::iterator> _entries;
+
+    std::shared_ptr<Entry> _entryFor(const CompilationInfo& info);
+    /// Bring the entry's unit up to date. Returns false if it already was
+    bool _parse(Entry& entry, const std::vector<UnsavedBuffer>& unsaved);
+    /// Remember which files went into a freshly parsed unit
+    /// `started` is the stamp of when the parse began
+    static void _recordDependencies(Entry& entry, const FileStamp& started);
+    /// Whether a unit that was spilled can be loaded back as it is
+    bool _loadSpilled(Entry& entry, std::size_t unsavedHash,
+                      const std::vector<UnsavedBuffer>& unsaved);
+    /// Dispose of units other than `keep` until the cache fits its budget
+    void _enforceBudget(const std::shared_ptr<Entry>& keep);
+    /// Save the unit to the spill directory, if there is one, then dispose of it
+    void _spill(Entry& entry, const std::string& directory);
+
+public:
+    class Lease {
+        std::shared_ptr<Entry> _entry;
+        std::unique_lock<std::mutex> _lock;
+        friend class TranslationUnitCache;
+
+    public:
+        explicit Lease(std::shared_ptr<Entry> entry)
+            : _entry(std::move(entry))
+            , _lock(_entry->lock) {}
+
+        clangxx::TranslationUnit& unit() const { return _entry->unit; }
+        const std::string& file() const { return _entry->file; }
+        /// The directory the unit was compiled in, which relative paths in
+        /// it are relative to
+        const std::string& directory() const { return _entry->directory; }
+        bool valid() const { return _entry->unit.valid(); }
+    };
+
+    explicit TranslationUnitCache(std::size_t capacity = 8);
+
+    /// Get the translation unit for `info.file`, parsing it or bringing it up
+    /// to date with the given editor buffers first if needed
+    Lease acquire(const CompilationInfo& info, const std::vector<UnsavedBuffer>& unsaved);
+
+    /// Drop the unit for a file. A lease already handed out stays valid
+    void evict(const std::string& file);
+
+    /// Limit the memory the cached units may use, in bytes, or lift the
+    /// limit with 0. Units evicted to stay within it are saved to
+    /// `spillDirectory`, unless it's empty
+    void setMemoryBudget(std::size_t bytes, std::string spillDirectory = {});
+
+    std::size_t size() const;
+    /// The bytes used by the units in the cache, as last measured
+    std::size_t memoryUsage() const;
+};
+}
+
+#endif  // CLS_TRANSLATION_UNIT_CACHE_HPP_INCLUDED
@@ -234,6 +234,44 @@ MIRRORPP_REFLECT(langsrv::DidOpenTextDocumentParams,
                 (textDocument)
                 );
 
+namespace langsrv { struct TextDocumentContentChangeEvent {
+    optional<Range> range;
+    optional<int> rangeLength;
+    string text;
+}; }
+
+MIRRORPP_REFLECT(langsrv::TextDocumentContentChangeEvent,
+                (range)
+                (rangeLength)
+                (text)
+                );
+
+namespace langsrv { struct DidChangeTextDocumentParams {
+    VersionedTextDocumentIdentifier textDocument;
+    vector<TextDocumentContentChangeEvent> contentChanges;
+}; }
+
+MIRRORPP_REFLECT(langsrv::DidChangeTextDocumentParams,
+                (textDocument)
+                (contentChanges)
+                );
+
+namespace langsrv { struct DidCloseTextDocumentParams {
+    TextDocumentIdentifier textDocument;
+}; }
+
+MIRRORPP_REFLECT(langsrv::DidCloseTextDocumentParams,
+                (textDocument)
+                );
+
+namespace langsrv { struct DidSaveTextDocumentParams {
+    TextDocumentIdentifier textDocument;
+}; }
+
+MIRRORPP_REFLECT(langsrv::DidSaveTextDocumentParams,
+                (textDocument)
+                );
+
 namespace langsrv { struct ShowMessageRequestParams {
     int type;
     string message;
@@ -254,6 +292,58 @@ MIRRORPP_REFLECT(langsrv::LogMessageParams,
                 (message)
                 );
 
+namespace langsrv { struct PublishDiagnosticsParams {
+    string uri;
+    vector<Diagnostic> diagnostics;
+}; }
+
+MIRRORPP_REFLECT(langsrv::PublishDiagnosticsParams,
+                (uri)
+                (diagnostics)
+                );
+
+namespace langsrv { struct ReferenceContext {
+    bool includeDeclaration;
+}; }
+
+MIRRORPP_REFLECT(langsrv::ReferenceContext,
+                (includeDeclaration)
+                );
+
+namespace langsrv { struct ReferenceParams {
+    TextDocumentIdentifier textDocument;
+    Position position;
+    ReferenceContext context;
+}; }
+
+MIRRORPP_REFLECT(langsrv::ReferenceParams,
+                (textDocument)
+                (position)
+                (context)
+                );
+
+namespace langsrv { struct WorkspaceSymbolParams {
+    string query;
+}; }
+
+MIRRORPP_REFLECT(langsrv::WorkspaceSymbolParams,
+                (query)
+                );
+
+namespace langsrv { struct SymbolInformation {
+    string name;
+    int kind;
+    Location location;
+    optional<string> containerName;
+}; }
+
+MIRRORPP_REFLECT(langsrv::SymbolInformation,
+                (name)
+                (kind)
+                (location)
+                (containerName)
+                );
+
 namespace langsrv { struct RenameParams {
     TextDocumentIdentifier textDocument;
     Position position;
@@ -302,6 +392,20 @@ MIRRORPP_REFLECT(cls::GetCompilationInfoResult,
                 (compilationInfo)
                 );
 
+namespace cls { struct InitializationOptions {
+    optional<int> astMemoryBudget;
+    optional<string> astSpillDirectory;
+    optional<int> parseJobs;
+    optional<string> indexPath;
+}; }
+
+MIRRORPP_REFLECT(cls::InitializationOptions,
+                (astMemoryBudget)
+                (astSpillDirectory)
+                (parseJobs)
+                (indexPath)
+                );
+
 namespace cls { struct GetCompilationDatabasePathResult {
     optional<string> filepath;
     optional<string> directory;
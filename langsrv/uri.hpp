@@ -0,0 +1,96 @@
+#ifndef CLS_URI_HPP_INCLUDED
+#define CLS_URI_HPP_INCLUDED
+
+#include <cctype>
+#include <string>
+#include <vector>
+
+namespace cls {
+
+/// Convert a file:// URI from the client to a local path
+inline std::string uriToPath(const std::string& uri) {
+    static const std::string scheme = "file://";
+    if (uri.compare(0, scheme.size(), scheme) != 0)
+        return uri;
+    std::string ret;
+    ret.reserve(uri.size() - scheme.size());
+    for (auto i = scheme.size(); i < uri.size(); ++i) {
+        if (uri[i] == '%' && i + 2 < uri.size() && std::isxdigit(static_cast<unsigned char>(uri[i + 1]))
+            && std::isxdigit(static_cast<unsigned char>(uri[i + 2]))) {
+            ret.push_back(static_cast<char>(std::stoi(uri.substr(i + 1, 2), nullptr, 16)));
+            i += 2;
+        } else {
+            ret.push_back(uri[i]);
+        }
+    }
+#ifdef _WIN32
+    // file:///C:/foo
+    if (ret.size() > 2 && ret[0] == '/' && ret[2] == ':')
+        ret.erase(0, 1);
+#endif
+    return ret;
+}
+
+/// Convert a local path to a file:// URI for the client
+inline std::string pathToUri(const std::string& path) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string ret = "file://";
+#ifdef _WIN32
+    ret.push_back('/');
+#endif
+    for (const auto ch : path) {
+        const auto c = static_cast<unsigned char>(ch);
+        if (std::isalnum(c) || c == '/' || c == '-' || c == '_' || c == '.' || c == '~'
+#ifdef _WIN32
+            || c == ':'
+#endif
+            ) {
+            ret.push_back(ch);
+        } else if (c == '\\') {
+            ret.push_back('/');
+        } else {
+            ret.push_back('%');
+            ret.push_back(hex[c >> 4]);
+            ret.push_back(hex[c & 0xF]);
+        }
+    }
+    return ret;
+}
+
+/// Resolve `path` against `directory` and remove `.` and `..` components, so
+/// that different spellings of a path compare equal
+inline std::string normalizePath(const std::string& path, const std::string& directory) {
+    const auto is_absolute =
+        !path.empty() && (path[0] == '/' || (path.size() > 1 && path[1] == ':'));
+    const auto absolute = is_absolute || directory.empty()
+        ? path
+        : directory + "/" + path;
+    std::vector<std::string> parts;
+    std::size_t start = 0;
+    while (start <= absolute.size()) {
+        auto end = absolute.find('/', start);
+        if (end == std::string::npos) {
+            end = absolute.size();
+        }
+        const auto part = absolute.substr(start, end - start);
+        if (part == "..") {
+            if (!parts.empty() && !parts.back().empty()) {
+                parts.pop_back();
+            }
+        } else if (part != "." && (part != "" || parts.empty())) {
+            parts.push_back(part);
+        }
+        start = end + 1;
+    }
+    std::string ret;
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        if (i != 0) {
+            ret += '/';
+        }
+        ret += parts[i];
+    }
+    return ret;
+}
+}
+
+#endif  // CLS_URI_HPP_INCLUDED
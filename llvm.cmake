@@ -7,7 +7,7 @@ set(LLVM_MD5 c5750e5563b162013ae52b7dd0ad54d3)
 set(CLANG_URL "https://github.com/llvm-mirror/clang/archive/${LLVM_BRANCH}.zip")
 set(CLANG_MD5 1c19129ec64b48c0e371e34b3de4416c)
 
-foreach(target IN ITEMS clangTooling clangASTMatchers clangFormat clangFrontend
+foreach(target IN ITEMS libclang clangIndex clangTooling clangASTMatchers clangFormat clangFrontend
                         clangDriver clangParse clangSerialization LLVMMCParser
                         LLVMOption clangSema clangAnalysis LLVMBitReader
                         LLVMProfileData clangAST clangRewrite clangLex clangEdit
@@ -74,7 +74,8 @@ if(NOT TARGET clangTooling OR NOT LLVM_FOUND)
     message(WARNING "Failed to find LibTooling. You probably don't have it installed properly. Build the 'LLVM' target and reconfigure.")
 else()
     add_library(clang::libTooling INTERFACE IMPORTED)
-    set_property(TARGET clang::libTooling APPEND PROPERTY INTERFACE_LINK_LIBRARIES clangTooling)
+    # clangIndex provides USR generation
+    set_property(TARGET clang::libTooling APPEND PROPERTY INTERFACE_LINK_LIBRARIES clangTooling clangIndex)
     set_property(TARGET clang::libTooling
         APPEND PROPERTY INTERFACE_INCLUDE_DIRECTORIES
             "${llvm_extern}/include"
@@ -84,3 +85,15 @@ else()
             # "${CMAKE_CURRENT_BINARY_DIR}/LLVM-prefix/src/LLVM/tools/clang/include"
         )
 endif()
+
+if(TARGET libclang)
+    add_library(clang::libclang INTERFACE IMPORTED)
+    set_property(TARGET clang::libclang APPEND PROPERTY INTERFACE_LINK_LIBRARIES libclang)
+    set_property(TARGET clang::libclang
+        APPEND PROPERTY INTERFACE_INCLUDE_DIRECTORIES
+            "${llvm_extern}/include"
+            "${LLVM_DIR}/../../../include"
+            # The header-only C++ wrapper
+            "${CMAKE_CURRENT_LIST_DIR}/extern/clangxx"
+        )
+endif()
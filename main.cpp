@@ -37,8 +37,13 @@ int main(int, char**) {
     using nlohmann::json;
     using std::string;
     cls::LanguageService service(server);
-    server.run([&service, &server](std::string method, nlohmann::json params) {
-        return service.dispatchMethod(method, params);
+    json_rpc::server_options options;
+    options.ordering_key = &cls::LanguageService::orderingKey;
+    server.configure(options);
+    server.run([&service](const std::string& method,
+                          const json_rpc::params_view& params,
+                          const json_rpc::cancellation_token& cancel) {
+        return service.dispatchMethod(method, params, cancel);
     });
     return 0;
 }
@@ -0,0 +1,232 @@
+#define BOOST_TEST_MODULE CrossReferenceIndexTests
+#include <boost/test/included/unit_test.hpp>
+
+#include <langsrv/cross_reference_index.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include <tuple>
+
+using namespace cls;
+
+namespace {
+
+const std::vector<OccurrenceRole> allRoles{ OccurrenceRole::Reference,
+                                            OccurrenceRole::Declaration,
+                                            OccurrenceRole::Definition };
+
+/// An index in the working directory, removed before and after the test
+struct IndexFiles {
+    std::string path;
+
+    explicit IndexFiles(const std::string& name)
+        : path(name + ".cls-index") {
+        remove();
+    }
+    ~IndexFiles() { remove(); }
+
+    /// The segments the manifest lists
+    std::vector<std::string> segments() const {
+        std::vector<std::string> ret;
+        std::ifstream in{ path };
+        std::string magic, version, next, id;
+        in >> magic >> version >> next;
+        while (in >> id)
+            ret.push_back(path + "." + id);
+        return ret;
+    }
+
+    void remove() const {
+        for (const auto& segment : segments())
+            std::remove(segment.c_str());
+        std::remove(path.c_str());
+    }
+};
+
+IndexedUnit makeUnit(std::mt19937& rng, const std::string& file, int usrs) {
+    IndexedUnit unit;
+    unit.file = file;
+    unit.commandHash = rng();
+    unit.dependencies.push_back({ file, rng(), true });
+    unit.files = { file, "/include/common.h" };
+    const auto symbols = 1 + rng() % 8;
+    for (std::size_t i = 0; i < symbols; ++i) {
+        IndexedSymbol symbol;
+        symbol.usr = "c:@S@" + std::to_string(rng() % usrs);
+        symbol.name = "n" + symbol.usr;
+        symbol.qualifiedName = "ns::n" + symbol.usr;
+        symbol.kind = 5;
+        unit.symbols.push_back(symbol);
+    }
+    const auto occurrences = rng() % 16;
+    for (std::size_t i = 0; i < occurrences; ++i) {
+        IndexedOccurrence occurrence;
+        occurrence.symbol = static_cast<std::uint32_t>(rng() % symbols);
+        occurrence.file = static_cast<std::uint32_t>(rng() % 2);
+        occurrence.range.start = { static_cast<int>(rng() % 500), static_cast<int>(rng() % 80) };
+        occurrence.range.end = occurrence.range.start;
+        occurrence.role = allRoles[rng() % 3];
+        unit.occurrences.push_back(occurrence);
+    }
+    return unit;
+}
+
+using Place = std::tuple<std::string, int, int, int>;
+using Model = std::map<std::string, IndexedUnit>;
+
+std::set<Place> expectedOccurrences(const Model& model, const std::string& usr) {
+    std::set<Place> ret;
+    for (const auto& pair : model) {
+        const auto& unit = pair.second;
+        for (const auto& occurrence : unit.occurrences) {
+            if (unit.symbols[occurrence.symbol].usr == usr) {
+                ret.emplace(unit.files[occurrence.file],
+                            occurrence.range.start.line,
+                            occurrence.range.start.character,
+                            static_cast<int>(occurrence.role));
+            }
+        }
+    }
+    return ret;
+}
+
+/// Check everything the index answers against what was put in it
+void checkAgainst(const CrossReferenceIndex& index, const Model& model, int usrs) {
+    const auto units = index.units();
+    std::set<std::string> expectedUnits;
+    std::set<std::string> expectedSymbols;
+    for (const auto& pair : model) {
+        expectedUnits.insert(pair.first);
+        for (const auto& occurrence : pair.second.occurrences)
+            expectedSymbols.insert(pair.second.symbols[occurrence.symbol].usr);
+    }
+    BOOST_REQUIRE_EQUAL(units.size(), expectedUnits.size());
+    BOOST_REQUIRE(std::set<std::string>(units.begin(), units.end()) == expectedUnits);
+    BOOST_REQUIRE_EQUAL(index.unitCount(), expectedUnits.size());
+
+    std::set<std::string> symbols;
+    index.forEachSymbol([&](const IndexedSymbol& symbol) {
+        BOOST_REQUIRE(symbols.insert(symbol.usr).second);
+        BOOST_REQUIRE_EQUAL(symbol.name, "n" + symbol.usr);
+        // The definition and declaration are among its occurrences
+        const auto places = expectedOccurrences(model, symbol.usr);
+        for (const auto& location : { symbol.definition, symbol.declaration }) {
+            if (!location)
+                continue;
+            BOOST_REQUIRE(places.count(Place{ location->file,
+                                              location->range.start.line,
+                                              location->range.start.character,
+                                              static_cast<int>(location->role) }));
+        }
+    });
+    BOOST_REQUIRE(symbols == expectedSymbols);
+
+    for (int i = 0; i < usrs; ++i) {
+        const auto usr = "c:@S@" + std::to_string(i);
+        std::set<Place> found;
+        for (const auto& location : index.occurrences(usr, allRoles)) {
+            BOOST_REQUIRE(model.count(location.unit));
+            found.emplace(location.file,
+                          location.range.start.line,
+                          location.range.start.character,
+                          static_cast<int>(location.role));
+        }
+        BOOST_REQUIRE(found == expectedOccurrences(model, usr));
+        BOOST_REQUIRE_EQUAL(!!index.symbol(usr), !!expectedSymbols.count(usr));
+    }
+}
+}
+
+BOOST_AUTO_TEST_CASE(UpdatesMatchModel) {
+    const IndexFiles files{ "updates-match-model" };
+    std::mt19937 rng{ 7 };
+    const int usrs = 100;
+    Model model;
+    auto index = std::make_unique<CrossReferenceIndex>(files.path);
+    for (int step = 0; step < 200; ++step) {
+        // The indexer never passes the same unit twice in one update
+        Model batch;
+        const auto count = rng() % 4;
+        for (std::size_t i = 0; i < count; ++i) {
+            const auto file = "/src/" + std::to_string(rng() % 40) + ".cpp";
+            batch[file] = makeUnit(rng, file, usrs);
+        }
+        std::vector<std::string> removed;
+        if (rng() % 3 == 0) {
+            const auto file = "/src/" + std::to_string(rng() % 40) + ".cpp";
+            if (!batch.count(file)) {
+                removed.push_back(file);
+                model.erase(file);
+            }
+        }
+        std::vector<IndexedUnit> units;
+        for (const auto& pair : batch) {
+            units.push_back(pair.second);
+            model[pair.first] = pair.second;
+        }
+        index->update(units, removed);
+        checkAgainst(*index, model, usrs);
+
+        if (step % 40 == 39) {
+            // What was written is all there is: reopen from the manifest
+            index.reset();
+            index = std::make_unique<CrossReferenceIndex>(files.path);
+            checkAgainst(*index, model, usrs);
+        }
+    }
+    // Merging keeps the number of segments down to about the log of the
+    // number of updates
+    BOOST_CHECK_LE(files.segments().size(), 16u);
+}
+
+BOOST_AUTO_TEST_CASE(RemovedUnitsStayRemoved) {
+    const IndexFiles files{ "removed-units-stay-removed" };
+    std::mt19937 rng{ 11 };
+    auto a = makeUnit(rng, "/src/a.cpp", 10);
+    auto b = makeUnit(rng, "/src/b.cpp", 10);
+    {
+        CrossReferenceIndex index{ files.path };
+        index.update({ a, b });
+        index.update({}, { a.file });
+        const auto units = index.units();
+        BOOST_REQUIRE_EQUAL(units.size(), 1u);
+        BOOST_CHECK_EQUAL(units[0], b.file);
+    }
+    // The record of the removal hides the unit after reopening too, and
+    // indexing it again brings it back
+    CrossReferenceIndex index{ files.path };
+    BOOST_CHECK_EQUAL(index.unitCount(), 1u);
+    Model model{ { b.file, b } };
+    checkAgainst(index, model, 10);
+    index.update({ a });
+    model[a.file] = a;
+    checkAgainst(index, model, 10);
+}
+
+BOOST_AUTO_TEST_CASE(GenerationCountsChanges) {
+    const IndexFiles files{ "generation-counts-changes" };
+    std::mt19937 rng{ 3 };
+    CrossReferenceIndex index{ files.path };
+    const auto before = index.generation();
+    index.update({ makeUnit(rng, "/src/a.cpp", 10) });
+    BOOST_CHECK_GT(index.generation(), before);
+}
+
+BOOST_AUTO_TEST_CASE(UnreadableManifestStartsOver) {
+    const IndexFiles files{ "unreadable-manifest-starts-over" };
+    {
+        std::ofstream out{ files.path };
+        out << "not an index";
+    }
+    std::mt19937 rng{ 5 };
+    CrossReferenceIndex index{ files.path };
+    BOOST_CHECK_EQUAL(index.unitCount(), 0u);
+    const auto unit = makeUnit(rng, "/src/a.cpp", 10);
+    index.update({ unit });
+    checkAgainst(index, Model{ { unit.file, unit } }, 10);
+}
@@ -0,0 +1,135 @@
+#define BOOST_TEST_MODULE DocumentStoreTests
+#include <boost/test/included/unit_test.hpp>
+
+#include <langsrv/document_store.hpp>
+
+#include <algorithm>
+#include <random>
+#include <string>
+
+using namespace cls;
+
+namespace {
+
+/// The byte offset of an LSP position, found by walking the text from the
+/// start. Characters outside the BMP take two UTF-16 code units
+std::size_t naiveOffset(const std::string& text, const langsrv::Position& pos) {
+    std::size_t i = 0;
+    for (int line = 0; line < pos.line; ++line) {
+        const auto newline = text.find('\n', i);
+        if (newline == std::string::npos)
+            return text.size();
+        i = newline + 1;
+    }
+    for (int units = pos.character; units > 0 && i < text.size() && text[i] != '\n';) {
+        const auto c = static_cast<unsigned char>(text[i]);
+        const std::size_t length = c < 0xC0 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        i = std::min(i + length, text.size());
+        units -= std::min(length == 4 ? 2 : 1, units);
+    }
+    return i;
+}
+
+langsrv::TextDocumentContentChangeEvent edit(langsrv::Position start,
+                                             langsrv::Position end,
+                                             std::string text) {
+    langsrv::TextDocumentContentChangeEvent ret;
+    ret.range = langsrv::Range{ start, end };
+    ret.text = std::move(text);
+    return ret;
+}
+
+langsrv::DidChangeTextDocumentParams change(const std::string& uri,
+                                            int version,
+                                            langsrv::TextDocumentContentChangeEvent event) {
+    langsrv::DidChangeTextDocumentParams ret;
+    ret.textDocument.uri = uri;
+    ret.textDocument.version = version;
+    ret.contentChanges.push_back(std::move(event));
+    return ret;
+}
+}
+
+BOOST_AUTO_TEST_CASE(RandomEditsMatchString) {
+    std::mt19937 rng{ 42 };
+    std::string expected = "hello\nworld\n\xc3\xa9t\xc3\xa9\nend";
+    Document doc{ 1, expected };
+    const char* inserts[] = { "a", "bc\n", "\n", "xyz", "\xf0\x9f\x98\x80", "" };
+    // Enough insertions to flatten the document more than once
+    for (int i = 0; i < 50000; ++i) {
+        const auto lines = static_cast<int>(std::count(expected.begin(), expected.end(), '\n'));
+        const langsrv::Position start{ static_cast<int>(rng() % (lines + 2)),
+                                       static_cast<int>(rng() % 8) };
+        const langsrv::Position end{ start.line + static_cast<int>(rng() % 2),
+                                     static_cast<int>(rng() % 8) };
+        BOOST_REQUIRE_EQUAL(doc.offsetAt(start), naiveOffset(expected, start));
+        auto first = naiveOffset(expected, start);
+        auto last = naiveOffset(expected, end);
+        if (last < first)
+            std::swap(first, last);
+        const std::string text = inserts[rng() % 6];
+        doc.applyChange(edit(start, end, text));
+        expected.replace(first, last - first, text);
+        BOOST_REQUIRE_EQUAL(doc.size(), expected.size());
+        if (i % 97 == 0)
+            BOOST_REQUIRE_EQUAL(*doc.text(), expected);
+    }
+    BOOST_CHECK_EQUAL(*doc.text(), expected);
+}
+
+BOOST_AUTO_TEST_CASE(ChangeWithoutRangeReplacesText) {
+    Document doc{ 1, "one\ntwo\n" };
+    langsrv::TextDocumentContentChangeEvent whole;
+    whole.text = "three";
+    doc.applyChange(whole);
+    BOOST_CHECK_EQUAL(*doc.text(), "three");
+    BOOST_CHECK_EQUAL(doc.offsetAt({ 0, 99 }), 5u);
+    BOOST_CHECK_EQUAL(doc.offsetAt({ 7, 0 }), 5u);
+}
+
+BOOST_AUTO_TEST_CASE(TextIsSharedUntilChanged) {
+    Document doc{ 1, "abc" };
+    const auto before = doc.text();
+    BOOST_CHECK(doc.text() == before);
+    doc.applyChange(edit({ 0, 1 }, { 0, 2 }, "X"));
+    BOOST_CHECK_EQUAL(*before, "abc");
+    BOOST_CHECK_EQUAL(*doc.text(), "aXc");
+}
+
+BOOST_AUTO_TEST_CASE(PositionsAtMatchOffsets) {
+    const std::string text = "a\xf0\x9f\x98\x80" "b\nxy\n";
+    const auto positions = positionsAt(text, { 0, 1, 5, 6, 7, 9, 100 });
+    const std::vector<std::pair<int, int>> expected{ { 0, 0 }, { 0, 1 }, { 0, 3 }, { 0, 4 },
+                                                     { 1, 0 }, { 1, 2 }, { 2, 0 } };
+    BOOST_REQUIRE_EQUAL(positions.size(), expected.size());
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        BOOST_CHECK_EQUAL(positions[i].line, expected[i].first);
+        BOOST_CHECK_EQUAL(positions[i].character, expected[i].second);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(StoreTracksVersions) {
+    DocumentStore store;
+    const std::string uri = "file:///a.cpp";
+    BOOST_CHECK(!store.change(change(uri, 2, edit({ 0, 0 }, { 0, 0 }, "x"))));
+
+    langsrv::TextDocumentItem item;
+    item.uri = uri;
+    item.version = 1;
+    item.text = "int x;\n";
+    store.open(item);
+    const auto opened = store.snapshot(uri);
+    BOOST_REQUIRE(opened);
+    BOOST_CHECK_EQUAL(opened->version, 1);
+
+    BOOST_CHECK(store.change(change(uri, 2, edit({ 0, 4 }, { 0, 5 }, "y"))));
+    BOOST_CHECK_EQUAL(*store.version(uri), 2);
+    BOOST_CHECK_EQUAL(*store.snapshot(uri)->text, "int y;\n");
+    // A snapshot taken before the change keeps the text it had
+    BOOST_CHECK_EQUAL(*opened->text, "int x;\n");
+    BOOST_CHECK_EQUAL(store.snapshots().size(), 1u);
+
+    store.close(uri);
+    BOOST_CHECK(!store.isOpen(uri));
+    BOOST_CHECK(!store.snapshot(uri));
+}
@@ -0,0 +1,126 @@
+#define BOOST_TEST_MODULE JsonReaderTests
+#include <boost/test/included/unit_test.hpp>
+
+#include <json_rpc/serialize.hpp>
+
+#include <mirror/mirror.hpp>
+
+#include <string>
+#include <vector>
+
+namespace test {
+
+struct Inner {
+    int number;
+    std::string text;
+};
+
+struct Outer {
+    Inner inner;
+    std::vector<int> numbers;
+    boost::optional<std::string> maybe;
+    bool flag;
+};
+}
+
+MIRRORPP_REFLECT(test::Inner, (number)(text));
+MIRRORPP_REFLECT(test::Outer, (inner)(numbers)(maybe)(flag));
+
+using json_rpc::json_reader;
+
+namespace {
+
+template <typename T> T read(const std::string& text) {
+    json_reader reader{ text.data(), text.data() + text.size() };
+    auto ret = json_rpc::read_json<T>(reader);
+    reader.expect_end();
+    return ret;
+}
+
+/// The code of the error reading `text` as a T throws
+template <typename T> int errorReading(const std::string& text) {
+    try {
+        read<T>(text);
+    } catch (const json_rpc::error& e) {
+        return e.code();
+    }
+    return 0;
+}
+}
+
+BOOST_AUTO_TEST_CASE(ReadsEveryMember) {
+    const auto outer = read<test::Outer>(
+        R"({"inner": {"number": -12, "text": "a\"bé"}, "numbers": [1, 2, 3],
+            "maybe": "here", "flag": true})");
+    BOOST_CHECK_EQUAL(outer.inner.number, -12);
+    BOOST_CHECK_EQUAL(outer.inner.text, "a\"b\xc3\xa9");
+    BOOST_CHECK(outer.numbers == (std::vector<int>{ 1, 2, 3 }));
+    BOOST_REQUIRE(outer.maybe);
+    BOOST_CHECK_EQUAL(*outer.maybe, "here");
+    BOOST_CHECK(outer.flag);
+}
+
+BOOST_AUTO_TEST_CASE(MissingMembersAreValueInitialized) {
+    const auto outer = read<test::Outer>(R"({"inner": {"text": "x"}})");
+    BOOST_CHECK_EQUAL(outer.inner.number, 0);
+    BOOST_CHECK_EQUAL(outer.inner.text, "x");
+    BOOST_CHECK(outer.numbers.empty());
+    BOOST_CHECK(!outer.maybe);
+    BOOST_CHECK(!outer.flag);
+
+    BOOST_CHECK(!read<test::Outer>(R"({"maybe": null})").maybe);
+}
+
+BOOST_AUTO_TEST_CASE(UnknownMembersAreSkipped) {
+    const auto inner = read<test::Inner>(
+        R"({"before": {"deep": [1, {"x": null}, "s"]}, "number": 7,
+            "after": [true, false, 1.5e3], "text": "t"})");
+    BOOST_CHECK_EQUAL(inner.number, 7);
+    BOOST_CHECK_EQUAL(inner.text, "t");
+}
+
+BOOST_AUTO_TEST_CASE(MatchesTheDom) {
+    const std::string text = R"({"inner": {"number": 3, "text": "😀"}, "flag": false,
+                                 "numbers": [], "unknown": {}})";
+    const auto streamed = read<test::Outer>(text);
+    const auto loaded = json_rpc::from_json<test::Outer>(nlohmann::json::parse(text));
+    BOOST_CHECK_EQUAL(streamed.inner.number, loaded.inner.number);
+    BOOST_CHECK_EQUAL(streamed.inner.text, loaded.inner.text);
+    BOOST_CHECK_EQUAL(streamed.inner.text, "\xf0\x9f\x98\x80");
+    BOOST_CHECK_EQUAL(streamed.flag, loaded.flag);
+}
+
+BOOST_AUTO_TEST_CASE(WrongTypesAreInvalidParams) {
+    using json_rpc::error_code::invalid_params;
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({"number": "7"})"), invalid_params);
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({"number": 1.5})"), invalid_params);
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({"number": 4294967296})"), invalid_params);
+    BOOST_CHECK_EQUAL(errorReading<test::Outer>(R"({"numbers": {}})"), invalid_params);
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"([])"), invalid_params);
+}
+
+BOOST_AUTO_TEST_CASE(MalformedInputIsParseError) {
+    using json_rpc::error_code::parse_error;
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({"number": 1)"), parse_error);
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({"number" 1})"), parse_error);
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({"text": "\x"})"), parse_error);
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({"text": "\ud83d"})"), parse_error);
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({"skipped": [1,]})"), parse_error);
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(R"({} {})"), parse_error);
+    const auto tooDeep = R"({"deep": )" + std::string(1000, '[');
+    BOOST_CHECK_EQUAL(errorReading<test::Inner>(tooDeep), parse_error);
+}
+
+BOOST_AUTO_TEST_CASE(RawValuesCoverTheirInput) {
+    const std::string text = R"( [ {"a": [1, 2]}, "s" ] )";
+    json_reader reader{ text.data(), text.data() + text.size() };
+    reader.begin_array();
+    BOOST_REQUIRE(reader.next_element());
+    const auto first = reader.raw_value();
+    BOOST_CHECK_EQUAL(std::string(first.first, first.second), R"({"a": [1, 2]})");
+    BOOST_REQUIRE(reader.next_element());
+    BOOST_CHECK(reader.peek() == json_reader::token::string);
+    BOOST_CHECK_EQUAL(reader.read_string(), "s");
+    BOOST_CHECK(!reader.next_element());
+    reader.expect_end();
+}
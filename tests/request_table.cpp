@@ -0,0 +1,77 @@
+#define BOOST_TEST_MODULE RequestTableTests
+#include <boost/test/included/unit_test.hpp>
+
+#include <json_rpc/request_table.hpp>
+
+#include <chrono>
+
+using json_rpc::request_table;
+using nlohmann::json;
+
+namespace {
+
+const auto later = request_table::clock::now() + std::chrono::hours(1);
+}
+
+BOOST_AUTO_TEST_CASE(TakeCompletesOnce) {
+    request_table table{ 4 };
+    boost::future<json> fut;
+    const auto id = table.add(fut, later);
+    BOOST_REQUIRE(id);
+    auto prom = table.take(*id);
+    BOOST_REQUIRE(prom);
+    prom->set_value(json(42));
+    BOOST_CHECK_EQUAL(fut.get(), json(42));
+    BOOST_CHECK(!table.take(*id));
+}
+
+BOOST_AUTO_TEST_CASE(FullTableRefuses) {
+    request_table table{ 2 };
+    boost::future<json> a, b, c;
+    BOOST_CHECK(table.add(a, later));
+    BOOST_CHECK(table.add(b, later));
+    BOOST_CHECK(!table.add(c, later));
+}
+
+BOOST_AUTO_TEST_CASE(ReusedSlotGetsNewId) {
+    // A single slot, so every request reuses it
+    request_table table{ 1 };
+    boost::future<json> fut;
+    const auto first = table.add(fut, later);
+    BOOST_REQUIRE(first);
+    BOOST_REQUIRE(table.take(*first));
+
+    const auto second = table.add(fut, later);
+    BOOST_REQUIRE(second);
+    BOOST_CHECK_NE(*first, *second);
+    // A late response to the first request must not complete the second
+    BOOST_CHECK(!table.take(*first));
+    BOOST_CHECK(table.take(*second));
+}
+
+BOOST_AUTO_TEST_CASE(OutOfRangeGenerationIsRejected) {
+    request_table table{ 1 };
+    boost::future<json> fut;
+    const auto id = table.add(fut, later);
+    BOOST_REQUIRE(id);
+    // Both have the generation of `id` in their low bits
+    BOOST_CHECK(!table.take(*id | (request_table::id_type{ 1 } << 32)));
+    BOOST_CHECK(!table.take(*id | (request_table::id_type{ 1 } << 30)));
+    BOOST_CHECK(table.take(*id));
+}
+
+BOOST_AUTO_TEST_CASE(ExpireFailsOverdueRequests) {
+    request_table table{ 4 };
+    const auto now = request_table::clock::now();
+    boost::future<json> overdue, pending;
+    const auto overdueId = table.add(overdue, now - std::chrono::seconds(1));
+    const auto pendingId = table.add(pending, now + std::chrono::hours(1));
+    BOOST_REQUIRE(overdueId && pendingId);
+
+    table.expire(now);
+    BOOST_REQUIRE(overdue.is_ready());
+    BOOST_CHECK_THROW(overdue.get(), json_rpc::error);
+    BOOST_CHECK(!pending.is_ready());
+    BOOST_CHECK(!table.take(*overdueId));
+    BOOST_CHECK(table.take(*pendingId));
+}
@@ -0,0 +1,142 @@
+#define BOOST_TEST_MODULE SymbolSearchTests
+#include <boost/test/included/unit_test.hpp>
+
+#include <langsrv/symbol_search.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <thread>
+
+using namespace cls;
+
+namespace {
+
+/// An index of symbols, each defined at its own line of one file
+class Fixture {
+    std::string _path;
+
+public:
+    std::shared_ptr<CrossReferenceIndex> index;
+    SymbolSearch search{ std::chrono::seconds(0) };
+
+    Fixture(const std::string& name,
+            const std::vector<std::pair<std::string, std::string>>& qualifiedNames)
+        : _path(name + ".cls-index") {
+        _remove();
+        index = std::make_shared<CrossReferenceIndex>(_path);
+        IndexedUnit unit;
+        unit.file = "/src/a.cpp";
+        unit.files = { unit.file };
+        for (const auto& pair : qualifiedNames) {
+            IndexedSymbol symbol;
+            symbol.usr = "c:@" + pair.first;
+            symbol.qualifiedName = pair.first;
+            symbol.name = pair.second;
+            symbol.kind = 12;
+            IndexedOccurrence occurrence;
+            occurrence.symbol = static_cast<std::uint32_t>(unit.symbols.size());
+            occurrence.file = 0;
+            const auto line = static_cast<int>(occurrence.symbol);
+            occurrence.range.start = { line, 0 };
+            occurrence.range.end = { line, 1 };
+            occurrence.role = OccurrenceRole::Definition;
+            unit.symbols.push_back(symbol);
+            unit.occurrences.push_back(occurrence);
+        }
+        index->update({ unit });
+        // Searches find nothing until the snapshot is built. An empty query
+        // matches everything
+        for (int i = 0; i < 1000 && search.search(index, "", 1).empty(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    ~Fixture() {
+        index.reset();
+        _remove();
+    }
+
+    /// The qualified names of the matches for `query`, best first
+    std::vector<std::string> find(const std::string& query, std::size_t limit = 100) {
+        std::vector<std::string> ret;
+        for (const auto& match : search.search(index, query, limit))
+            ret.push_back(match.symbol.qualifiedName);
+        return ret;
+    }
+
+private:
+    void _remove() const {
+        std::ifstream in{ _path };
+        std::string magic, version, next, id;
+        in >> magic >> version >> next;
+        while (in >> id)
+            std::remove((_path + "." + id).c_str());
+        in.close();
+        std::remove(_path.c_str());
+    }
+};
+
+using Names = std::vector<std::string>;
+}
+
+BOOST_AUTO_TEST_CASE(BetterMatchesComeFirst) {
+    Fixture f{ "better-matches-come-first",
+               { { "cls::LanguageService", "LanguageService" },
+                 { "langsrv", "langsrv" },
+                 { "launchServer", "launchServer" },
+                 { "lan", "lan" },
+                 { "Lan", "Lan" },
+                 { "planServer", "planServer" } } };
+    // Exact matches, the one with the same case first, then prefixes, then
+    // word starts
+    const auto found = f.find("lan");
+    BOOST_REQUIRE_GE(found.size(), 4u);
+    BOOST_CHECK_EQUAL(found[0], "lan");
+    BOOST_CHECK_EQUAL(found[1], "Lan");
+    BOOST_CHECK_EQUAL(found[2], "langsrv");
+
+    // Word starts let an abbreviation find a name, ahead of names it only
+    // matches in the middle of words
+    const auto abbreviated = f.find("lanser");
+    BOOST_REQUIRE_EQUAL(abbreviated.size(), 2u);
+    BOOST_CHECK_EQUAL(abbreviated[0], "cls::LanguageService");
+    BOOST_CHECK_EQUAL(abbreviated[1], "planServer");
+    BOOST_CHECK(f.find("xyz").empty());
+}
+
+BOOST_AUTO_TEST_CASE(ShortQueriesMatchPrefixes) {
+    Fixture f{ "short-queries-match-prefixes",
+               { { "abc", "abc" }, { "xab", "xab" }, { "b", "b" } } };
+    BOOST_CHECK(f.find("a") == (Names{ "abc" }));
+    BOOST_CHECK(f.find("ab") == (Names{ "abc" }));
+}
+
+BOOST_AUTO_TEST_CASE(LimitKeepsTheBest) {
+    std::vector<std::pair<std::string, std::string>> names;
+    for (int i = 0; i < 50; ++i) {
+        const auto name = "value" + std::string(static_cast<std::size_t>(i), 'x');
+        names.emplace_back(name, name);
+    }
+    Fixture f{ "limit-keeps-the-best", names };
+    const auto all = f.find("value");
+    BOOST_REQUIRE_EQUAL(all.size(), 50u);
+    BOOST_CHECK_EQUAL(all.front(), "value");
+    const auto best = f.find("value", 5);
+    BOOST_REQUIRE_EQUAL(best.size(), 5u);
+    BOOST_CHECK(std::equal(best.begin(), best.end(), all.begin()));
+    BOOST_CHECK(f.find("value", 0).empty());
+}
+
+BOOST_AUTO_TEST_CASE(QualifierNarrowsScopes) {
+    Fixture f{ "qualifier-narrows-scopes",
+               { { "std::vector", "vector" },
+                 { "boost::container::vector", "vector" },
+                 { "std::map", "map" },
+                 { "vector", "vector" } } };
+    BOOST_CHECK_EQUAL(f.find("vector").size(), 3u);
+    BOOST_CHECK(f.find("std::vec") == (Names{ "std::vector" }));
+    BOOST_CHECK(f.find("cont::vector") == (Names{ "boost::container::vector" }));
+    BOOST_CHECK_EQUAL(f.find("std::").size(), 2u);
+    BOOST_CHECK(f.find("nope::vector").empty());
+}